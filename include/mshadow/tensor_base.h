@@ -11,6 +11,7 @@
 #include <cfloat>
 #include <climits>
 #include <algorithm>
+#include <functional>
 // macro defintiions
 
 /*!\brief if this macro is define to be 1, mshadow should compile without any of other libs */
@@ -121,6 +122,54 @@ namespace mshadow {
 #endif
     /*! \brief type that will be used for index */
     typedef unsigned index_t;
+
+    /*!
+     * \brief function that runs func(begin, end) on disjoint chunks covering
+     *        [0, n) in parallel and returns after all chunks are done
+     */
+    typedef std::function< void( index_t n, const std::function<void(index_t,index_t)> &func ) > ParallelForFunc;
+    /*!
+     * \brief parallel loop used by CPU mapping and reduction of large tensors,
+     *        empty by default, i.e., they run on the calling thread;
+     *        the host program can set it to run loops on its thread pool
+     */
+    inline ParallelForFunc &CPUParallelFor( void ){
+        static ParallelForFunc func;
+        return func;
+    }
+    /*! \brief tensors with fewer elements are mapped on the calling thread */
+    const size_t kMinParallelSize = 1 << 15;
+    /*! \brief num of columns of a row mapped by one parallel task, multiple of the SSE width */
+    const index_t kParallelBlock = 4096;
+    /*!
+     * \brief run func( begin, end ) on chunks covering [0, n), by CPUParallelFor
+     *        if the loop visits at least kMinParallelSize elements in total
+     * \param work num of elements visited by the whole loop
+     */
+    template<typename F>
+    inline void ParallelRange( index_t n, size_t work, const F &func ){
+        const ParallelForFunc &pfor = CPUParallelFor();
+        if( !pfor || n < 2 || work < kMinParallelSize ){
+            func( 0, n );
+        }else{
+            pfor( n, func );
+        }
+    }
+    /*!
+     * \brief run func( y, xbegin, xend ) on blocks covering rows [0, nrow) and
+     *        columns [0, ncol); rows are cut into blocks of kParallelBlock
+     *        columns so that single-row tensors are split too
+     */
+    template<typename F>
+    inline void ParallelMapBlocks( index_t nrow, index_t ncol, const F &func ){
+        const index_t nblock = ( ncol + kParallelBlock - 1 ) / kParallelBlock;
+        ParallelRange( nrow * nblock, static_cast<size_t>( nrow ) * ncol, [&]( index_t begin, index_t end ){
+            for( index_t t = begin; t < end; ++t ){
+                const index_t x = ( t % nblock ) * kParallelBlock;
+                func( t / nblock, x, std::min( x + kParallelBlock, ncol ) );
+            }
+        });
+    }
 }; // namespace mshadow
 
 namespace mshadow {
@@ -51,12 +51,12 @@ namespace mshadow {
     template<typename Saver, typename E, int dim>
     inline void MapPlan(Tensor<cpu,dim> _dst, const expr::Plan<E> &plan){
         Tensor<cpu,2> dst = _dst.FlatTo2D();
-        for (index_t y = 0; y < dst.shape[1]; ++y ) {
-            for (index_t x = 0; x < dst.shape[0]; ++x ) {
+        ParallelMapBlocks( dst.shape[1], dst.shape[0], [&]( index_t y, index_t xbegin, index_t xend ){
+            for (index_t x = xbegin; x < xend; ++x ) {
                 // trust your compiler! -_- they will optimize it
                 Saver::Save(dst[y][x], plan.Eval( y, x ) );
             }
-        }
+        });
     }
 
     // code to handle SSE optimization
@@ -106,13 +106,15 @@ namespace mshadow {
         utils::Assert( eshape[1] != 0, "can not reduce over empty tensor" );
         // execution
         expr::Plan<E> plan = MakePlan( exp.self() );
-        for( index_t x = 0; x < eshape[0]; ++x ){
-            real_t res = plan.Eval( 0, x );
-            for( index_t y = 1; y < eshape[1]; ++y ){
-                Reducer::Reduce( res, plan.Eval( y, x ) );
+        ParallelRange( eshape[0], static_cast<size_t>( eshape[0] ) * eshape[1], [&]( index_t xbegin, index_t xend ){
+            for( index_t x = xbegin; x < xend; ++x ){
+                real_t res = plan.Eval( 0, x );
+                for( index_t y = 1; y < eshape[1]; ++y ){
+                    Reducer::Reduce( res, plan.Eval( y, x ) );
+                }
+                Saver::Save( dst[x], res*scale );
             }
-            Saver::Save( dst[x], res*scale );
-        }
+        });
     }
 
     template<typename Saver, typename Reducer, int dimkeep, typename E, int etype>
@@ -129,19 +131,21 @@ namespace mshadow {
         // execution
         expr::Plan<E> plan = MakePlan( exp.self() );
 
-        for( index_t c = 0; c < pshape[2]; ++c ){
-            real_t res = Reducer::kInitV;
-            for( index_t n = 0; n < pshape[3]; ++n ){
-                real_t tres = Reducer::kInitV;
-                for( index_t y = 0; y < pshape[1]; ++y ){
-                    for( index_t x = 0; x < pshape[0]; ++x ){
-                        Reducer::Reduce( tres, plan.Eval( (n*pshape[2] + c) * pshape[1] + y, x ) );
+        ParallelRange( pshape[2], pshape.Size(), [&]( index_t cbegin, index_t cend ){
+            for( index_t c = cbegin; c < cend; ++c ){
+                real_t res = Reducer::kInitV;
+                for( index_t n = 0; n < pshape[3]; ++n ){
+                    real_t tres = Reducer::kInitV;
+                    for( index_t y = 0; y < pshape[1]; ++y ){
+                        for( index_t x = 0; x < pshape[0]; ++x ){
+                            Reducer::Reduce( tres, plan.Eval( (n*pshape[2] + c) * pshape[1] + y, x ) );
+                        }
                     }
+                    Reducer::Reduce( res, tres );
                 }
-                Reducer::Reduce( res, tres );
+                Saver::Save( dst[c], res*scale );
             }
-            Saver::Save( dst[c], res*scale );
-        }
+        });
     }
 
     inline void Softmax( Tensor<cpu,1> dst, const Tensor<cpu,1>& energy ){
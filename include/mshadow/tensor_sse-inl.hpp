@@ -417,14 +417,16 @@ namespace mshadow{
     inline void MapSSEPlan(Tensor<cpu,dim> _dst, const expr::SSEPlan<E> &plan){        
         Tensor<cpu,2> dst = _dst.FlatTo2D();
         const index_t xlen = sse2::LowerAlign( dst.shape[0], sizeof(real_t) );
-        for ( index_t y = 0; y < dst.shape[1]; y ++ ) {
-            for( index_t x = 0; x < xlen; x += sse2::FVec<real_t>::kSize ){
+        // blocks start at multiples of kParallelBlock, hence stay aligned
+        ParallelMapBlocks( dst.shape[1], dst.shape[0], [&]( index_t y, index_t xbegin, index_t xend ){
+            const index_t xmid = std::max( xbegin, std::min( xend, xlen ) );
+            for( index_t x = xbegin; x < xmid; x += sse2::FVec<real_t>::kSize ){
                 sse2::Saver<SV,real_t>::Save( &dst[y][x], plan.EvalSSE( y,x ) );
             }
-            for( index_t x = xlen; x < dst.shape[0]; x ++ ){
+            for( index_t x = xmid; x < xend; x ++ ){
                 SV::Save( dst[y][x], plan.Eval(y,x) );
             }
-        }
+        });
     }
 }; // namespace mshadow
 #endif // MSHADOW_USE_SSE
@@ -0,0 +1,71 @@
+#ifndef INCLUDE_UTILS_BLOCKING_QUEUE_H_
+#define INCLUDE_UTILS_BLOCKING_QUEUE_H_
+
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+
+namespace singa {
+/**
+ * Bounded FIFO queue shared by producer and consumer threads.
+ * Push() blocks if the queue is full and Pop() blocks if it is empty. After
+ * Close(), blocked threads are woken up, Push() fails and Pop() fails once the
+ * queue is drained.
+ */
+template<typename T>
+class BlockingQueue {
+ public:
+  /**
+   * @param capacity max num of elements in the queue
+   */
+  explicit BlockingQueue(size_t capacity=1): capacity_(capacity),
+    closed_(false){}
+  /**
+   * @return false if the queue is closed
+   */
+  bool Push(const T& x){
+    std::unique_lock<std::mutex> lck(mtx_);
+    while(queue_.size()>=capacity_&&!closed_) notfull_.wait(lck);
+    if(closed_)
+      return false;
+    queue_.push(x);
+    notempty_.notify_one();
+    return true;
+  }
+  /**
+   * @return false if the queue is closed and empty
+   */
+  bool Pop(T* x){
+    std::unique_lock<std::mutex> lck(mtx_);
+    while(queue_.empty()&&!closed_) notempty_.wait(lck);
+    if(queue_.empty())
+      return false;
+    *x=queue_.front();
+    queue_.pop();
+    notfull_.notify_one();
+    return true;
+  }
+  void Close(){
+    std::unique_lock<std::mutex> lck(mtx_);
+    closed_=true;
+    notfull_.notify_all();
+    notempty_.notify_all();
+  }
+  size_t size(){
+    std::unique_lock<std::mutex> lck(mtx_);
+    return queue_.size();
+  }
+  void set_capacity(size_t capacity){
+    std::unique_lock<std::mutex> lck(mtx_);
+    capacity_=capacity;
+  }
+
+ private:
+  size_t capacity_;
+  bool closed_;
+  std::queue<T> queue_;
+  std::mutex mtx_;
+  std::condition_variable notfull_, notempty_;
+};
+} /* singa */
+#endif  // INCLUDE_UTILS_BLOCKING_QUEUE_H_
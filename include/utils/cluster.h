@@ -42,6 +42,8 @@ class Cluster {
   int nprocs_per_group()const {return cluster_.nprocs_per_group();}
   int nthreads_per_procs()const{return cluster_.nthreads_per_procs();}
   int nthreads_per_server()const{return cluster_.nthreads_per_server();}
+  int naugment_threads()const{return cluster_.naugment_threads();}
+  int nintra_op_threads()const{return cluster_.nintra_op_threads();}
   int global_procsid()const {return global_procsid_;}
   /**
    * Return the id of the worker thread within his group.
@@ -0,0 +1,78 @@
+#ifndef INCLUDE_UTILS_CODEC_H_
+#define INCLUDE_UTILS_CODEC_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace shard {
+
+/**
+ * Base class of codecs for compressing blocks of shard tuples.
+ *
+ * Codecs are registered in Singleton<Factory<Codec>> by name, which is stored
+ * in the header of compressed shards to select the codec for reading. The
+ * built-in codecs are registered by Codec::Create(); user defined codecs can
+ * be registered before creating the Shard, e.g.,
+ * Singleton<Factory<Codec>>::Instance()->Register("mycodec",
+ *    CreateInstance(MyCodec, Codec));
+ */
+class Codec {
+ public:
+  virtual ~Codec(){}
+  /**
+   * Create a registered codec.
+   * @param name codec identifier, at most 15 characters
+   */
+  static Codec* Create(const std::string& name);
+  /**
+   * @return max bytes of the compressed result for size bytes of input.
+   */
+  virtual size_t MaxCompressedSize(size_t size)=0;
+  /**
+   * Compress src into dst.
+   * @param dst must have at least MaxCompressedSize(size) bytes
+   * @return bytes of the compressed result
+   */
+  virtual size_t Compress(const char* src, size_t size, char* dst)=0;
+  /**
+   * Decompress src into dst.
+   * @param dst must have rawsize bytes
+   * @return false if src is corrupted, i.e., not rawsize bytes after
+   * decompression
+   */
+  virtual bool Decompress(const char* src, size_t size, char* dst,
+      size_t rawsize)=0;
+};
+
+/**
+ * Built-in byte-oriented LZ77 codec, registered as "lz".
+ *
+ * The compressed block is a sequence of [token literals offset matchlen],
+ * where the token has 4 bits for the literal length and 4 bits for the
+ * match length (minus 4); lengths >=15 continue in following bytes (255 for
+ * continuation). The offset is 2 bytes (little endian). The last sequence
+ * has only literals. It trades compression ratio for speed, which suits
+ * decompressing records on reader threads.
+ */
+class LZCodec: public Codec {
+ public:
+  virtual size_t MaxCompressedSize(size_t size);
+  virtual size_t Compress(const char* src, size_t size, char* dst);
+  virtual bool Decompress(const char* src, size_t size, char* dst,
+      size_t rawsize);
+
+ private:
+  //!< last position (plus 1) of every hashed 4-byte sequence
+  std::vector<uint32_t> table_;
+};
+
+/**
+ * CRC-32C (Castagnoli) checksum, computed by the SSE4.2 instruction if it is
+ * enabled by the compiler, e.g., -msse4.2; otherwise by slicing-by-8 tables.
+ * @param crc checksum of the preceding data, 0 for the start
+ * @return checksum of the preceding data and the data
+ */
+uint32_t Crc32c(uint32_t crc, const char* data, size_t size);
+} /* shard */
+#endif  // INCLUDE_UTILS_CODEC_H_
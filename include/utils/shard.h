@@ -2,15 +2,120 @@
 #define INCLUDE_UTILS_SHARD_H_
 
 #include <google/protobuf/message.h>
+#include <stdint.h>
+#include <condition_variable>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
-#include <unordered_set>
+#include <thread>
+#include <vector>
 
+#include "utils/codec.h"
 
 using google::protobuf::Message;
 
 namespace shard {
 
+/**
+ * Interface of readers that return tuples sequentially or by index, i.e.,
+ * Shard and Dataset.
+ */
+class Reader {
+ public:
+  virtual ~Reader(){}
+  /**
+   * read next tuple without copying the value.
+   * @key key tuple key
+   * @param val set to point to the tuple value, see the implementations for
+   * how long it is valid
+   * @param vallen set to the bytes of the tuple value
+   * @return true if read success otherwise false, e.g., at the end
+   */
+  virtual bool Next(std::string *key, const char** val, int* vallen)=0;
+  /**
+   * read next tuple.
+   * @key key tuple key
+   * @param val tuple value of type Message
+   * @return true if read success otherwise false, e.g., the tuple was not
+   * inserted completely.
+   */
+  bool Next(std::string *key, Message* val);
+  /**
+   * read next tuple.
+   * @key key tuple key
+   * @param val tuple value of type string
+   * @return true if read success otherwise false, e.g., the tuple was not
+   * inserted completely.
+   */
+  bool Next(std::string *key, std::string* val);
+  /**
+   * Move the read pointer to the first tuple.
+   */
+  virtual void SeekToFirst()=0;
+  /**
+   * Move the read pointer to the index-th tuple.
+   * @param index tuple index, starting from 0
+   */
+  virtual void Seek(int index)=0;
+  /**
+   * @return num of tuples
+   */
+  virtual const int Count()=0;
+  /**
+   * @return num of corrupted tuples skipped by Next()
+   */
+  virtual int ncorrupted() const=0;
+};
+
+/**
+ * Compact set of tuple keys for rejecting duplicated tuples when writing.
+ *
+ * Every key is stored as its 64-bit hash together with the id (i.e., index)
+ * of its tuple in an open addressing table, which takes less than 40 bytes
+ * per key regardless of the key length. Different keys may have the same
+ * hash, hence the tuples returned by Find() must be verified against the
+ * real key.
+ */
+class KeySet {
+ public:
+  KeySet();
+  /**
+   * @return 64-bit hash of the key, which is the same across runs and
+   * machines, i.e., can be persisted.
+   */
+  static uint64_t Hash(const std::string& key);
+  /**
+   * @param hash of the key of the tuple
+   * @param id of the tuple
+   */
+  void Insert(uint64_t hash, int id);
+  /**
+   * @param ids set to the ids of tuples whose keys have the hash
+   */
+  void Find(uint64_t hash, std::vector<int>* ids) const;
+  /**
+   * @return num of keys
+   */
+  size_t size() const {
+    return size_;
+  }
+
+ protected:
+  /**
+   * Double the table size.
+   */
+  void Grow();
+
+ private:
+  // hashes of slots
+  std::vector<uint64_t> hashes_;
+  // tuple ids of slots, -1 for empty slots
+  std::vector<int> ids_;
+  size_t size_;
+};
+
 /**
  * Data shard stores training/validation/test records.
  * Every worker node should have a training shard (validation/test shard
@@ -25,12 +130,40 @@ namespace shard {
  * When Shard obj is created, it will remove the last key if the tuple size and
  * key size do not match because the last write of tuple crashed.
  *
- * TODO
- * 1. split one shard into multile shards.
- * 2. add threading to prefetch and parse records
+ * Shards created with checksum have a CRC-32C checksum after every tuple, i.e.,
+ * [key_len key tuple_len tuple crc], which is recorded by a flag in the header.
+ * Corrupted tuples, i.e., with wrong checksums or lengths, are skipped by
+ * Next() (using shard.idx to find the next tuple) and counted by
+ * ncorrupted().
  *
+ * shard.key is another sidecar file, which stores the hashes (uint64) of the
+ * keys of all tuples (see KeySet). It is loaded in kAppend mode to reject
+ * tuples inserted before, without scanning shard.dat.
+ *
+ * shard.idx is a sidecar file written together with shard.dat. It stores the
+ * offset (size_t) of every tuple in shard.dat, which makes Count(), Seek() and
+ * Read() constant-time. If shard.idx is missing or does not cover all tuples,
+ * e.g., for shards created by old versions, it is rebuilt in memory by
+ * scanning shard.dat.
+ *
+ * In kMmap mode, shard.dat is mapped into memory and tuples are returned as
+ * views (pointer and length) into the mapping, which avoids the buffer refills
+ * and copies of kRead mode.
+ *
+ * Compressed shards start with a header [magic version flags codec], followed
+ * by blocks of tuples [rawsize compsize payload]. Every block is compressed
+ * independently by the codec named in the header, and decompresses to the
+ * tuple format above; tuples never span blocks. shard.idx stores the pair
+ * (block offset, offset inside the block) for every tuple. Shards without the
+ * header are the raw format above.
+ *
+ * Insert() and Flush() can be called by multiple threads. After
+ * StartFlusher(), full buffers are written by a background thread into
+ * shard.dat while the inserting threads fill the other buffer.
+ *
+ * A dataset of multiple shards is described by a manifest, see Dataset.
  */
-class Shard {
+class Shard: public Reader {
  public:
   //!< read only mode used in training
   enum {
@@ -38,36 +171,42 @@ class Shard {
   //!< write mode used in creating shard (will overwrite previous one)
    kCreate=1,
   //!< append mode, e.g. used when previous creating crashes
-   kAppend=2
+   kAppend=2,
+  //!< read only mode that maps shard.dat into memory, zero-copy reading
+   kMmap=3
   };
 
  public:
   /**
    * Init the shard obj.
    * @folder shard folder (path except shard.dat) on worker node
-   * @mode shard open mode, Shard::kRead, Shard::kWrite or Shard::kAppend
+   * @mode shard open mode, Shard::kRead, Shard::kWrite, Shard::kAppend or
+   * Shard::kMmap
    * @bufsize batch bufsize bytes data for every disk op (read or write),
    * default is 100MB
+   * @codec name of the codec for compressing blocks, used only when creating
+   * a new shard; empty for the raw format. The codec of an existing shard is
+   * read from its header.
+   * @checksum add checksums to tuples, used only when creating a new shard
    */
-  Shard(std::string folder, char mode, int capacity=104857600);
+  Shard(std::string folder, char mode, int capacity=104857600,
+      std::string codec="", bool checksum=false);
   ~Shard();
 
+  using Reader::Next;
   /**
-   * read next tuple from the shard.
+   * read next tuple from the shard without copying the value.
    * @key key tuple key
-   * @param val tuple value of type Message
+   * @param val set to point to the tuple value, which is inside the mapped
+   * file for kMmap mode, or inside the internal buffer for kRead mode. It is
+   * valid until the shard is destroyed (kMmap) or until the next read (kRead).
+   * For compressed shards it is inside the decompressed block, and is valid
+   * until the next block is loaded by Next() or Seek().
+   * @param vallen set to the bytes of the tuple value
    * @return true if read success otherwise false, e.g., the tuple was not
    * inserted completely.
    */
-  bool Next(std::string *key, Message* val);
-  /**
-   * read next tuple from the shard.
-   * @key key tuple key
-   * @param val tuple value of type string
-   * @return true if read success otherwise false, e.g., the tuple was not
-   * inserted completely.
-   */
-  bool Next(std::string *key, std::string* val);
+  virtual bool Next(std::string *key, const char** val, int* vallen);
 
   /**
    * Append one tuple to the shard.
@@ -87,16 +226,47 @@ class Shard {
    * Move the read pointer to the head of the shard file.
    * Used for repeated reading.
    */
-  void SeekToFirst();
+  virtual void SeekToFirst();
+  /**
+   * Move the read pointer to the index-th tuple.
+   * Used only for kRead or kMmap.
+   * @param index tuple index, starting from 0
+   */
+  virtual void Seek(int index);
+  /**
+   * read the index-th tuple, the following Next() reads the (index+1)-th tuple.
+   * @param index tuple index, starting from 0
+   * @key key tuple key
+   * @param val tuple value of type Message
+   * @return true if read success otherwise false
+   */
+  bool Read(int index, std::string *key, Message* val);
+  /**
+   * read the index-th tuple, the following Next() reads the (index+1)-th tuple.
+   * @param index tuple index, starting from 0
+   * @key key tuple key
+   * @param val tuple value of type string
+   * @return true if read success otherwise false
+   */
+  bool Read(int index, std::string *key, std::string* val);
   /**
    * Flush buffered data to disk.
    * Used only for kCreate or kAppend.
    */
   void Flush() ;
   /**
-   * @return num of tuples
+   * Start the background thread for writing full buffers, which doubles
+   * the buffer memory. Used only for kCreate or kAppend.
    */
-  const int Count();
+  void StartFlusher();
+  /**
+   * @return num of tuples, i.e., tuples in shard.dat for reading modes, and
+   * inserted tuples (including buffered ones) for writing modes.
+   */
+  virtual const int Count();
+  virtual int ncorrupted() const {
+    return ncorrupted_;
+  }
   /**
    * @return path to shard file
    */
@@ -111,26 +281,152 @@ class Shard {
    * @return length (i.e., bytes) of value field.
    */
   int Next(std::string *key);
+  /**
+   * Read the next tuple without skipping corrupted ones.
+   * @return false if the tuple is incomplete or corrupted
+   */
+  bool NextTuple(std::string *key, const char** val, int* vallen);
+  /**
+   * Move the read pointer to the tuple after the corrupted one (or after the
+   * corrupted block for compressed shards) using the index.
+   * @return false if there is no tuple after it
+   */
+  bool SkipCorrupted();
   /**
    * Setup the disk pointer to the right position for append in case that
    * the pervious write crashes.
    * @param path shard path.
    * @return offset (end pos) of the last success written tuple.
    */
-  int PrepareForAppend(std::string path);
+  size_t PrepareForAppend(std::string path);
+  /**
+   * Load key hashes from shard.key for kAppend mode. Keys of tuples that are
+   * not covered by shard.key (e.g., written by old versions) are read from
+   * shard.dat.
+   * @param hashes set to the hashes of keys of all tuples
+   */
+  void LoadKeys(std::vector<uint64_t>* hashes);
+  /**
+   * Load offsets of tuples from shard.idx, then scan shard.dat after the last
+   * indexed tuple (or from the start if shard.idx is invalid) for tuples that
+   * are not indexed, e.g., due to crashes.
+   * @param fin input stream of shard.dat, not used in kMmap mode
+   * @return end position of the last complete tuple (or block)
+   */
+  size_t BuildIndex(std::istream* fin);
+  /**
+   * Read the key of the id-th inserted tuple, used in writing modes.
+   * @param lck lock of mtx_ held by the caller
+   */
+  void ReadKey(int id, std::string* key, std::unique_lock<std::mutex>* lck);
+  /**
+   * Read the key of the tuple at the position from shard.dat.
+   * @param block offset of the block, used only for compressed shards
+   * @param offset of the tuple in shard.dat, or in the block for compressed
+   * shards
+   */
+  void ReadKeyAt(size_t block, size_t offset, std::string* key);
   /**
    * Read data from disk if the current data in the buffer is not a full field.
    * @param size size of the next field.
    */
   bool PrepareNextField(int size);
+  /**
+   * Map shard.dat into memory for kMmap mode.
+   */
+  void MapFile();
+  /**
+   * Write buffered tuples to shard.dat and their offsets to shard.idx, or
+   * pass them to the flusher if it is started.
+   * @param lck lock of mtx_ held by the caller
+   */
+  void WriteBuffer(std::unique_lock<std::mutex>* lck);
+  /**
+   * Write tuples to shard.dat (compressed into one block for compressed
+   * shards) and their offsets to shard.idx.
+   * @param buf tuples
+   * @param size bytes of tuples
+   * @param index offsets of tuples inside buf, cleared after writing
+   * @param hashes hashes of keys of tuples, cleared after writing
+   */
+  void WriteBlock(const char* buf, int size, std::vector<size_t>* index,
+      std::vector<uint64_t>* hashes);
+  /**
+   * Loop of the flusher thread, which writes wbuf_ once it is filled.
+   */
+  void FlushLoop();
+  /**
+   * Load tuple offsets from shard.idx, or rebuild them by scanning shard.dat
+   * if shard.idx is missing or stale. Used only for kRead or kMmap.
+   */
+  void LoadIndex();
+  /**
+   * @param fin input stream of shard.dat
+   * @param offset start position of the tuple
+   * @param datsize bytes of shard.dat
+   * @return end position of the tuple, 0 if the tuple is incomplete.
+   */
+  size_t TupleEnd(std::istream* fin, size_t offset, size_t datsize);
+  /**
+   * Read the header of an existing shard.dat and create the codec if it is
+   * compressed.
+   * @param codec set to the codec name in the header
+   * @return bytes of the header, 0 for raw shards without header.
+   */
+  size_t ReadHeader(std::string* codec);
+  /**
+   * Write the header of a compressed or checksummed shard.dat.
+   */
+  void WriteHeader(const std::string& codec, bool checksum);
+  /**
+   * Load and decompress the block starting at pos into buf_.
+   * @param fin input stream of shard.dat, not used in kMmap mode
+   * @return false if the block is incomplete or corrupted.
+   */
+  bool LoadBlock(std::istream* fin, size_t pos);
+  /**
+   * Collect offsets of all tuples by decompressing every block of shard.dat.
+   * @param fin input stream of shard.dat, not used in kMmap mode
+   * @param pos position of the first block to scan
+   * @return end position of the last complete block.
+   */
+  size_t ScanBlocks(std::istream* fin, size_t pos);
+  /**
+   * Write tuple offsets to shard.idx.
+   * @param index tuple offsets, inside blocks for compressed shards
+   * @param blocks block offsets of tuples, used only for compressed shards
+   */
+  void WriteIndex(const std::vector<size_t>& index,
+      const std::vector<size_t>& blocks);
 
  private:
   char mode_;
-  std::string path_;
+  std::string path_, idx_path_, key_path_;
   // either ifstream or ofstream
   std::fstream fdat_;
+  // output streams of shard.idx and shard.key, used in writing
+  std::ofstream fidx_, fkey_;
+  // input streams of shard.dat and shard.idx for verifying keys in writing
+  std::ifstream fdat_in_, fidx_in_;
+  // offsets of all tuples for reading; offsets of buffered tuples for writing
+  // (inside buf_ before WriteBuffer)
+  std::vector<size_t> index_;
+  // block offsets of all tuples, used only for compressed shards, where
+  // index_ stores the tuple offsets inside their blocks
+  std::vector<size_t> block_index_;
+  // num of tuples, set after the index is loaded for reading
+  int count_;
+  // position in shard.dat of the first byte in buf_, used in writing
+  size_t fileoffset_;
   // to avoid replicated tuples
-  std::unordered_set<std::string> keys_;
+  KeySet keys_;
+  // hashes of keys of tuples in buf_ and wbuf_ respectively
+  std::vector<uint64_t> hashes_, whashes_;
+  // num of tuples written into shard.dat
+  int nwritten_;
+  // decompressed block for verifying keys, and its position
+  std::string vblock_;
+  size_t vblock_pos_;
   // internal buffer
   char* buf_;
   // offset inside the buf_
@@ -139,6 +435,179 @@ class Shard {
   int capacity_;
   // bytes in buf_, used in reading
   int bufsize_;
+  // start address of the mapped shard.dat, used in kMmap mode
+  char* mmap_;
+  // bytes of the mapped file
+  size_t mmap_size_;
+  // read position inside the mapped file
+  size_t mmap_offset_;
+  // bytes of shard.dat when it is opened for reading
+  size_t datsize_;
+  // position of the first tuple (or block), i.e., bytes of the header
+  size_t datastart_;
+  // codec of compressed shards, nullptr for raw shards
+  std::shared_ptr<Codec> codec_;
+  // true if every tuple ends with a checksum
+  bool checksum_;
+  // index of the tuple to be read by Next()
+  int next_index_;
+  // num of corrupted tuples skipped
+  int ncorrupted_;
+  // compressed block, for reading from or writing to the stream
+  std::string cbuf_;
+  // positions of the block in buf_ and the next block, used in reading
+  size_t block_pos_, next_block_;
+  // buffer being written by the flusher, swapped with buf_ when buf_ is full
+  char* wbuf_;
+  // bytes of tuples in wbuf_
+  int wsize_;
+  // offsets of tuples in wbuf_
+  std::vector<size_t> windex_;
+  std::thread flusher_;
+  // protects the writing states, i.e., buf_, index_, keys_ and the swap
+  std::mutex mtx_;
+  // signaled when wbuf_ is filled or written respectively
+  std::condition_variable filled_, flushed_;
+  // true if wbuf_ is filled and not written yet
+  bool flushing_;
+  // true to stop the flusher
+  bool stop_;
+};
+
+/**
+ * Dataset of tuples stored in multiple shards.
+ *
+ * The shards are listed in a manifest file, one line per shard as
+ * [folder num_tuples]; relative folders are relative to the manifest file.
+ * Lines starting with '#' are comments. Tuples are indexed globally in the
+ * order of the manifest. A partition, e.g., for one worker group, is a range
+ * of the global indices, hence re-partitioning for a different num of workers
+ * only changes the ranges, without copying any tuple.
+ */
+class Dataset: public Reader {
+ public:
+  /**
+   * @param manifest path to the manifest file
+   * @param mode Shard::kRead or Shard::kMmap for opening shards
+   */
+  explicit Dataset(const std::string& manifest, char mode=Shard::kMmap);
+  /**
+   * Restrict reading to the k-th of n (almost) equal partitions. Count(),
+   * Seek() and Next() are then relative to the partition.
+   * @param k partition id, starting from 0
+   * @param n num of partitions
+   */
+  void SetPartition(int k, int n);
+  using Reader::Next;
+  /**
+   * \copydoc Reader::Next(std::string*, const char**, int*)
+   * The value is valid as documented in Shard::Next().
+   * @return false at the end of the partition
+   */
+  virtual bool Next(std::string *key, const char** val, int* vallen);
+  virtual void SeekToFirst();
+  virtual void Seek(int index);
+  virtual const int Count();
+  virtual int ncorrupted() const;
+  /**
+   * Write the manifest for a list of existing shards.
+   * @param manifest path to the manifest file
+   * @param folders shard folders
+   */
+  static void WriteManifest(const std::string& manifest,
+      const std::vector<std::string>& folders);
+
+ protected:
+  /**
+   * @return the i-th shard, which is opened on first use
+   */
+  Shard* OpenShard(int i);
+  /**
+   * @return id of the shard that has the tuple of the global index
+   */
+  int Locate(int index);
+
+ private:
+  char mode_;
+  std::vector<std::string> folders_;
+  // global index of the first tuple of every shard, plus total num of tuples
+  std::vector<int> offsets_;
+  std::vector<std::shared_ptr<Shard>> shards_;
+  // range of global indices of the partition
+  int begin_, end_;
+  // global index of the next tuple and the shard to read it from
+  int pos_, cur_;
+};
+
+/**
+ * Read tuples of a Shard (or Dataset) in a different random order every
+ * epoch.
+ *
+ * Tuples are grouped into blocks of consecutive tuples. For every epoch the
+ * order of blocks is permuted, then the tuples of a window of blocks are
+ * loaded and shuffled together. Tuples inside one block are read
+ * sequentially, hence the disk access is mostly sequential while the
+ * iteration order is still random.
+ */
+class ShuffleReader {
+ public:
+  /**
+   * @param shard a Shard opened in kRead or kMmap mode, or a Dataset; not
+   * owned by the reader
+   * @param blocksize num of consecutive tuples in one block
+   * @param window num of blocks whose tuples are shuffled together
+   * @param seed seed for the random permutations
+   */
+  ShuffleReader(Reader* shard, int blocksize, int window, unsigned seed);
+  /**
+   * read next tuple of the current epoch.
+   * @return false if all tuples of this epoch have been read
+   */
+  bool Next(std::string *key, Message* val);
+  /**
+   * \copydoc Next(std::string*, Message*)
+   */
+  bool Next(std::string *key, std::string* val);
+  /**
+   * \copydoc Next(std::string*, Message*)
+   * @param val set to the value inside the loaded window, which is valid
+   * until the next call
+   */
+  bool Next(std::string *key, const char** val, int* vallen);
+  /**
+   * Start a new epoch with a new permutation.
+   */
+  void NextEpoch();
+  /**
+   * @return num of epochs started, starting from 1
+   */
+  int epoch() const {
+    return epoch_;
+  }
+
+ protected:
+  /**
+   * Load tuples of the next window of blocks and shuffle them.
+   * @return false if there is no block left in this epoch.
+   */
+  bool LoadWindow();
+
+ private:
+  Reader* shard_;
+  int blocksize_, window_, count_, epoch_;
+  std::mt19937 rng_;
+  // permuted block ids of this epoch
+  std::vector<int> blocks_;
+  // position of the next block in blocks_
+  size_t next_block_;
+  // keys and values of tuples in the current window
+  std::vector<std::string> keys_, vals_;
+  // num of tuples in the current window
+  int nloaded_;
+  // shuffled order of tuples in the current window
+  std::vector<int> order_;
+  // position of the next tuple in order_
+  size_t pos_;
 };
 } /* shard */
 #endif  // DATASOURCE_SHARD_H_
@@ -0,0 +1,136 @@
+#ifndef INCLUDE_UTILS_TENSOR_SHARD_H_
+#define INCLUDE_UTILS_TENSOR_SHARD_H_
+
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace shard {
+
+/**
+ * Shard of fixed-shape records, e.g., images of the same size, in dense
+ * layout.
+ *
+ * The shard folder has two files. tensor.dat has a header (magic, element
+ * type and shape of one record) followed by the tensors of all records back
+ * to back; label.dat is an array of int32_t labels, one per record. Every
+ * record is at a fixed offset, hence a batch of consecutive records is read
+ * from the mapped tensor.dat by one memcpy without parsing any protobuf
+ * message.
+ *
+ * Records are appended by Insert(). Like Shard, kAppend mode drops the
+ * records that were written partially, e.g., due to crashes, before appending.
+ */
+class TensorShard {
+ public:
+  enum {
+  //!< read only mode that maps tensor.dat and label.dat into memory
+    kRead=0,
+  //!< write mode used in creating shard (will overwrite previous one)
+    kCreate=1,
+  //!< append mode, e.g. used when previous creating crashes
+    kAppend=2
+  };
+  //!< type of tensor elements
+  enum DType {
+    kUInt8=0,
+    kFloat=1
+  };
+
+  /**
+   * Init the shard obj.
+   * @folder shard folder (path except tensor.dat) on worker node
+   * @mode shard open mode, TensorShard::kRead, kCreate or kAppend
+   * @dtype type of tensor elements, used only when creating a new shard
+   * @shape shape of one record, e.g., {channels, height, width}, used only
+   * when creating a new shard
+   */
+  TensorShard(std::string folder, char mode, DType dtype=kUInt8,
+      const std::vector<int>& shape=std::vector<int>{});
+  ~TensorShard();
+
+  /**
+   * Append one record.
+   * @param tensor record_size() bytes of the tensor
+   * @param label
+   */
+  void Insert(const char* tensor, int label);
+  /**
+   * Flush buffered records to disk.
+   */
+  void Flush();
+  /**
+   * Copy n consecutive records into tensors and labels, wrapping around to the
+   * first record at the end of the shard.
+   * @param start index of the first record
+   * @param tensors buffer of at least n*record_size() bytes
+   * @param labels buffer of at least n labels, ignored if it is nullptr
+   * @return index of the record after the last copied one
+   */
+  int Read(int start, int n, char* tensors, int* labels) const;
+  /**
+   * @return the tensor of the index-th record, inside the mapped file
+   */
+  const char* tensor(int index) const;
+  int label(int index) const;
+  /**
+   * @return num of records
+   */
+  int Count() const {
+    return count_;
+  }
+  DType dtype() const {
+    return dtype_;
+  }
+  /**
+   * @return shape of one record
+   */
+  const std::vector<int>& shape() const {
+    return shape_;
+  }
+  /**
+   * @return bytes of the tensor of one record
+   */
+  size_t record_size() const {
+    return record_size_;
+  }
+  /**
+   * @return bytes of one element of the dtype
+   */
+  static size_t DTypeSize(DType dtype);
+  /**
+   * @return true if folder has a tensor.dat
+   */
+  static bool Exists(const std::string& folder);
+
+ protected:
+  /**
+   * Read the header of tensor.dat.
+   * @return false if the file does not exist or has no valid header
+   */
+  bool ReadHeader();
+  void WriteHeader();
+  /**
+   * Map path into memory.
+   * @param size set to bytes of the file
+   */
+  char* MapFile(const std::string& path, size_t* size);
+
+ protected:
+  char mode_;
+  std::string path_, label_path_;
+  DType dtype_;
+  std::vector<int> shape_;
+  size_t record_size_;
+  int count_;
+  // write mode
+  std::ofstream fdat_, flabel_;
+  // read mode
+  const char* tensors_;
+  const int32_t* labels_;
+  char *mmap_dat_, *mmap_label_;
+  size_t dat_size_, label_size_;
+};
+} /* shard */
+#endif  // INCLUDE_UTILS_TENSOR_SHARD_H_
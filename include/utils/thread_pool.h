@@ -0,0 +1,52 @@
+#ifndef INCLUDE_UTILS_THREAD_POOL_H_
+#define INCLUDE_UTILS_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace singa {
+/**
+ * Pool of threads for data parallel loops, e.g., parsing records of a batch.
+ *
+ * ParallelFor() splits the range into chunks, which are run by the pool
+ * threads and the calling thread. While waiting for its chunks, the calling
+ * thread runs pending chunks of other callers, hence ParallelFor() can be
+ * called by multiple threads and from inside the loop body.
+ */
+class ThreadPool {
+ public:
+  /**
+   * @param nthreads num of pool threads, besides the calling threads
+   */
+  explicit ThreadPool(int nthreads);
+  ~ThreadPool();
+  /**
+   * Run func(begin, end) on disjoint chunks covering [0, n) and return after
+   * all chunks are done.
+   */
+  void ParallelFor(int n, const std::function<void(int, int)>& func);
+  int nthreads() const {
+    return threads_.size();
+  }
+
+ protected:
+  /**
+   * Run by pool threads, running chunks until the pool is destroyed.
+   */
+  void Run();
+
+ private:
+  bool stop_;
+  std::vector<std::thread> threads_;
+  //!< pending chunks
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mtx_;
+  //!< signaled when tasks are added and when chunks are done respectively
+  std::condition_variable task_cv_, done_cv_;
+};
+} /* singa */
+#endif  // INCLUDE_UTILS_THREAD_POOL_H_
@@ -16,6 +16,8 @@
 #include "utils/param.h"
 #include "utils/common.h"
 #include "utils/blob.h"
+#include "utils/blocking_queue.h"
+#include "worker/transform.h"
 
 using std::vector;
 using std::shared_ptr;
@@ -37,6 +39,13 @@ typedef shared_ptr<Layer> SLayer;
  */
 class Layer {
  public:
+  /**
+   * @return the pool of ClusterProto::nintra_op_threads threads shared by all
+   * layers of the process for splitting the computation of one layer, e.g.,
+   * images of a batch, nullptr if layers run on the worker thread only. The
+   * pool also runs the CPU loops of large mshadow expressions.
+   */
+  static ThreadPool* intra_op_pool();
   Layer(){}
   /**
    * simply save the proto configuation.
@@ -257,6 +266,12 @@ protected:
   vector<SLayer> srclayers_, dstlayers_;
 };
 
+/**
+ * Run func(begin, end) on chunks of [0, n) by Layer::intra_op_pool() if any,
+ * otherwise on the calling thread.
+ */
+void IntraOpFor(int n, const std::function<void(int, int)>& func);
+
 /**
  * For sending data to layer on other threads which may resident on other nodes
  * due to layer/data partition.
@@ -327,6 +342,34 @@ class ConcateLayer: public Layer {
 };
 
 
+/**
+ * A batch of fixed-shape records in dense layout, i.e., the tensors of all
+ * records are contiguous, which is provided by data layers reading dense
+ * tensors (e.g., TensorDataLayer) instead of Records.
+ */
+struct DenseBatch {
+  //!< shape of one record, e.g., {channels, height, width}
+  vector<int> shape;
+  //!< true if elements are float, otherwise uint8_t
+  bool is_float;
+  //!< tensors of all records
+  vector<char> tensors;
+  vector<int> labels;
+
+  int size() const {
+    return labels.size();
+  }
+  /**
+   * @return num of elements of one record
+   */
+  int record_dim() const;
+  /**
+   * Convert elements [begin, end) of tensors into floats, i.e.,
+   * dst[i]=element[begin+i]*scale+bias.
+   */
+  void Convert(int begin, int end, float scale, float bias, float* dst) const;
+};
+
 /**
  * base layer for prefetching records from local Shard, HDFS, lmdb, etc.
  * cannot be partitioned, always returns kNone for partition type.
@@ -366,6 +409,13 @@ class DataLayer: public Layer{
   virtual const Record& sample() const {
     return sample_;
   }
+  /**
+   * @return the batch of dense records for data layers reading dense
+   * tensors, nullptr for data layers reading Records, see records().
+   */
+  virtual const DenseBatch* dense_batch() const {
+    return nullptr;
+  }
 
   virtual Blob<float>* mutable_data(const Layer* layer=nullptr) {
     return nullptr;
@@ -475,6 +525,14 @@ class ParserLayer: public Layer {
    * ComputeFeature(bool, const vector<SLayer>& srclayers)  or Prefetch(bool).
    */
   virtual void ParseRecords(bool training, const vector<Record>& records, Blob<float>* blob)=0;
+  /**
+   * Parse the dense batch from DataLayer into blob, called instead of
+   * ParseRecords if DataLayer::dense_batch() is not nullptr.
+   */
+  virtual void ParseDenseBatch(bool training, const DenseBatch& batch,
+      Blob<float>* blob){
+    LOG(FATAL)<<"Parser layer "<<name()<<" does not support dense batches";
+  }
   virtual bool is_parserlayer() const {
     return true;
   }
@@ -484,8 +542,8 @@ class ParserLayer: public Layer {
   virtual void ComputeGradient(const vector<SLayer>& srclayers){};
   virtual void Setup(){
     Setup(layer_proto_,srclayers_);
+    SetupTransforms(layer_proto_);
     has_set_=true;
-    ready_=true;
     prefetch_=false;
   }
   virtual void SetupAfterPartition(){
@@ -509,54 +567,94 @@ class ParserLayer: public Layer {
 
   virtual void ComputeFeature(bool training, const vector<SLayer>& srclayers){
     if(!prefetch_){
-      DataLayer* datalayer=static_cast<DataLayer*>(srclayers[0].get());
-      ParseRecords(training, datalayer->records(), &data_);
+      Parse(training, static_cast<DataLayer*>(srclayers[0].get()), &data_);
     }else{
-      std::unique_lock<std::mutex> lck(mtx_);
-      while(!ready_) cv_.wait(lck);
-      data_.CopyFrom(prefetch_data_);
-      ready_=false;
-      cv_.notify_all();
+      // take the oldest parsed batch and return the buffer of the consumed one
+      Blob<float>* blob;
+      CHECK(full_queue_.Pop(&blob))<<"Prefetching of "<<name()<<" is stopped";
+      data_.Swap(*blob);
+      free_queue_.Push(blob);
     }
   }
   /**
    * prefetching is transparent to parsing logics.
    * users implement parsing logics in ParseRecords
    * worker/training algorithm calls this function to do prefetching in a
-   * separate thread. Records are in fact parsed into prefetch_data_, and later
-   * copied into data_.
+   * separate thread. Records are in fact parsed into a free buffer of the
+   * prefetch_data_ ring, which is swapped with data_ by ComputeFeature later.
+   * It blocks if all buffers are parsed but not consumed.
+   * @return false if prefetching is stopped
    */
-  void Prefetching(bool training){
-    std::unique_lock<std::mutex> lck(mtx_);
-    while(ready_) cv_.wait(lck);
-    //data_.Swap(prefetch_data_);
-    DataLayer* datalayer=static_cast<DataLayer*>(srclayers_[0].get());
-    ParseRecords(training, datalayer->records(), &prefetch_data_);
-    ready_=true;
-    cv_.notify_all();
+  bool Prefetching(bool training){
+    Blob<float>* blob;
+    if(!free_queue_.Pop(&blob))
+      return false;
+    Parse(training, static_cast<DataLayer*>(srclayers_[0].get()), blob);
+    return full_queue_.Push(blob);
   }
 
   /**
    * must be called before calling ComputeFeature(bool) if Prefetching runs in a
    * separate thread
+   * @param depth max num of batches parsed in advance
    */
-  void set_prefetch(bool prefetch) {
-    if(prefetch){
-      if(prefetch_data_.count()==0)
-        prefetch_data_.ReshapeLike(data_);
-      ready_=false;
+  void set_prefetch(bool prefetch, int depth=1) {
+    if(prefetch&&prefetch_data_.empty()){
+      CHECK_GT(depth, 0);
+      prefetch_data_.resize(depth);
+      full_queue_.set_capacity(depth);
+      free_queue_.set_capacity(depth);
+      for(auto& blob: prefetch_data_){
+        blob.ReshapeLike(data_);
+        free_queue_.Push(&blob);
+      }
     }
     prefetch_=prefetch;
   }
+  /**
+   * Wake up and stop the thread calling Prefetching.
+   */
+  void StopPrefetching(){
+    full_queue_.Close();
+    free_queue_.Close();
+  }
+
+ protected:
+  /**
+   * Parse the records or the dense batch of datalayer, and then augment the
+   * parsed images if there are transforms.
+   */
+  void Parse(bool training, DataLayer* datalayer, Blob<float>* blob){
+    Blob<float>* dst=transforms_.empty()?blob:&stages_[0];
+    if(datalayer->dense_batch()!=nullptr)
+      ParseDenseBatch(training, *datalayer->dense_batch(), dst);
+    else
+      ParseRecords(training, datalayer->records(), dst);
+    if(!transforms_.empty())
+      Augment(training, blob);
+  }
+  /**
+   * Create transforms of LayerProto::transform and reshape data_ to their
+   * output shape. Parsing logics are unaware of transforms, i.e., images are
+   * parsed into a blob of the shape set by Setup(proto, srclayers).
+   */
+  void SetupTransforms(const LayerProto& proto);
+  /**
+   * Apply transforms to the parsed images, output into blob.
+   */
+  void Augment(bool training, Blob<float>* blob);
 
  private:
-  std::mutex mtx_;
-  std::condition_variable cv_;
-  bool ready_;
   bool has_set_;
   bool prefetch_;
-  //!< prefetch_data_ is invisible to layer logics, i.e., parsing.
-  Blob<float> prefetch_data_;
+  //!< ring of buffers for prefetching, invisible to layer logics, i.e., parsing.
+  vector<Blob<float>> prefetch_data_;
+  //!< parsed buffers to be consumed and free buffers to be parsed into
+  BlockingQueue<Blob<float>*> full_queue_, free_queue_;
+  //!< data augmentation applied in order
+  vector<std::unique_ptr<Transform>> transforms_;
+  //!< parsed images and outputs of transforms except the last one
+  vector<Blob<float>> stages_;
 };
 } // singa
 
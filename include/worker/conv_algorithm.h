@@ -0,0 +1,136 @@
+#ifndef INCLUDE_WORKER_CONV_ALGORITHM_H_
+#define INCLUDE_WORKER_CONV_ALGORITHM_H_
+
+#include <string>
+#include "proto/model.pb.h"
+#include "utils/blob.h"
+
+using std::string;
+
+namespace singa {
+/**
+ * Shape of a convolution of a batch of images.
+ */
+struct ConvShape {
+  int batchsize, channels, height, width;
+  int num_filters, kernel, pad, stride;
+  int conv_height, conv_width;
+  /**
+   * @return signature of the shape, e.g., "b64_c3_h32_w32_f32_k5_p2_s1"
+   */
+  string ToString() const;
+};
+
+/**
+ * Base class of convolution algorithms used by ConvolutionLayer.
+ *
+ * Algorithms are created by the names of ConvolutionProto::ConvAlgorithm,
+ * e.g., "kIm2col" and "kWinograd4x4". User defined algorithms can be
+ * registered before creating the neural net, e.g.,
+ * Singleton<Factory<ConvAlgorithm>>::Instance()->Register("kMyConv",
+ *    CreateInstance(MyConv, ConvAlgorithm));
+ *
+ * Images are {batchsize, channels, height, width}, filters are {num_filters,
+ * channels, kernel, kernel} and outputs are {batchsize, num_filters,
+ * conv_height, conv_width}. Bias is added by the layer.
+ */
+class ConvAlgorithm {
+ public:
+  /**
+   * Create a registered algorithm.
+   */
+  static ConvAlgorithm* Create(const string& type);
+  /**
+   * Create and setup the algorithm of ConvolutionProto::algorithm for the
+   * shape, falling back to kIm2col if it does not support the shape.
+   *
+   * For kAuto, every algorithm supporting the shape is timed on one batch
+   * and the fastest is used. The choice is cached per shape signature in
+   * the file ClusterProto::workspace/conv_algorithms and reused by later
+   * layers and runs of the same shape.
+   */
+  static ConvAlgorithm* Create(const ConvShape& shape,
+      const ConvolutionProto& proto);
+
+  virtual ~ConvAlgorithm(){}
+  /**
+   * @return false if the algorithm does not support the shape
+   */
+  virtual bool Setup(const ConvShape& shape,
+      const ConvolutionProto& proto)=0;
+  /**
+   * @param dst output images, overwritten
+   */
+  virtual void Forward(const float* src, const float* weight, float* dst)=0;
+  /**
+   * @param gweight gradient of the filters, overwritten
+   * @param gsrc gradient of the input images, overwritten; not computed if
+   * nullptr
+   */
+  virtual void Backward(const float* src, const float* weight,
+      const float* grad, float* gweight, float* gsrc)=0;
+};
+
+/**
+ * Unpack the patches of images into columns and multiply them by the filters.
+ * Images of a batch are unpacked in groups whose columns fit into
+ * ConvolutionProto::col_buffer_mb, one GEMM per group.
+ */
+class Im2colConv: public ConvAlgorithm {
+ public:
+  virtual bool Setup(const ConvShape& shape,
+      const ConvolutionProto& proto);
+  virtual void Forward(const float* src, const float* weight, float* dst);
+  virtual void Backward(const float* src, const float* weight,
+      const float* grad, float* gweight, float* gsrc);
+
+ protected:
+  /**
+   * Unpack g consecutive images from src into the column buffer col of
+   * {col_height_, g*col_width_}.
+   */
+  void Unpack(const float* src, int g, float* col) const;
+  /**
+   * Reverse of Unpack(), summing the columns of every pixel into the g
+   * consecutive images of dst.
+   */
+  void Pack(const float* col, int g, float* dst) const;
+
+  ConvShape shape_;
+  int col_height_, col_width_;
+  //!< num of images unpacked into the column buffer together
+  int group_;
+  //!< columns of a group of images, {col_height_, group_*col_width_}
+  Blob<float> col_data_, col_grad_;
+  //!< data (or grad) of a group of images as the GEMM result (or operand),
+  //!< {num_filters, group_*col_width_}
+  Blob<float> group_data_;
+};
+
+/**
+ * Im2colConv with one image per GEMM, using the smallest buffers.
+ */
+class Im2colPerImageConv: public Im2colConv {
+ public:
+  virtual bool Setup(const ConvShape& shape,
+      const ConvolutionProto& proto);
+};
+
+/**
+ * Direct convolution, accumulating shifted rows of the input for every
+ * filter and kernel offset. It needs no buffers and suits layers of few
+ * channels and filters.
+ */
+class DirectConv: public ConvAlgorithm {
+ public:
+  virtual bool Setup(const ConvShape& shape,
+      const ConvolutionProto& proto);
+  virtual void Forward(const float* src, const float* weight, float* dst);
+  virtual void Backward(const float* src, const float* weight,
+      const float* grad, float* gweight, float* gsrc);
+
+ protected:
+  ConvShape shape_;
+};
+}  // namespace singa
+#endif  // INCLUDE_WORKER_CONV_ALGORITHM_H_
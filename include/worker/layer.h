@@ -9,11 +9,16 @@
 #include <memory>
 #include <chrono>
 #include <random>
+#include <thread>
 #include <lmdb.h>
 
 #include "proto/model.pb.h"
 #include "utils/shard.h"
+#include "utils/blocking_queue.h"
+#include "utils/tensor_shard.h"
+#include "utils/thread_pool.h"
 #include "worker/base_layer.h"
+#include "worker/conv_algorithm.h"
 
 
 /**
@@ -24,6 +29,11 @@ namespace singa {
 
 /**
  * Convolution layer.
+ *
+ * Images are unpacked (im2col) in groups into the column buffer, which is
+ * capped by ConvolutionProto::col_buffer_mb, and every group is convolved by
+ * one GEMM instead of one small GEMM per image. The columns of the images of
+ * a group are side by side, i.e., the buffer is {col_height_, g*col_width_}.
  */
 class ConvolutionLayer: public Layer {
  public:
@@ -52,7 +62,8 @@ class ConvolutionLayer: public Layer {
   int batchsize_,  channels_, height_,width_;
   int col_height_, col_width_, conv_height_, conv_width_, num_filters_;
   shared_ptr<Param> weight_, bias_;
-  Blob<float> col_data_, col_grad_;
+  //!< chosen by ConvolutionProto::algorithm
+  std::unique_ptr<ConvAlgorithm> algorithm_;
 };
 
 class DropoutLayer: public Layer {
@@ -115,6 +126,8 @@ class LabelLayer: public ParserLayer {
   virtual void Setup(const LayerProto& proto, const vector<SLayer>& srclayers);
   virtual void ParseRecords(bool training, const vector<Record>& records,
       Blob<float>* blob);
+  virtual void ParseDenseBatch(bool training, const DenseBatch& batch,
+      Blob<float>* blob);
 };
 
 class LRNLayer: public Layer {
@@ -148,21 +161,59 @@ class LRNLayer: public Layer {
   Blob<float> norm_;
 };
 
+/**
+ * Parse MNIST images into the data blob.
+ *
+ * For training, images are deformed by random scaling (gamma), rotation or
+ * shearing (beta) and elastic distortion (kernel, sigma, alpha). The affine
+ * transform, the displacement field and the resizing are composed into one
+ * mapping from output to input coordinates, hence every output pixel is
+ * bilinearly interpolated from the raw image in one pass. Displacement
+ * fields are generated and images are warped in parallel on Transform::pool().
+ */
 class MnistImageLayer: public ParserLayer {
  public:
   virtual void Setup(const LayerProto& proto, const vector<SLayer>& srclayers);
   virtual void ParseRecords(bool training, const vector<Record>& records,
       Blob<float>* blob);
+  virtual void ParseDenseBatch(bool training, const DenseBatch& batch,
+      Blob<float>* blob);
 
  protected:
-  // height and width of the image after deformation
-  // kernel size for elastic distortion
-  // n^2 images are processed as a batch for elastic distortion
-  // conv height and conv width
-  // gauss kernel values, displacements, column image and tmp buffer
-  //float* gauss_, *displacementx_, *displacementy_, *colimg_, *tmpimg_;
-  float  gamma_, beta_, sigma_, kernel_, alpha_, norm_a_, norm_b_;
-  int resize_, elastic_freq_;
+  /**
+   * Draw the affine transforms of n images and generate the displacement
+   * fields shared by them.
+   * @param labels labels of the images, shearing is halved for 1 and 7
+   */
+  void SampleTransforms(bool training, const vector<int>& labels);
+  /**
+   * Generate the index-th displacement field from the seed.
+   * @param tmp buffer of size_*size_ floats
+   */
+  void GenerateField(int index, unsigned seed, float* tmp);
+  /**
+   * Warp the rid-th image of the batch into dst, then normalize it.
+   * @param src pixels of the raw image of inputsize_*inputsize_
+   */
+  template<typename T>
+  void ParseImage(const T* src, int rid, float* dst) const;
+  /**
+   * Run func(begin, end) over [0, n) on Transform::pool() if any.
+   */
+  void ParallelFor(int n, const std::function<void(int, int)>& func);
+
+  float  gamma_, beta_, sigma_, alpha_, norm_a_, norm_b_;
+  int kernel_, resize_, elastic_freq_;
+  //!< width (height) of raw images and output images
+  int inputsize_, size_;
+  //!< gaussian kernel for smoothing displacement fields
+  vector<float> gauss_;
+  //!< x and y displacements of fields of the current batch
+  vector<float> fields_;
+  //!< 2x3 matrix per image, mapping output to input coordinates
+  vector<float> affine_;
+  //!< true if images of the current batch are warped, elastically distorted
+  bool warp_, elastic_;
 };
 
 class PoolingLayer: public Layer {
@@ -181,6 +232,9 @@ class PoolingLayer: public Layer {
   int kernel_, pad_, stride_;
   int batchsize_,channels_, height_, width_, pooled_height_, pooled_width_;
   PoolingProto_PoolMethod pool_;
+  bool cache_argmax_;
+  //!< offset of the max element within its input image of every output
+  vector<int> argmax_;
 };
 
 class ReLULayer: public Layer {
@@ -233,40 +287,237 @@ class SoftmaxLossLayer: public LossLayer {
   int topk_;
 };
 
+/**
+ * Parse RGB images into the data blob.
+ *
+ * Each image is cropped (randomly for training, at the center for test),
+ * mirrored (randomly for training), converted to float, mean subtracted and
+ * scaled in one pass from the record (or dense batch) into the blob. Images
+ * of a batch are parsed in parallel on Transform::pool().
+ */
 class RGBImageLayer: public ParserLayer {
  public:
   virtual void Setup(const LayerProto& proto, const vector<SLayer>& srclayers);
   virtual void ParseRecords(bool training, const vector<Record>& records,
       Blob<float>* blob);
+  virtual void ParseDenseBatch(bool training, const DenseBatch& batch,
+      Blob<float>* blob);
+
+ protected:
+  /**
+   * Draw crop offsets and mirror flags for n images, on the calling thread
+   * to keep rand() out of the parallel parsing.
+   */
+  void SampleTransforms(bool training, int n);
+  /**
+   * Transform the rid-th image of the batch into dst.
+   * @param src pixels of the raw image of shape {channels, height, width}
+   */
+  template<typename T>
+  void ParseImage(const T* src, int rid, float* dst) const;
 
  private:
   float scale_;
   int cropsize_;
   bool mirror_;
+  //!< shape of raw images
+  int channels_, height_, width_;
+  //!< mean image of the raw shape, empty if no mean is subtracted
+  vector<float> mean_;
+  //!< crop offsets and mirror flags of images of the current batch
+  vector<int> hoffs_, woffs_;
+  vector<bool> mirrors_;
 };
 
+/**
+ * Decoder of encoded images, e.g., JPEG or PNG, into a DenseBatch, used by
+ * data layers whose records are encoded.
+ *
+ * The encoded images of a batch are copied by Add(), hence the source buffers
+ * can be reused or unmapped afterwards, and then decoded in parallel by
+ * Decode(). Every decoding thread reuses its own scratch cv::Mat for the
+ * decoded and resized images, hence there is no allocation per image once the
+ * buffers have grown to the image size.
+ */
+class ImageDecoder {
+ public:
+  /**
+   * @param shape {channels, height, width} of decoded images, where channels
+   * is 1 for grayscale and 3 for BGR images (the order of OpenCV and Caffe)
+   * @param batchsize max num of images of one batch
+   * @param nthreads num of threads decoding images besides the calling thread
+   */
+  void Setup(const vector<int>& shape, int batchsize, int nthreads);
+  /**
+   * @return {channels, height, width} of the encoded image, where channels is
+   * 1 for grayscale images and 3 for others
+   */
+  static vector<int> Shape(const void* data, int size);
+  /**
+   * Copy the rid-th encoded image of the batch.
+   */
+  void Add(int rid, const void* data, int size);
+  /**
+   * Decode the added images of all records of the batch into the uint8
+   * batch->tensors of shape() images.
+   */
+  void Decode(DenseBatch* batch);
+  /**
+   * Decode one image into dst in {channels, height, width} layout; it is
+   * resized if its size is not height x width.
+   */
+  void DecodeImage(const void* data, int size, uint8_t* dst) const;
+  const vector<int>& shape() const {
+    return shape_;
+  }
+
+ private:
+  vector<int> shape_;
+  //!< encoded images of the current batch, reused across batches
+  vector<string> images_;
+  //!< threads decoding images besides the calling thread, nullptr if none
+  std::unique_ptr<ThreadPool> pool_;
+};
+
+/**
+ * Data layer reading Records from a shard::Shard or a shard::Dataset.
+ *
+ * If records are pixel images of the same shape (and DataProto::dense), the
+ * pixels and labels are copied from the serialized records, which are in the
+ * mapped file or the read buffer of the shard, into a reused DenseBatch
+ * without parsing Record messages. If records are encoded images, they are
+ * decoded into the DenseBatch by an ImageDecoder with DataProto::decode_threads
+ * threads. Otherwise records are parsed into reused Record messages, by
+ * DataProto::decode_threads if it is set. Pixel records of the DenseBatch
+ * are read ahead by a background thread if DataProto::decode_threads is set.
+ */
 class ShardDataLayer: public DataLayer{
  public:
+  ~ShardDataLayer();
   virtual void ComputeFeature(bool training, const vector<shared_ptr<Layer>>& srclayers);
   virtual void ComputeGradient(const vector<shared_ptr<Layer>>& srclayers){};
   virtual void Setup(const LayerProto& proto, const vector<SLayer>& srclayers);
+  virtual const DenseBatch* dense_batch() const {
+    return dense_?&batch_:nullptr;
+  }
+
+ protected:
+  /**
+   * Read the next record from the shard, restart from the first record (or
+   * start a new epoch for shuffled reading) at the end of the shard.
+   * @param val either string for raw record, Record for parsed record, or
+   * const char** and int* for the pointer to and size of the raw record
+   */
+  template<typename... T>
+  void NextRecord(string* key, T... val);
+  /**
+   * Copy the pixels and label of the serialized record into the rid-th
+   * record of batch_.
+   */
+  void CopyRecord(const char* val, int vallen, int rid);
+  /**
+   * Add the encoded image and the label of the serialized record as the
+   * rid-th record of batch_ to decoder_.
+   */
+  void AddEncodedRecord(const char* val, int vallen, int rid);
+  /**
+   * Skip [0, random_skip_) records.
+   */
+  void RandomSkip();
+  /**
+   * Run by the reader thread, reading raw batches from the shard, which are
+   * parsed by the decode thread or copied into batch_ if dense_.
+   */
+  void ReadBatches();
+  /**
+   * Run by the decode thread, parsing raw batches into Record batches in
+   * order; records of a batch are parsed together with decode_pool_.
+   */
+  void DecodeBatches();
+
  private:
-  shared_ptr<shard::Shard> shard_;
+  //!< a Shard, or a Dataset if the path is a manifest file
+  shared_ptr<shard::Reader> shard_;
+  //!< not null if records are read in shuffled order
+  shared_ptr<shard::ShuffleReader> shuffle_;
+  //!< reader thread and decode thread
+  vector<std::thread> threads_;
+  //!< threads parsing records besides the decode thread, nullptr if none
+  std::unique_ptr<ThreadPool> decode_pool_;
+  //!< buffers of raw and parsed batches circulating between the queues
+  vector<vector<string>> raw_batches_;
+  vector<vector<Record>> record_batches_;
+  //!< raw batches to be parsed and empty raw batches to be filled
+  BlockingQueue<vector<string>*> raw_queue_, free_raw_queue_;
+  //!< parsed batches to be consumed and empty batches to be parsed into
+  BlockingQueue<vector<Record>*> record_queue_, free_record_queue_;
+  //!< true if records are copied (or decoded) into batch_ instead of records_
+  bool dense_;
+  //!< true if records are encoded images, decoded by decoder_
+  bool encoded_;
+  DenseBatch batch_;
+  ImageDecoder decoder_;
 };
+/**
+ * Data layer reading Caffe's Datum from lmdb.
+ *
+ * lmdb values are memory mapped. If Datums are raw (not encoded) images of the
+ * same shape (and DataProto::dense), the pixels (or float_data) and labels are copied from the mapped
+ * values into a DenseBatch directly, without parsing Datum messages or
+ * converting them into Records; parser layers parse the batch by
+ * ParserLayer::ParseDenseBatch. If Datums are encoded images, e.g., created by
+ * Caffe's convert_imageset --encoded, they are decoded into the DenseBatch by
+ * an ImageDecoder with DataProto::decode_threads threads, and resized to the
+ * size of the first image if necessary. Otherwise Datums are converted into
+ * records().
+ */
 class LMDBDataLayer: public DataLayer{
  public:
   virtual void ComputeFeature(bool training, const vector<shared_ptr<Layer>>& srclayers);
   virtual void ComputeGradient(const vector<shared_ptr<Layer>>& srclayers){};
   virtual void Setup(const LayerProto& proto, const vector<SLayer>& srclayers);
+  virtual const DenseBatch* dense_batch() const {
+    return dense_?&batch_:nullptr;
+  }
   void ConvertDatumToSingleLableImageRecord(const Datum& datum,
     SingleLabelImageRecord* record);
 
+ protected:
+  /**
+   * Move the cursor to the next entry, restart from the first entry at the
+   * end.
+   */
+  void NextEntry();
+  /**
+   * Skip [0, random_skip_) entries. lmdb has no positional access, hence the
+   * cursor is positioned at the key interpolated between the first and last
+   * keys, which is exact if keys are evenly spread, e.g., zero-padded indices.
+   * The num of entries is from mdb_stat.
+   */
+  void RandomSkip();
+  /**
+   * Copy the pixels (or float_data) and label of the serialized Datum into
+   * the rid-th record of batch_.
+   */
+  void CopyDatum(const MDB_val& value, int rid);
+  /**
+   * Add the encoded image and the label of the serialized Datum as the rid-th
+   * record of batch_ to decoder_.
+   */
+  void AddEncodedDatum(const MDB_val& value, int rid);
+
  private:
   MDB_env* mdb_env_;
   MDB_dbi mdb_dbi_;
   MDB_txn* mdb_txn_;
   MDB_cursor* mdb_cursor_;
   MDB_val mdb_key_, mdb_value_;
+  //!< true if Datums are copied (or decoded) into batch_ instead of records_
+  bool dense_;
+  //!< true if Datums are encoded images, decoded by decoder_
+  bool encoded_;
+  DenseBatch batch_;
+  ImageDecoder decoder_;
 };
 
 /**
@@ -290,6 +541,31 @@ class TanhLayer: public Layer {
   float outer_scale_, inner_scale_;
 };
 
+/**
+ * Data layer reading fixed-shape records from a shard::TensorShard.
+ *
+ * Every batch of consecutive records is copied from the mapped shard into the
+ * DenseBatch by one memcpy (two at the end of the shard), which is parsed by
+ * ParserLayer::ParseDenseBatch without any protobuf parsing. records() is
+ * empty; sample() has only the shape and label of the first record, which is
+ * used by parser layers to setup.
+ */
+class TensorDataLayer: public DataLayer{
+ public:
+  virtual void ComputeFeature(bool training, const vector<shared_ptr<Layer>>& srclayers);
+  virtual void ComputeGradient(const vector<shared_ptr<Layer>>& srclayers){};
+  virtual void Setup(const LayerProto& proto, const vector<SLayer>& srclayers);
+  virtual const DenseBatch* dense_batch() const {
+    return &batch_;
+  }
+
+ private:
+  shared_ptr<shard::TensorShard> shard_;
+  //!< index of the first record of the next batch
+  int pos_;
+  DenseBatch batch_;
+};
+
 
 }  // namespace singa
 
@@ -0,0 +1,126 @@
+#ifndef INCLUDE_WORKER_TRANSFORM_H_
+#define INCLUDE_WORKER_TRANSFORM_H_
+
+#include <string>
+#include <vector>
+#include "proto/model.pb.h"
+#include "utils/thread_pool.h"
+
+using std::string;
+using std::vector;
+
+namespace singa {
+/**
+ * Base class of data augmentation transforms, which are applied by parser
+ * layers to parsed images of shape {channels, height, width}.
+ *
+ * Transforms are configured by LayerProto::transform and created by type, e.g.,
+ * kCrop, kFlip, kColorJitter and kNormalize. User defined transforms can be
+ * registered before creating the neural net, e.g.,
+ * Singleton<Factory<Transform>>::Instance()->Register("kMyTransform",
+ *    CreateInstance(MyTransform, Transform));
+ *
+ * For every batch, Sample() draws random parameters of all images on the
+ * parsing thread, then Apply() transforms images in parallel on the shared
+ * pool of augmentation threads.
+ */
+class Transform {
+ public:
+  /**
+   * Create a registered transform.
+   */
+  static Transform* Create(const string& type);
+  /**
+   * @return the pool of ClusterProto::naugment_threads threads shared by all
+   * parser layers of the process, nullptr if augmentation runs on the
+   * parsing thread only
+   */
+  static ThreadPool* pool();
+
+  virtual ~Transform(){}
+  /**
+   * @param shape shape of input images, {channels, height, width}
+   */
+  virtual void Setup(const TransformProto& proto, const vector<int>& shape){
+    srcshape_=shape;
+    shape_=shape;
+  }
+  /**
+   * Draw random parameters of n images, called before Apply().
+   */
+  virtual void Sample(bool training, int n){}
+  /**
+   * Transform the rid-th image of the batch. It is called by multiple threads
+   * for different images.
+   * @param src image of the input shape
+   * @param dst image of shape()
+   */
+  virtual void Apply(int rid, const float* src, float* dst) const=0;
+  /**
+   * @return shape of output images
+   */
+  const vector<int>& shape() const {
+    return shape_;
+  }
+
+ protected:
+  vector<int> srcshape_, shape_;
+};
+
+/**
+ * Crop images, randomly for training and at the center for test.
+ */
+class CropTransform: public Transform {
+ public:
+  virtual void Setup(const TransformProto& proto, const vector<int>& shape);
+  virtual void Sample(bool training, int n);
+  virtual void Apply(int rid, const float* src, float* dst) const;
+
+ private:
+  vector<int> hoffs_, woffs_;
+};
+
+/**
+ * Flip images horizontally at random for training.
+ */
+class FlipTransform: public Transform {
+ public:
+  virtual void Setup(const TransformProto& proto, const vector<int>& shape);
+  virtual void Sample(bool training, int n);
+  virtual void Apply(int rid, const float* src, float* dst) const;
+
+ private:
+  float prob_;
+  vector<bool> flips_;
+};
+
+/**
+ * Scale brightness, contrast and saturation (of 3 channel images) by random
+ * factors for training.
+ */
+class ColorJitterTransform: public Transform {
+ public:
+  virtual void Setup(const TransformProto& proto, const vector<int>& shape);
+  virtual void Sample(bool training, int n);
+  virtual void Apply(int rid, const float* src, float* dst) const;
+
+ private:
+  float brightness_, contrast_, saturation_;
+  //!< 3 factors per image
+  vector<float> factors_;
+};
+
+/**
+ * Subtract the mean and divide by the std per channel.
+ */
+class NormalizeTransform: public Transform {
+ public:
+  virtual void Setup(const TransformProto& proto, const vector<int>& shape);
+  virtual void Apply(int rid, const float* src, float* dst) const;
+
+ private:
+  //!< mean and 1/std per channel
+  vector<float> mean_, scale_;
+};
+} /* singa */
+#endif  // INCLUDE_WORKER_TRANSFORM_H_
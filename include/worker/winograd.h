@@ -0,0 +1,95 @@
+#ifndef INCLUDE_WORKER_WINOGRAD_H_
+#define INCLUDE_WORKER_WINOGRAD_H_
+
+#include "utils/blob.h"
+#include "worker/conv_algorithm.h"
+
+namespace singa {
+/**
+ * Winograd minimal filtering F(m x m, 3 x 3) for convolutions of 3x3 kernels
+ * and stride 1 (Lavin and Gray, Fast Algorithms for Convolutional Neural
+ * Networks), with m=2 (4x4 tiles) or m=4 (6x6 tiles).
+ *
+ * Images are cut into overlapping tiles of (m+2)x(m+2) pixels, each producing
+ * m x m outputs. Tiles and filters are transformed so that the convolution
+ * becomes (m+2)^2 independent GEMMs over channels, which saves 2.25x (m=2) or
+ * 4x (m=4) multiplications compared with im2col. Images of a batch are
+ * transformed in groups, one set of GEMMs per group.
+ *
+ * The gradient of the input is the convolution of the gradient of the output
+ * with the flipped filters, computed in the same way; the gradient of the
+ * filters is the sum of products of transformed input tiles and transformed
+ * gradient tiles.
+ */
+class Winograd: public ConvAlgorithm {
+ public:
+  /**
+   * @param m output tile size, 2 or 4
+   */
+  explicit Winograd(int m);
+  /**
+   * Supports 3x3 kernels of stride 1. Transformed tiles of a group of images
+   * are bounded by ConvolutionProto::col_buffer_mb.
+   */
+  virtual bool Setup(const ConvShape& shape,
+      const ConvolutionProto& proto);
+  virtual void Forward(const float* src, const float* weight, float* dst);
+  virtual void Backward(const float* src, const float* weight,
+      const float* grad, float* gweight, float* gsrc);
+
+ protected:
+  /**
+   * Convolution of one direction, i.e., the forward pass or the gradient of
+   * the input. Tiles are taken at offset -pad, which may be negative.
+   */
+  struct Geometry {
+    int channels, height, width, pad;
+    int filters, oheight, owidth;
+    //!< num of tiles of an image along the height and width
+    int tiles_h, tiles_w;
+    int tiles() const { return tiles_h*tiles_w; }
+  };
+  Geometry MakeGeometry(int channels, int height, int width, int pad,
+      int filters) const;
+  /**
+   * Transform filters {filters, channels, 3, 3} into U of {alpha^2, filters,
+   * channels}. If flip, filters are read as the flipped and transposed
+   * filters of the forward pass, i.e., weight {channels, filters, 3, 3}.
+   */
+  void TransformFilters(const Geometry& geo, const float* weight, bool flip,
+      float* u) const;
+  /**
+   * Transform the tiles of g images into V of {alpha^2, channels, g*tiles}.
+   */
+  void TransformInput(const Geometry& geo, const float* src, int g,
+      float* v) const;
+  /**
+   * Inverse transform M of {alpha^2, filters, g*tiles} into g images.
+   */
+  void TransformOutput(const Geometry& geo, const float* m, int g,
+      float* dst) const;
+  /**
+   * Transform m x m tiles of the gradient of g output images into E of
+   * {alpha^2, filters, g*tiles}.
+   */
+  void TransformGrad(const Geometry& geo, const float* grad, int g,
+      float* e) const;
+  /**
+   * Convolve the batch in groups of images.
+   * @param u transformed filters
+   */
+  void Convolve(const Geometry& geo, const float* u, const float* src,
+      float* dst);
+
+  //!< output tile size and input tile size m+2
+  int m_, alpha_;
+  int batchsize_, group_;
+  //!< the forward pass and the gradient of the input
+  Geometry forward_, backward_;
+  //!< transformed filters, tiles and GEMM results
+  Blob<float> filters_, tiles_, products_;
+  //!< gradient of the transformed filters
+  Blob<float> gfilters_;
+};
+}  // namespace singa
+#endif  // INCLUDE_WORKER_WINOGRAD_H_
@@ -53,6 +53,8 @@ class Executor{
   /**
     * Fetchdata by calling DataLayer and ParserLayer of the net.
     * This function is called by launcing a new thread as prefetching.
+    * @param steps num of batches to prefetch, <=0 for prefetching until
+    * ParserLayer::StopPrefetching() is called
     */
   static void PrefetchData(const vector<DataLayer*>& datalayers, bool training,
       int steps=1);
@@ -163,7 +165,8 @@ class Executor{
   shared_ptr<Cluster> cluster_;
   shared_ptr<ParamManager> pm_;
   shared_ptr<NeuralNet> train_net_, test_net_, validation_net_;
-  std::thread prefetch_thread_; //!< thread for prefetching training data.
+  //!< long-lived thread for prefetching training data, stopped in destructor
+  std::thread prefetch_thread_;
   vector<DataLayer*> localDataLayers_;
   int step_;
 
@@ -206,9 +209,10 @@ class Worker : public Executor{
    * Weights for test/validation net can share those from training after
    * setup (done outside of this funcion).
    * @param np proto for the neural network.
+   * @param prefetch_depth max num of batches prefetched by parser layers
    */
   shared_ptr<NeuralNet> SetupNeuralNet(const NetProto& np, bool prefetch,
-      Phase phase);
+      int prefetch_depth, Phase phase);
 };
 }  // namespace singa
 
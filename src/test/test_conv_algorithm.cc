@@ -0,0 +1,236 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <memory>
+#include <random>
+#include "mshadow/tensor.h"
+
+#include "worker/conv_algorithm.h"
+#include "worker/winograd.h"
+
+using namespace singa;
+using namespace mshadow;
+using namespace mshadow::expr;
+
+/**
+ * Im2colConv exposing the num of images per GEMM.
+ */
+class GroupIm2colConv: public Im2colConv {
+ public:
+  int group() const {
+    return group_;
+  }
+};
+
+/**
+ * Winograd exposing the num of images transformed together.
+ */
+class GroupWinograd: public Winograd {
+ public:
+  explicit GroupWinograd(int m): Winograd(m){}
+  int group() const {
+    return group_;
+  }
+};
+
+/**
+ * Convolution of random images, filters and gradients, computed by the
+ * per-image mshadow expressions of the original ConvolutionLayer.
+ */
+class ConvAlgorithmTest: public ::testing::Test {
+ protected:
+  void SetShape(int batchsize, int channels, int height, int width,
+      int filters, int kernel, int pad, int stride){
+    shape_.batchsize=batchsize;
+    shape_.channels=channels;
+    shape_.height=height;
+    shape_.width=width;
+    shape_.num_filters=filters;
+    shape_.kernel=kernel;
+    shape_.pad=pad;
+    shape_.stride=stride;
+    shape_.conv_height=(height+2*pad-kernel)/stride+1;
+    shape_.conv_width=(width+2*pad-kernel)/stride+1;
+    int srcsize=batchsize*channels*height*width;
+    int dstsize=batchsize*filters*shape_.conv_height*shape_.conv_width;
+    int wsize=filters*channels*kernel*kernel;
+    src_.resize(srcsize);
+    gsrc_.resize(srcsize);
+    dst_.resize(dstsize);
+    grad_.resize(dstsize);
+    weight_.resize(wsize);
+    gweight_.resize(wsize);
+    std::mt19937 gen(srcsize+wsize);
+    std::uniform_real_distribution<float> dist(-1.f, 1.f);
+    for(auto* v: {&src_, &grad_, &weight_})
+      for(float& x: *v)
+        x=dist(gen);
+    Reference();
+  }
+
+  void Reference(){
+    const ConvShape& s=shape_;
+    int colh=s.channels*s.kernel*s.kernel, colw=s.conv_height*s.conv_width;
+    Shape<4> srcshape=Shape4(s.batchsize, s.channels, s.height, s.width);
+    Shape<3> dstshape=Shape3(s.batchsize, s.num_filters, colw);
+    Tensor<cpu, 4> src(src_.data(), srcshape), gsrc(gsrc_.data(), srcshape);
+    Tensor<cpu, 3> dst(dst_.data(), dstshape), grad(grad_.data(), dstshape);
+    Tensor<cpu, 2> weight(weight_.data(), Shape2(s.num_filters, colh));
+    Tensor<cpu, 2> gweight(gweight_.data(), Shape2(s.num_filters, colh));
+    vector<float> coldata(colh*colw), colgrad(colh*colw);
+    Tensor<cpu, 2> col(coldata.data(), Shape2(colh, colw));
+    Tensor<cpu, 2> gcol(colgrad.data(), Shape2(colh, colw));
+    Shape<3> padshape(gsrc.shape.SubShape());
+    padshape[0]+=2*s.pad;padshape[1]+=2*s.pad;
+    Shape<2> imgshape=Shape2(s.height, s.width);
+    gweight=0.0f;
+    for(int n=0;n<s.batchsize;n++){
+      if(s.pad>0)
+        col=unpack_patch2col(pad(src[n], s.pad), s.kernel, s.stride);
+      else
+        col=unpack_patch2col(src[n], s.kernel, s.stride);
+      dst[n]=dot(weight, col);
+      gweight+=dot(grad[n], col.T());
+      gcol=dot(weight.T(), grad[n]);
+      gsrc[n]=crop(pack_col2patch(gcol, padshape, s.kernel, s.stride),
+          imgshape);
+    }
+  }
+
+  /**
+   * Replace the results of the reference by those of the algorithm.
+   */
+  void Reference(ConvAlgorithm* algorithm){
+    algorithm->Forward(src_.data(), weight_.data(), dst_.data());
+    algorithm->Backward(src_.data(), weight_.data(), grad_.data(),
+        gweight_.data(), gsrc_.data());
+  }
+
+  void ExpectNear(const vector<float>& expected, const vector<float>& actual,
+      float tolerance, const char* name){
+    ASSERT_EQ(expected.size(), actual.size());
+    for(size_t i=0;i<expected.size();i++)
+      ASSERT_NEAR(expected[i], actual[i], tolerance*(1+fabs(expected[i])))
+        <<name<<"["<<i<<"] of "<<shape_.ToString();
+  }
+
+  /**
+   * Compare the forward and backward passes of the algorithm with the
+   * reference, outputs are filled with garbage to check they are overwritten.
+   */
+  void Check(ConvAlgorithm* algorithm, float tolerance){
+    vector<float> dst(dst_.size(), 1e9f), gweight(gweight_.size(), 1e9f);
+    vector<float> gsrc(gsrc_.size(), 1e9f);
+    algorithm->Forward(src_.data(), weight_.data(), dst.data());
+    ExpectNear(dst_, dst, tolerance, "dst");
+    algorithm->Backward(src_.data(), weight_.data(), grad_.data(),
+        gweight.data(), gsrc.data());
+    ExpectNear(gweight_, gweight, tolerance, "gweight");
+    ExpectNear(gsrc_, gsrc, tolerance, "gsrc");
+  }
+
+  ConvShape shape_;
+  vector<float> src_, weight_, grad_;
+  //!< results of the reference
+  vector<float> dst_, gweight_, gsrc_;
+};
+
+TEST_F(ConvAlgorithmTest, Im2colGroups){
+  // {stride, pad, height, width} of 52x52 outputs, whose columns of 3x3
+  // kernels over 3 channels take 1/3.6 MB per image
+  int configs[][4]={{1, 0, 54, 54}, {1, 2, 50, 50}, {2, 0, 106, 105},
+    {2, 2, 101, 102}};
+  for(auto& cfg: configs){
+    SetShape(7, 3, cfg[2], cfg[3], 4, 3, cfg[1], cfg[0]);
+    ASSERT_EQ(52, shape_.conv_height);
+    ASSERT_EQ(52, shape_.conv_width);
+    // one image, 3 images with a remainder group of 1 image, the whole batch
+    int groups[][2]={{0, 1}, {1, 3}, {64, 7}};
+    for(auto& group: groups){
+      ConvolutionProto proto;
+      proto.set_col_buffer_mb(group[0]);
+      GroupIm2colConv conv;
+      ASSERT_TRUE(conv.Setup(shape_, proto));
+      ASSERT_EQ(group[1], conv.group());
+      Check(&conv, 1e-4);
+    }
+  }
+}
+
+TEST_F(ConvAlgorithmTest, Im2colSmallImages){
+  // {kernel, pad, stride}, including strides skipping pixels
+  int configs[][3]={{5, 2, 1}, {5, 2, 2}, {2, 0, 2}, {4, 1, 3}, {1, 0, 1}};
+  for(auto& cfg: configs){
+    SetShape(5, 2, 9, 8, 3, cfg[0], cfg[1], cfg[2]);
+    for(int mb: {0, 64}){
+      ConvolutionProto proto;
+      proto.set_col_buffer_mb(mb);
+      Im2colConv conv;
+      ASSERT_TRUE(conv.Setup(shape_, proto));
+      Check(&conv, 1e-4);
+    }
+  }
+}
+
+TEST_F(ConvAlgorithmTest, Winograd){
+  // odd images leave partial tiles, 3 images are transformed together, which
+  // does not divide the batch, for {m, col_buffer_mb} of {2, 2} and {4, 1}
+  int buffers[][2]={{2, 2}, {4, 1}};
+  for(int pad: {0, 1, 2}){
+    SetShape(7, 8, 45, 45, 8, 3, pad, 1);
+    ConvolutionProto proto;
+    proto.set_col_buffer_mb(0);
+    Im2colPerImageConv im2col;
+    ASSERT_TRUE(im2col.Setup(shape_, proto));
+    Reference(&im2col);
+    for(auto& buffer: buffers){
+      // one image, 3 images with a remainder group of 1 image, the whole batch
+      int groups[][2]={{0, 1}, {buffer[1], 3}, {64, 7}};
+      for(auto& group: groups){
+        proto.set_col_buffer_mb(group[0]);
+        GroupWinograd winograd(buffer[0]);
+        ASSERT_TRUE(winograd.Setup(shape_, proto));
+        ASSERT_EQ(group[1], winograd.group());
+        Check(&winograd, 2e-3);
+      }
+    }
+  }
+  // images smaller than a tile of F(4x4, 3x3)
+  SetShape(3, 2, 3, 5, 4, 3, 1, 1);
+  for(int m: {2, 4}){
+    ConvolutionProto proto;
+    Winograd winograd(m);
+    ASSERT_TRUE(winograd.Setup(shape_, proto));
+    Check(&winograd, 2e-3);
+  }
+}
+
+TEST_F(ConvAlgorithmTest, Direct){
+  // {kernel, pad, stride}
+  int configs[][3]={{3, 1, 1}, {5, 2, 2}, {2, 0, 2}, {4, 1, 3}, {1, 0, 1}};
+  for(auto& cfg: configs){
+    SetShape(5, 3, 11, 10, 4, cfg[0], cfg[1], cfg[2]);
+    ConvolutionProto proto;
+    DirectConv conv;
+    ASSERT_TRUE(conv.Setup(shape_, proto));
+    Check(&conv, 1e-4);
+  }
+}
+
+TEST_F(ConvAlgorithmTest, CreateFallback){
+  SetShape(4, 3, 12, 12, 5, 3, 1, 2);
+  ConvolutionProto proto;
+  for(auto type: {ConvolutionProto::kWinograd2x2,
+      ConvolutionProto::kWinograd4x4}){
+    proto.set_algorithm(type);
+    std::unique_ptr<ConvAlgorithm> conv(ConvAlgorithm::Create(shape_, proto));
+    ASSERT_NE(nullptr, dynamic_cast<Im2colConv*>(conv.get()));
+    ASSERT_EQ(nullptr, dynamic_cast<Winograd*>(conv.get()));
+    Check(conv.get(), 1e-4);
+  }
+  // supported shapes use the requested algorithm
+  SetShape(4, 3, 12, 12, 5, 3, 1, 1);
+  proto.set_algorithm(ConvolutionProto::kWinograd4x4);
+  std::unique_ptr<ConvAlgorithm> conv(ConvAlgorithm::Create(shape_, proto));
+  ASSERT_NE(nullptr, dynamic_cast<Winograd*>(conv.get()));
+  Check(conv.get(), 2e-3);
+}
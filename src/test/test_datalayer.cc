@@ -0,0 +1,220 @@
+#include <gtest/gtest.h>
+#include <lmdb.h>
+#include <sys/stat.h>
+#include <cstdint>
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "worker/layer.h"
+#include "utils/shard.h"
+
+using namespace singa;
+
+const int kRecords=20, kBatchsize=8, kHeight=4, kWidth=4;
+
+/**
+ * Pixel of channel c (in BGR order) at (y, x) of the i-th image.
+ */
+int Pixel(int i, int c, int y, int x){
+  return (i*7+c*60+y*kWidth+x)&0xff;
+}
+
+/**
+ * The i-th image encoded as PNG. Every 5th image (except the first) is
+ * scaled up by 2 with blocks of 2x2 equal pixels, hence it is resized back
+ * to kHeight x kWidth exactly by any interpolation.
+ */
+string EncodedImage(int i){
+  int scale=i%5==3?2:1;
+  cv::Mat img(kHeight*scale, kWidth*scale, CV_8UC3);
+  for(int y=0;y<img.rows;y++)
+    for(int x=0;x<img.cols;x++)
+      for(int c=0;c<3;c++)
+        img.ptr(y)[x*3+c]=Pixel(i, c, y/scale, x/scale);
+  vector<uint8_t> buf;
+  CHECK(cv::imencode(".png", img, buf));
+  return string(buf.begin(), buf.end());
+}
+
+/**
+ * Check the decoded planar BGR images of the step-th batch; the first record
+ * is read by Setup() as the sample.
+ */
+void CheckBatch(const DenseBatch& batch, int step){
+  ASSERT_EQ(vector<int>({3, kHeight, kWidth}), batch.shape);
+  ASSERT_FALSE(batch.is_float);
+  ASSERT_EQ(kBatchsize, batch.size());
+  int dim=3*kHeight*kWidth;
+  for(int r=0;r<kBatchsize;r++){
+    int i=(step*kBatchsize+r+1)%kRecords;
+    ASSERT_EQ(i%10, batch.labels[r]);
+    const uint8_t* img=reinterpret_cast<const uint8_t*>(batch.tensors.data())
+      +r*dim;
+    for(int c=0;c<3;c++)
+      for(int y=0;y<kHeight;y++)
+        for(int x=0;x<kWidth;x++)
+          ASSERT_EQ(Pixel(i, c, y, x), img[(c*kHeight+y)*kWidth+x])
+            <<"record "<<i<<" channel "<<c<<" at ("<<y<<", "<<x<<")";
+  }
+}
+
+TEST(DataLayerTest, EncodedShard){
+  std::string path="/tmp/datalayer_shard";
+  mkdir(path.c_str(), S_IRWXU);
+  {
+    shard::Shard shard(path, shard::Shard::kCreate);
+    for(int i=0;i<kRecords;i++){
+      Record record;
+      SingleLabelImageRecord* image=record.mutable_image();
+      image->set_label(i%10);
+      image->set_encoded(true);
+      image->set_pixel(EncodedImage(i));
+      shard.Insert(std::to_string(i), record);
+    }
+    shard.Flush();
+  }
+  for(int nthreads: {0, 2}){
+    LayerProto proto;
+    proto.mutable_data_param()->set_path(path);
+    proto.mutable_data_param()->set_batchsize(kBatchsize);
+    proto.mutable_data_param()->set_decode_threads(nthreads);
+    ShardDataLayer layer;
+    layer.Init(proto);
+    layer.Setup(proto, vector<SLayer>{});
+    ASSERT_NE(nullptr, layer.dense_batch());
+    const SingleLabelImageRecord& sample=layer.sample().image();
+    ASSERT_FALSE(sample.encoded());
+    ASSERT_EQ(3*kHeight*kWidth, sample.pixel().size());
+    ASSERT_EQ(Pixel(0, 2, 1, 3), static_cast<uint8_t>(
+          sample.pixel()[(2*kHeight+1)*kWidth+3]));
+    for(int step=0;step<4;step++){
+      layer.ComputeFeature(true, vector<SLayer>{});
+      CheckBatch(*layer.dense_batch(), step);
+    }
+  }
+}
+
+TEST(DataLayerTest, DecodeThreadsKeepOrder){
+  std::string path="/tmp/datalayer_records";
+  mkdir(path.c_str(), S_IRWXU);
+  {
+    shard::Shard shard(path, shard::Shard::kCreate);
+    for(int i=0;i<kRecords;i++){
+      Record record;
+      SingleLabelImageRecord* image=record.mutable_image();
+      image->set_label(i);
+      image->add_data(i*0.5f);
+      shard.Insert(std::to_string(i), record);
+    }
+    shard.Flush();
+  }
+  for(int nthreads: {1, 2, 4}){
+    LayerProto proto;
+    proto.mutable_data_param()->set_path(path);
+    proto.mutable_data_param()->set_batchsize(kBatchsize);
+    proto.mutable_data_param()->set_decode_threads(nthreads);
+    proto.mutable_data_param()->set_queue_depth(3);
+    ShardDataLayer layer;
+    layer.Init(proto);
+    layer.Setup(proto, vector<SLayer>{});
+    ASSERT_EQ(nullptr, layer.dense_batch());
+    for(int step=0;step<10;step++){
+      layer.ComputeFeature(true, vector<SLayer>{});
+      ASSERT_EQ(kBatchsize, layer.records().size());
+      for(int r=0;r<kBatchsize;r++){
+        int i=(step*kBatchsize+r+1)%kRecords;
+        const SingleLabelImageRecord& image=layer.records()[r].image();
+        ASSERT_EQ(i, image.label())<<nthreads<<" threads, step "<<step;
+        ASSERT_EQ(i*0.5f, image.data(0));
+      }
+    }
+  }
+}
+
+TEST(DataLayerTest, EncodedLMDB){
+  std::string path="/tmp/datalayer_lmdb";
+  mkdir(path.c_str(), S_IRWXU);
+  MDB_env* env;
+  MDB_txn* txn;
+  MDB_dbi dbi;
+  ASSERT_EQ(MDB_SUCCESS, mdb_env_create(&env));
+  ASSERT_EQ(MDB_SUCCESS, mdb_env_open(env, path.c_str(), 0, 0664));
+  ASSERT_EQ(MDB_SUCCESS, mdb_txn_begin(env, NULL, 0, &txn));
+  ASSERT_EQ(MDB_SUCCESS, mdb_open(txn, NULL, 0, &dbi));
+  for(int i=0;i<kRecords;i++){
+    Datum datum;
+    datum.set_label(i%10);
+    datum.set_encoded(true);
+    datum.set_data(EncodedImage(i));
+    string key=std::to_string(100+i), value;
+    datum.SerializeToString(&value);
+    MDB_val mdb_key{key.size(), &key[0]}, mdb_value{value.size(), &value[0]};
+    ASSERT_EQ(MDB_SUCCESS, mdb_put(txn, dbi, &mdb_key, &mdb_value, 0));
+  }
+  ASSERT_EQ(MDB_SUCCESS, mdb_txn_commit(txn));
+  mdb_env_close(env);
+  for(int nthreads: {0, 2}){
+    LayerProto proto;
+    proto.mutable_data_param()->set_path(path);
+    proto.mutable_data_param()->set_batchsize(kBatchsize);
+    proto.mutable_data_param()->set_decode_threads(nthreads);
+    LMDBDataLayer layer;
+    layer.Init(proto);
+    layer.Setup(proto, vector<SLayer>{});
+    ASSERT_NE(nullptr, layer.dense_batch());
+    for(int step=0;step<4;step++){
+      layer.ComputeFeature(true, vector<SLayer>{});
+      CheckBatch(*layer.dense_batch(), step);
+    }
+  }
+}
+
+TEST(DataLayerTest, RawLMDB){
+  std::string path="/tmp/datalayer_rawlmdb";
+  mkdir(path.c_str(), S_IRWXU);
+  MDB_env* env;
+  MDB_txn* txn;
+  MDB_dbi dbi;
+  ASSERT_EQ(MDB_SUCCESS, mdb_env_create(&env));
+  ASSERT_EQ(MDB_SUCCESS, mdb_env_open(env, path.c_str(), 0, 0664));
+  ASSERT_EQ(MDB_SUCCESS, mdb_txn_begin(env, NULL, 0, &txn));
+  ASSERT_EQ(MDB_SUCCESS, mdb_open(txn, NULL, 0, &dbi));
+  int dim=3*kHeight*kWidth;
+  for(int i=0;i<kRecords;i++){
+    Datum datum;
+    datum.set_channels(3);
+    datum.set_height(kHeight);
+    datum.set_width(kWidth);
+    datum.set_label(i);
+    datum.set_data(string(dim, static_cast<char>(i)));
+    string key=std::to_string(100+i), value;
+    datum.SerializeToString(&value);
+    MDB_val mdb_key{key.size(), &key[0]}, mdb_value{value.size(), &value[0]};
+    ASSERT_EQ(MDB_SUCCESS, mdb_put(txn, dbi, &mdb_key, &mdb_value, 0));
+  }
+  ASSERT_EQ(MDB_SUCCESS, mdb_txn_commit(txn));
+  mdb_env_close(env);
+  for(bool dense: {false, true}){
+    LayerProto proto;
+    proto.mutable_data_param()->set_path(path);
+    proto.mutable_data_param()->set_batchsize(kBatchsize);
+    proto.mutable_data_param()->set_dense(dense);
+    LMDBDataLayer layer;
+    layer.Init(proto);
+    layer.Setup(proto, vector<SLayer>{});
+    ASSERT_EQ(dense, layer.dense_batch()!=nullptr);
+    layer.ComputeFeature(true, vector<SLayer>{});
+    for(int r=0;r<kBatchsize;r++){
+      if(dense){
+        const DenseBatch& batch=*layer.dense_batch();
+        ASSERT_EQ(r+1, batch.labels[r]);
+        ASSERT_EQ(r+1, batch.tensors[(r+1)*dim-1]);
+      }else{
+        const SingleLabelImageRecord& image=layer.records()[r].image();
+        ASSERT_EQ(r+1, image.label());
+        ASSERT_EQ(3, image.shape(0));
+        ASSERT_EQ(string(dim, static_cast<char>(r+1)), image.pixel());
+      }
+    }
+  }
+}
@@ -0,0 +1,109 @@
+#include <gtest/gtest.h>
+#include <memory>
+#include "mshadow/tensor.h"
+
+#include "worker/layer.h"
+
+using namespace singa;
+using namespace mshadow;
+using namespace mshadow::expr;
+
+/**
+ * Source layer providing data and grad blobs of the given shape.
+ */
+class SourceLayer: public Layer {
+ public:
+  explicit SourceLayer(const vector<int>& shape): shape_(shape){}
+  virtual void Setup(const LayerProto& proto, const vector<SLayer>& srclayers){
+    data_.Reshape(shape_);
+    grad_.Reshape(shape_);
+  }
+  virtual void SetupAfterPartition(const LayerProto& proto,
+      const vector<int> &shape, const vector<SLayer>& srclayers){}
+  virtual void ComputeFeature(bool training,
+      const vector<SLayer>& srclayers){}
+  virtual void ComputeGradient(const vector<SLayer>& srclayers){}
+
+ private:
+  vector<int> shape_;
+};
+
+/**
+ * Max pooling layer with cached argmax of data without ties.
+ */
+std::shared_ptr<PoolingLayer> MaxPooling(
+    const std::shared_ptr<SourceLayer>& src, int kernel, int stride){
+  LayerProto proto;
+  PoolingProto* pool_param=proto.mutable_pooling_param();
+  pool_param->set_pool(PoolingProto_PoolMethod_MAX);
+  pool_param->set_kernel(kernel);
+  pool_param->set_stride(stride);
+  pool_param->set_cache_argmax(true);
+  auto layer=std::make_shared<PoolingLayer>();
+  layer->Setup(proto, vector<SLayer>{src});
+  Blob<float>* grad=layer->mutable_grad(nullptr);
+  for(int i=0;i<grad->count();i++)
+    grad->mutable_cpu_data()[i]=i%13-6.f;
+  return layer;
+}
+
+TEST(PoolingLayerTest, CachedArgmax){
+  // {batchsize, channels, height, width, kernel, stride}, with windows
+  // covering the images exactly as required by pool and unpool
+  int configs[][6]={{3, 2, 9, 9, 3, 2}, {2, 3, 8, 8, 2, 2},
+    {4, 1, 11, 7, 3, 2}, {3, 2, 10, 10, 4, 3}, {2, 2, 5, 6, 3, 1}};
+  for(auto& cfg: configs){
+    auto src=std::make_shared<SourceLayer>(
+        vector<int>{cfg[0], cfg[1], cfg[2], cfg[3]});
+    src->Setup(LayerProto(), vector<SLayer>{});
+    Blob<float>* srcdata=src->mutable_data(nullptr);
+    int count=srcdata->count();
+    // distinct values, i.e., no ties
+    for(int i=0;i<count;i++)
+      srcdata->mutable_cpu_data()[i]=(i*7919%count)*0.01f-1.f;
+    auto layer=MaxPooling(src, cfg[4], cfg[5]);
+    layer->ComputeFeature(true, vector<SLayer>{src});
+    layer->ComputeGradient(vector<SLayer>{src});
+
+    const vector<int>& pooledshape=layer->data(nullptr).shape();
+    Shape<4> s1=Shape4(cfg[0], cfg[1], cfg[2], cfg[3]);
+    Shape<4> s2=Shape4(pooledshape[0], pooledshape[1], pooledshape[2],
+        pooledshape[3]);
+    Tensor<cpu, 4> srct(srcdata->mutable_cpu_data(), s1);
+    Tensor<cpu, 4> grad(layer->mutable_grad(nullptr)->mutable_cpu_data(), s2);
+    Tensor<cpu, 4> data=NewTensor<cpu>(s2, 0.0f, false);
+    Tensor<cpu, 4> gsrc=NewTensor<cpu>(s1, 0.0f, false);
+    data=pool<red::maximum>(srct, cfg[4], cfg[5]);
+    gsrc=unpool<red::maximum>(srct, data, grad, cfg[4], cfg[5]);
+    const float* dptr=layer->data(nullptr).cpu_data();
+    for(int i=0;i<layer->data(nullptr).count();i++)
+      ASSERT_EQ(data.dptr[i], dptr[i])<<"data "<<i;
+    const float* gptr=src->grad(nullptr).cpu_data();
+    for(int i=0;i<count;i++)
+      ASSERT_EQ(gsrc.dptr[i], gptr[i])<<"gsrc "<<i;
+    FreeSpace(data);
+    FreeSpace(gsrc);
+  }
+}
+
+TEST(PoolingLayerTest, StrideLargerThanKernel){
+  // the last window starts past the image, and is moved to the last pixel
+  auto src=std::make_shared<SourceLayer>(vector<int>{1, 1, 4, 4});
+  src->Setup(LayerProto(), vector<SLayer>{});
+  float* srcdata=src->mutable_data(nullptr)->mutable_cpu_data();
+  for(int i=0;i<16;i++)
+    srcdata[i]=i;
+  auto layer=MaxPooling(src, 1, 2);
+  ASSERT_EQ(vector<int>({1, 1, 3, 3}), layer->data(nullptr).shape());
+  layer->ComputeFeature(true, vector<SLayer>{src});
+  layer->ComputeGradient(vector<SLayer>{src});
+  const float* data=layer->data(nullptr).cpu_data();
+  const float* grad=layer->grad(nullptr).cpu_data();
+  const float* gsrc=src->grad(nullptr).cpu_data();
+  float expected[]={0, 2, 3, 8, 10, 11, 12, 14, 15};
+  for(int i=0;i<9;i++){
+    ASSERT_EQ(expected[i], data[i]);
+    ASSERT_EQ(grad[i], gsrc[static_cast<int>(expected[i])]);
+  }
+  ASSERT_EQ(0, gsrc[1]);
+}
@@ -0,0 +1,147 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "mshadow/tensor.h"
+
+#include "utils/thread_pool.h"
+
+using namespace mshadow;
+using namespace mshadow::expr;
+using singa::ThreadPool;
+
+/**
+ * Run mshadow loops of CPU tensors on a pool of threads, the way
+ * Layer::intra_op_pool() does, and compare them with the serial loops.
+ */
+class MshadowParallelTest: public ::testing::Test {
+ protected:
+  virtual void SetUp(){
+    pool_.reset(new ThreadPool(3));
+    saved_=CPUParallelFor();
+    Install();
+  }
+  virtual void TearDown(){
+    CPUParallelFor()=saved_;
+  }
+  void Install(){
+    ntasks_=0;
+    CPUParallelFor()=[this](index_t n,
+        const std::function<void(index_t, index_t)>& func){
+      ntasks_=n;
+      pool_->ParallelFor(n, [&func](int begin, int end){func(begin, end);});
+    };
+  }
+  void Uninstall(){
+    CPUParallelFor()=ParallelForFunc();
+  }
+  /**
+   * Fill the tensor, including the padding columns, with distinct values.
+   */
+  template<int dim>
+  void Fill(Tensor<cpu, dim> t, float seed){
+    Tensor<cpu, 2> mat=t.FlatTo2D();
+    for(index_t y=0;y<mat.shape[1];y++)
+      for(index_t x=0;x<mat.shape.stride_;x++)
+        mat.dptr[y*mat.shape.stride_+x]=seed+(y*131+x*7)%1013*0.01f;
+  }
+  template<int dim>
+  void ExpectEqual(Tensor<cpu, dim> expected, Tensor<cpu, dim> actual){
+    Tensor<cpu, 2> a=expected.FlatTo2D(), b=actual.FlatTo2D();
+    ASSERT_EQ(a.shape[0], b.shape[0]);
+    ASSERT_EQ(a.shape[1], b.shape[1]);
+    for(index_t y=0;y<a.shape[1];y++)
+      for(index_t x=0;x<a.shape[0];x++)
+        ASSERT_EQ(a[y][x], b[y][x])<<"at ("<<y<<", "<<x<<")";
+  }
+
+  std::unique_ptr<ThreadPool> pool_;
+  ParallelForFunc saved_;
+  //!< num of tasks of the last parallel loop, 0 if the loop is serial
+  std::atomic<index_t> ntasks_;
+};
+
+TEST_F(MshadowParallelTest, MapFlatTensor){
+  // a single row longer than kParallelBlock is split into blocks, by the SSE
+  // plan for aligned tensors and by the scalar plan for unaligned ones
+  const index_t size=10*kParallelBlock+3;
+  Tensor<cpu, 1> a=NewTensor<cpu>(Shape1(size), 0.0f);
+  Tensor<cpu, 1> b=NewTensor<cpu>(Shape1(size), 0.0f);
+  Tensor<cpu, 1> aligned=NewTensor<cpu>(Shape1(size), 0.0f);
+  // one float off the alignment of SSE
+  std::vector<float> buf(2*size+1);
+  Tensor<cpu, 1> serial(buf.data(), Shape1(size));
+  Tensor<cpu, 1> unaligned(buf.data()+size+1, Shape1(size));
+  if(sse2::CheckAlign(unaligned.dptr))
+    unaligned.dptr--;
+  Fill(a, 1.f);
+  Fill(b, -2.f);
+  Uninstall();
+  serial=a*2.0f+b*b;
+  Install();
+  aligned=a*2.0f+b*b;
+  EXPECT_EQ(11, ntasks_);
+  ExpectEqual(serial, aligned);
+  unaligned=a*2.0f+b*b;
+  EXPECT_EQ(11, ntasks_);
+  ExpectEqual(serial, unaligned);
+  for(auto t: {a, b, aligned})
+    FreeSpace(t);
+}
+
+TEST_F(MshadowParallelTest, MapPaddedMatrix){
+  // rows are padded to the SSE width, blocks must not cross rows
+  Shape<2> shape=Shape2(9, 2*kParallelBlock+5);
+  Tensor<cpu, 2> a=NewTensor<cpu>(shape, 0.0f), b=NewTensor<cpu>(shape, 0.0f);
+  Tensor<cpu, 2> serial=NewTensor<cpu>(shape, 0.0f);
+  Tensor<cpu, 2> parallel=NewTensor<cpu>(shape, 0.0f);
+  Fill(a, 0.5f);
+  Fill(b, 3.f);
+  Uninstall();
+  serial=a*b-1.0f;
+  serial+=F<op::identity>(a)/b;
+  Install();
+  parallel=a*b-1.0f;
+  EXPECT_EQ(9*3, ntasks_);
+  parallel+=F<op::identity>(a)/b;
+  ExpectEqual(serial, parallel);
+  for(auto t: {a, b, serial, parallel})
+    FreeSpace(t);
+}
+
+TEST_F(MshadowParallelTest, Reduce){
+  Shape<3> shape=Shape3(5, 300, 97);
+  Tensor<cpu, 3> src=NewTensor<cpu>(shape, 0.0f);
+  Fill(src, -4.f);
+  Tensor<cpu, 2> mat=src.FlatTo2D();
+  Tensor<cpu, 1> keephigh=NewTensor<cpu>(Shape1(300), 0.0f);
+  Tensor<cpu, 1> keeplow=NewTensor<cpu>(Shape1(97), 0.0f);
+  Tensor<cpu, 1> serialhigh=NewTensor<cpu>(Shape1(300), 0.0f);
+  Tensor<cpu, 1> seriallow=NewTensor<cpu>(Shape1(97), 0.0f);
+  Uninstall();
+  serialhigh=sumall_except_dim<1>(src);
+  seriallow=sum_rows(mat);
+  Install();
+  // MapReduceKeepHighDim
+  keephigh=sumall_except_dim<1>(src);
+  EXPECT_LT(1, ntasks_);
+  ExpectEqual(serialhigh, keephigh);
+  // MapReduceKeepLowest
+  ntasks_=0;
+  keeplow=sum_rows(mat);
+  EXPECT_LT(1, ntasks_);
+  ExpectEqual(seriallow, keeplow);
+  for(auto t: {keephigh, keeplow, serialhigh, seriallow})
+    FreeSpace(t);
+  FreeSpace(src);
+}
+
+TEST_F(MshadowParallelTest, SmallTensorSerial){
+  Tensor<cpu, 2> a=NewTensor<cpu>(Shape2(4, 100), 1.0f);
+  Tensor<cpu, 2> b=NewTensor<cpu>(Shape2(4, 100), 0.0f);
+  b=a*3.0f;
+  EXPECT_EQ(0, ntasks_);
+  EXPECT_EQ(3.0f, b[3][99]);
+  FreeSpace(a);
+  FreeSpace(b);
+}
@@ -3,8 +3,16 @@
 
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <atomic>
+#include <fstream>
+#include <set>
+#include <thread>
 
-#include "datasource/shard.h"
+#include "utils/shard.h"
+#include "utils/tensor_shard.h"
+
+using shard::Shard;
+using shard::TensorShard;
 
 std::string key[]={"firstkey","secondkey","3key", "key4", "key5"};
 std::string tuple[]={"firsttuple","2th-tuple","thridtuple", "tuple4", "tuple5"};
@@ -55,3 +63,344 @@ TEST(ShardTest, ReadShard){
   ASSERT_STREQ(key[0].c_str(), k.c_str());
   ASSERT_STREQ(tuple[0].c_str(), t.c_str());
 }
+
+TEST(ShardTest, MmapShard){
+  std::string path="/tmp/shard_test";
+  Shard shard(path, Shard::kMmap);
+  std::string k;
+  const char* val;
+  int len;
+  for(int i=0;i<5;i++){
+    ASSERT_TRUE(shard.Next(&k, &val, &len));
+    ASSERT_STREQ(key[i].c_str(), k.c_str());
+    ASSERT_EQ(tuple[i], std::string(val, len));
+  }
+  ASSERT_FALSE(shard.Next(&k, &val, &len));
+  shard.SeekToFirst();
+  std::string t;
+  ASSERT_TRUE(shard.Next(&k, &t));
+  ASSERT_STREQ(key[0].c_str(), k.c_str());
+  ASSERT_STREQ(tuple[0].c_str(), t.c_str());
+}
+
+TEST(ShardTest, SeekShard){
+  std::string path="/tmp/shard_test";
+  Shard shard(path, Shard::kRead, 50);
+  std::string k, t;
+  ASSERT_TRUE(shard.Read(3, &k, &t));
+  ASSERT_STREQ(key[3].c_str(), k.c_str());
+  ASSERT_STREQ(tuple[3].c_str(), t.c_str());
+  ASSERT_TRUE(shard.Next(&k, &t));
+  ASSERT_STREQ(key[4].c_str(), k.c_str());
+  shard.Seek(1);
+  ASSERT_TRUE(shard.Next(&k, &t));
+  ASSERT_STREQ(key[1].c_str(), k.c_str());
+
+  Shard mshard(path, Shard::kMmap);
+  ASSERT_EQ(5, mshard.Count());
+  ASSERT_TRUE(mshard.Read(2, &k, &t));
+  ASSERT_STREQ(key[2].c_str(), k.c_str());
+  ASSERT_STREQ(tuple[2].c_str(), t.c_str());
+}
+
+TEST(ShardTest, RebuildIndex){
+  std::string path="/tmp/shard_test";
+  std::string idx=path+"/shard.idx";
+  rename(idx.c_str(), (idx+".bak").c_str());
+  Shard shard(path, Shard::kRead, 50);
+  ASSERT_EQ(5, shard.Count());
+  std::string k, t;
+  ASSERT_TRUE(shard.Read(4, &k, &t));
+  ASSERT_STREQ(key[4].c_str(), k.c_str());
+  rename((idx+".bak").c_str(), idx.c_str());
+}
+
+TEST(ShardTest, ShuffleShard){
+  std::string path="/tmp/shard_test";
+  Shard shard(path, Shard::kMmap);
+  shard::ShuffleReader reader(&shard, 2, 2, 0);
+  for(int epoch=1;epoch<=2;epoch++){
+    ASSERT_EQ(epoch, reader.epoch());
+    std::set<std::string> keys;
+    std::string k, t;
+    while(reader.Next(&k, &t))
+      keys.insert(k);
+    ASSERT_EQ(5, keys.size());
+    reader.NextEpoch();
+  }
+}
+
+TEST(ShardTest, CompressedShard){
+  std::string path="/tmp/shard_ctest";
+  mkdir(path.c_str(), S_IRWXU);
+  {
+    // small capacity to put tuples into multiple blocks
+    Shard shard(path, Shard::kCreate, 256, "lz");
+    for(int i=0;i<100;i++)
+      ASSERT_TRUE(shard.Insert("key"+std::to_string(i),
+            std::string(20, 'a'+i%26)));
+    shard.Flush();
+  }
+  {
+    Shard shard(path, Shard::kAppend, 256, "lz");
+    ASSERT_EQ(100, shard.Count());
+    ASSERT_TRUE(shard.Insert("key100", std::string(20, 'x')));
+    shard.Flush();
+  }
+  Shard shard(path, Shard::kRead);
+  std::string k, t;
+  for(int i=0;i<101;i++){
+    ASSERT_TRUE(shard.Next(&k, &t));
+    ASSERT_EQ("key"+std::to_string(i), k);
+  }
+  ASSERT_FALSE(shard.Next(&k, &t));
+  ASSERT_EQ(101, shard.Count());
+  ASSERT_TRUE(shard.Read(57, &k, &t));
+  ASSERT_EQ("key57", k);
+  ASSERT_EQ(std::string(20, 'a'+57%26), t);
+
+  remove((path+"/shard.idx").c_str());
+  Shard mshard(path, Shard::kMmap);
+  ASSERT_EQ(101, mshard.Count());
+  ASSERT_TRUE(mshard.Read(100, &k, &t));
+  ASSERT_EQ("key100", k);
+  ASSERT_EQ(std::string(20, 'x'), t);
+}
+
+TEST(ShardTest, ConcurrentInsert){
+  std::string path="/tmp/shard_wtest";
+  mkdir(path.c_str(), S_IRWXU);
+  {
+    // small capacity to swap buffers frequently
+    Shard shard(path, Shard::kCreate, 1024);
+    shard.StartFlusher();
+    std::vector<std::thread> threads;
+    for(int t=0;t<4;t++)
+      threads.push_back(std::thread([&shard, t](){
+            for(int i=0;i<250;i++)
+              shard.Insert(std::to_string(t)+"-"+std::to_string(i),
+                  std::string(40, 'a'+t));
+            }));
+    for(auto& thread : threads)
+      thread.join();
+    shard.Flush();
+    ASSERT_EQ(1000, shard.Count());
+  }
+  Shard shard(path, Shard::kRead);
+  ASSERT_EQ(1000, shard.Count());
+  std::set<std::string> keys;
+  std::string k, t;
+  while(shard.Next(&k, &t)){
+    ASSERT_EQ(std::string(40, 'a'+k[0]-'0'), t);
+    keys.insert(k);
+  }
+  ASSERT_EQ(1000, keys.size());
+}
+
+TEST(ShardTest, ConcurrentInsertDuplicatedKeys){
+  for(std::string codec : {"", "lz"}){
+    std::string path="/tmp/shard_wdtest"+codec;
+    mkdir(path.c_str(), S_IRWXU);
+    std::atomic<int> ninserted(0);
+    {
+      Shard shard(path, Shard::kCreate, 1024, codec);
+      shard.StartFlusher();
+      // every thread inserts the same keys, in a different order
+      std::vector<std::thread> threads;
+      for(int t=0;t<4;t++)
+        threads.push_back(std::thread([&shard, &ninserted, t](){
+              for(int i=0;i<300;i++){
+                int k=(i*(2*t+1))%300;
+                if(shard.Insert(std::to_string(k), std::string(40, 'a'+k%26)))
+                  ninserted++;
+              }
+            }));
+      for(auto& thread : threads)
+        thread.join();
+      shard.Flush();
+      ASSERT_EQ(300, ninserted);
+      ASSERT_EQ(300, shard.Count());
+    }
+    Shard shard(path, Shard::kRead);
+    ASSERT_EQ(300, shard.Count());
+    std::set<std::string> keys;
+    std::string k, t;
+    while(shard.Next(&k, &t)){
+      ASSERT_EQ(std::string(40, 'a'+std::stoi(k)%26), t);
+      ASSERT_TRUE(keys.insert(k).second)<<"key "<<k<<" is duplicated";
+    }
+    ASSERT_EQ(300, keys.size());
+    ASSERT_EQ(0, shard.ncorrupted());
+  }
+}
+
+TEST(ShardTest, DatasetPartition){
+  std::vector<std::string> folders{"/tmp/shard_dtest-0", "/tmp/shard_dtest-1"};
+  int nums[]={3, 4};
+  for(int i=0;i<2;i++){
+    mkdir(folders[i].c_str(), S_IRWXU);
+    Shard shard(folders[i], Shard::kCreate);
+    for(int k=0;k<nums[i];k++)
+      shard.Insert(std::to_string(i)+"-"+std::to_string(k), "tuple");
+    shard.Flush();
+  }
+  shard::Dataset::WriteManifest("/tmp/shard_dtest.manifest", folders);
+  shard::Dataset dataset("/tmp/shard_dtest.manifest");
+  ASSERT_EQ(7, dataset.Count());
+  // partitions cover all tuples in order, crossing the shard boundary
+  std::vector<std::string> keys;
+  std::string k, t;
+  for(int p=0;p<3;p++){
+    dataset.SetPartition(p, 3);
+    int n=0;
+    while(dataset.Next(&k, &t)){
+      keys.push_back(k);
+      n++;
+    }
+    ASSERT_EQ(dataset.Count(), n);
+  }
+  ASSERT_EQ(7, keys.size());
+  ASSERT_EQ("0-0", keys[0]);
+  ASSERT_EQ("1-0", keys[3]);
+  ASSERT_EQ("1-3", keys[6]);
+  dataset.SetPartition(1, 3);
+  dataset.Seek(1);
+  ASSERT_TRUE(dataset.Next(&k, &t));
+  ASSERT_EQ("1-0", k);
+}
+
+TEST(ShardTest, DuplicatedKeys){
+  std::string path="/tmp/shard_ktest";
+  mkdir(path.c_str(), S_IRWXU);
+  {
+    Shard shard(path, Shard::kCreate);
+    ASSERT_TRUE(shard.Insert("a", "1"));
+    ASSERT_TRUE(shard.Insert("b", "2"));
+    // buffered tuple
+    ASSERT_FALSE(shard.Insert("a", "3"));
+    shard.Flush();
+    // tuple on disk
+    ASSERT_FALSE(shard.Insert("b", "4"));
+    ASSERT_TRUE(shard.Insert("c", "5"));
+    shard.Flush();
+  }
+  {
+    // keys are loaded from shard.key
+    Shard shard(path, Shard::kAppend);
+    ASSERT_FALSE(shard.Insert("c", "6"));
+    ASSERT_TRUE(shard.Insert("d", "7"));
+    shard.Flush();
+  }
+  remove((path+"/shard.key").c_str());
+  {
+    // keys are read from shard.dat
+    Shard shard(path, Shard::kAppend);
+    ASSERT_FALSE(shard.Insert("d", "8"));
+    ASSERT_EQ(4, shard.Count());
+  }
+  Shard shard(path, Shard::kRead);
+  ASSERT_EQ(4, shard.Count());
+}
+
+TEST(ShardTest, CorruptedTuple){
+  std::string path="/tmp/shard_ctest";
+  mkdir(path.c_str(), S_IRWXU);
+  {
+    Shard shard(path, Shard::kCreate, 104857600, "", true);
+    for(int i=0;i<5;i++)
+      shard.Insert(std::to_string(i), "value"+std::to_string(i));
+    shard.Flush();
+  }
+  {
+    // flip one byte of the value of tuple 2
+    std::fstream fdat(path+"/shard.dat",
+        std::ios::in|std::ios::out|std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(fdat)),
+        std::istreambuf_iterator<char>());
+    size_t pos=content.find("value2");
+    ASSERT_NE(std::string::npos, pos);
+    fdat.seekp(pos);
+    fdat.put('V');
+  }
+  for(char mode : {Shard::kRead, Shard::kMmap}){
+    Shard shard(path, mode);
+    std::vector<std::string> keys;
+    std::string key, val;
+    while(shard.Next(&key, &val))
+      keys.push_back(key);
+    ASSERT_EQ(4, keys.size());
+    ASSERT_EQ("1", keys[1]);
+    ASSERT_EQ("3", keys[2]);
+    ASSERT_EQ(1, shard.ncorrupted());
+  }
+  // the last tuple of the first shard of a dataset is corrupted
+  std::vector<std::string> folders{"/tmp/shard_ctest-0", "/tmp/shard_ctest-1"};
+  for(int i=0;i<2;i++){
+    mkdir(folders[i].c_str(), S_IRWXU);
+    Shard shard(folders[i], Shard::kCreate, 104857600, "", true);
+    for(int k=0;k<3;k++)
+      shard.Insert(std::to_string(i)+"-"+std::to_string(k),
+          "value"+std::to_string(i)+std::to_string(k));
+    shard.Flush();
+  }
+  {
+    std::fstream fdat(folders[0]+"/shard.dat",
+        std::ios::in|std::ios::out|std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(fdat)),
+        std::istreambuf_iterator<char>());
+    size_t pos=content.find("value02");
+    ASSERT_NE(std::string::npos, pos);
+    fdat.seekp(pos);
+    fdat.put('V');
+  }
+  shard::Dataset::WriteManifest("/tmp/shard_ctest.manifest", folders);
+  for(char mode : {Shard::kRead, Shard::kMmap}){
+    shard::Dataset dataset("/tmp/shard_ctest.manifest", mode);
+    std::vector<std::string> keys;
+    std::string key, val;
+    while(dataset.Next(&key, &val))
+      keys.push_back(key);
+    ASSERT_EQ(5, keys.size());
+    ASSERT_EQ("0-1", keys[1]);
+    ASSERT_EQ("1-0", keys[2]);
+    ASSERT_EQ("1-2", keys[4]);
+    ASSERT_EQ(1, dataset.ncorrupted());
+  }
+}
+
+TEST(ShardTest, TensorShard){
+  std::string path="/tmp/shard_ttest";
+  mkdir(path.c_str(), S_IRWXU);
+  std::vector<int> shape{2, 3};
+  {
+    TensorShard shard(path, TensorShard::kCreate, TensorShard::kUInt8, shape);
+    ASSERT_EQ(6, shard.record_size());
+    for(char i=0;i<3;i++)
+      shard.Insert(std::string(6, 'a'+i).data(), i);
+    shard.Flush();
+  }
+  {
+    // a record written partially
+    std::ofstream fdat(path+"/tensor.dat", std::ios::app|std::ios::binary);
+    fdat<<"xyz";
+  }
+  {
+    TensorShard shard(path, TensorShard::kAppend, TensorShard::kUInt8, shape);
+    ASSERT_EQ(3, shard.Count());
+    shard.Insert(std::string(6, 'd').data(), 3);
+    shard.Flush();
+  }
+  TensorShard shard(path, TensorShard::kRead);
+  ASSERT_EQ(4, shard.Count());
+  ASSERT_EQ(shape, shard.shape());
+  ASSERT_EQ(TensorShard::kUInt8, shard.dtype());
+  ASSERT_EQ('c', shard.tensor(2)[5]);
+  // wrap around at the end
+  char tensors[18];
+  int labels[3];
+  ASSERT_EQ(1, shard.Read(2, 3, tensors, labels));
+  ASSERT_EQ(std::string(6, 'c')+std::string(6, 'd')+std::string(6, 'a'),
+      std::string(tensors, 18));
+  ASSERT_EQ(3, labels[1]);
+  ASSERT_EQ(0, labels[2]);
+}
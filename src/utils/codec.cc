@@ -0,0 +1,208 @@
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "utils/codec.h"
+#include "utils/factory.h"
+#include "utils/singleton.h"
+
+namespace shard {
+
+Codec* Codec::Create(const std::string& name){
+  static std::once_flag flag;
+  std::call_once(flag, [](){
+      Factory<Codec>* factory=Singleton<Factory<Codec>>::Instance();
+      factory->Register("lz", CreateInstance(LZCodec, Codec));
+    });
+  CHECK_LT(name.size(), 16)<<"Codec name is too long "<<name;
+  return Singleton<Factory<Codec>>::Instance()->Create(name);
+}
+
+/***************************LZCodec*****************************************/
+const int kHashBits=16;
+const size_t kMinMatch=4;
+const size_t kMaxOffset=65535;
+// keep the last bytes as literals so that matching never reads beyond input
+const size_t kLastLiterals=5;
+
+inline uint32_t Load32(const uint8_t* p){
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint8_t* WriteLength(uint8_t* out, size_t len){
+  for(;len>=255;len-=255)
+    *out++=255;
+  *out++=static_cast<uint8_t>(len);
+  return out;
+}
+
+/**
+ * Write one sequence; matchlen=0 for the last sequence, which has no offset.
+ */
+inline uint8_t* WriteSequence(uint8_t* out, const uint8_t* literals,
+    size_t litlen, size_t offset, size_t matchlen){
+  uint8_t* token=out++;
+  size_t mlen=matchlen>0?matchlen-kMinMatch:0;
+  *token=static_cast<uint8_t>((std::min<size_t>(litlen, 15)<<4)
+      |std::min<size_t>(mlen, 15));
+  if(litlen>=15)
+    out=WriteLength(out, litlen-15);
+  memcpy(out, literals, litlen);
+  out+=litlen;
+  if(matchlen>0){
+    *out++=static_cast<uint8_t>(offset&0xff);
+    *out++=static_cast<uint8_t>(offset>>8);
+    if(mlen>=15)
+      out=WriteLength(out, mlen-15);
+  }
+  return out;
+}
+
+size_t LZCodec::MaxCompressedSize(size_t size){
+  return size+size/255+16;
+}
+
+size_t LZCodec::Compress(const char* src, size_t size, char* dst){
+  const uint8_t* in=reinterpret_cast<const uint8_t*>(src);
+  uint8_t* out=reinterpret_cast<uint8_t*>(dst);
+  table_.assign(1<<kHashBits, 0);
+  size_t anchor=0, pos=0;
+  while(pos+kMinMatch+kLastLiterals<=size){
+    uint32_t seq=Load32(in+pos);
+    uint32_t h=(seq*2654435761u)>>(32-kHashBits);
+    size_t ref=table_[h];
+    table_[h]=pos+1;
+    if(ref>0&&pos-(ref-1)<=kMaxOffset&&Load32(in+ref-1)==seq){
+      ref--;
+      size_t len=kMinMatch;
+      while(pos+len+kLastLiterals<size&&in[ref+len]==in[pos+len])
+        len++;
+      out=WriteSequence(out, in+anchor, pos-anchor, pos-ref, len);
+      pos+=len;
+      anchor=pos;
+    }else{
+      pos++;
+    }
+  }
+  out=WriteSequence(out, in+anchor, size-anchor, 0, 0);
+  return out-reinterpret_cast<uint8_t*>(dst);
+}
+
+/**
+ * Read a length continued by 255 bytes.
+ * @return false if the input ends.
+ */
+inline bool ReadLength(const uint8_t** ip, const uint8_t* iend, size_t* len){
+  uint8_t b;
+  do{
+    if(*ip>=iend)
+      return false;
+    b=*(*ip)++;
+    *len+=b;
+  }while(b==255);
+  return true;
+}
+
+bool LZCodec::Decompress(const char* src, size_t size, char* dst,
+    size_t rawsize){
+  const uint8_t* ip=reinterpret_cast<const uint8_t*>(src);
+  const uint8_t* iend=ip+size;
+  uint8_t* op=reinterpret_cast<uint8_t*>(dst);
+  uint8_t* ostart=op;
+  uint8_t* oend=op+rawsize;
+  while(ip<iend){
+    uint8_t token=*ip++;
+    size_t litlen=token>>4;
+    if(litlen==15&&!ReadLength(&ip, iend, &litlen))
+      return false;
+    if(litlen>static_cast<size_t>(iend-ip)
+        ||litlen>static_cast<size_t>(oend-op))
+      return false;
+    memcpy(op, ip, litlen);
+    ip+=litlen;
+    op+=litlen;
+    // the last sequence has only literals
+    if(ip==iend)
+      break;
+    if(iend-ip<2)
+      return false;
+    size_t offset=ip[0]|(ip[1]<<8);
+    ip+=2;
+    size_t matchlen=token&15;
+    if(matchlen==15&&!ReadLength(&ip, iend, &matchlen))
+      return false;
+    matchlen+=kMinMatch;
+    if(offset==0||offset>static_cast<size_t>(op-ostart)
+        ||matchlen>static_cast<size_t>(oend-op))
+      return false;
+    // byte by byte copy since the match may overlap the output
+    const uint8_t* ref=op-offset;
+    for(size_t i=0;i<matchlen;i++)
+      op[i]=ref[i];
+    op+=matchlen;
+  }
+  return op==oend;
+}
+
+/***************************CRC-32C*****************************************/
+#ifdef __SSE4_2__
+uint32_t Crc32c(uint32_t crc, const char* data, size_t size){
+  uint64_t c=~crc;
+  for(;size>=8;size-=8,data+=8){
+    uint64_t v;
+    memcpy(&v, data, sizeof(v));
+    c=_mm_crc32_u64(c, v);
+  }
+  uint32_t c32=static_cast<uint32_t>(c);
+  for(;size>0;size--)
+    c32=_mm_crc32_u8(c32, static_cast<uint8_t>(*data++));
+  return ~c32;
+}
+#else
+/**
+ * Tables for processing 8 bytes per step, table[k][b] is the CRC of byte b
+ * followed by k zero bytes.
+ */
+struct Crc32cTable {
+  uint32_t table[8][256];
+  Crc32cTable(){
+    // reversed Castagnoli polynomial
+    const uint32_t poly=0x82f63b78;
+    for(uint32_t b=0;b<256;b++){
+      uint32_t c=b;
+      for(int k=0;k<8;k++)
+        c=c&1?(c>>1)^poly:c>>1;
+      table[0][b]=c;
+    }
+    for(uint32_t b=0;b<256;b++)
+      for(int k=1;k<8;k++)
+        table[k][b]=(table[k-1][b]>>8)^table[0][table[k-1][b]&0xff];
+  }
+};
+
+uint32_t Crc32c(uint32_t crc, const char* data, size_t size){
+  static const Crc32cTable tables;
+  const uint32_t (*t)[256]=tables.table;
+  const uint8_t* p=reinterpret_cast<const uint8_t*>(data);
+  uint32_t c=~crc;
+  for(;size>=8;size-=8,p+=8){
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p+4, 4);
+    lo^=c;
+    c=t[7][lo&0xff]^t[6][(lo>>8)&0xff]^t[5][(lo>>16)&0xff]^t[4][lo>>24]
+      ^t[3][hi&0xff]^t[2][(hi>>8)&0xff]^t[1][(hi>>16)&0xff]^t[0][hi>>24];
+  }
+  for(;size>0;size--)
+    c=(c>>8)^t[0][(c^*p++)&0xff];
+  return ~c;
+}
+#endif
+} /* shard */
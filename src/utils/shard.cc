@@ -1,10 +1,87 @@
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+#include <climits>
+#include <sstream>
 
 #include "utils/shard.h"
 namespace shard {
 
-Shard::Shard(std::string folder, char mode, int capacity){
+// header of compressed or checksummed shard.dat
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  char codec[16];
+};
+const char kMagic[8]={'S', 'G', 'S', 'H', 'A', 'R', 'D', '\0'};
+const uint32_t kVersion=1;
+// bits of Header::flags
+const uint32_t kCompressed=1;
+const uint32_t kChecksum=2;
+// max bytes of raw tuples in one compressed block, tuples larger than it are
+// compressed into their own blocks
+const int kBlockSize=1<<20;
+
+/**
+ * Parse the tuple starting at *offset of data.
+ * @param checksum true if the tuple ends with a CRC-32C checksum
+ * @param verify true to verify the checksum
+ * @return false if the tuple is incomplete or corrupted; otherwise *offset is
+ * moved to the end of the tuple.
+ */
+inline bool ParseTuple(const char* data, size_t size, size_t* offset,
+    std::string* key, const char** val, size_t* vallen, bool checksum,
+    bool verify){
+  size_t ssize=sizeof(size_t);
+  size_t pos=*offset;
+  if(pos+ssize>size)
+    return false;
+  size_t keylen;
+  memcpy(&keylen, data+pos, ssize);
+  if(keylen>size||pos+ssize+keylen+ssize>size)
+    return false;
+  if(key!=nullptr)
+    key->assign(data+pos+ssize, keylen);
+  pos+=ssize+keylen;
+  size_t len;
+  memcpy(&len, data+pos, ssize);
+  pos+=ssize;
+  if(len==0||len>size||pos+len>size)
+    return false;
+  *val=data+pos;
+  *vallen=len;
+  pos+=len;
+  if(checksum){
+    uint32_t crc;
+    if(pos+sizeof(crc)>size)
+      return false;
+    memcpy(&crc, data+pos, sizeof(crc));
+    if(verify&&crc!=Crc32c(0, data+*offset, pos-*offset))
+      return false;
+    pos+=sizeof(crc);
+  }
+  *offset=pos;
+  return true;
+}
+
+/**
+ * @return CRC-32C checksum of the tuple [keylen key vallen val]
+ */
+inline uint32_t TupleChecksum(const char* key, size_t keylen, const char* val,
+    size_t vallen){
+  uint32_t crc=Crc32c(0, reinterpret_cast<char*>(&keylen), sizeof(keylen));
+  crc=Crc32c(crc, key, keylen);
+  crc=Crc32c(crc, reinterpret_cast<char*>(&vallen), sizeof(vallen));
+  return Crc32c(crc, val, vallen);
+}
+
+Shard::Shard(std::string folder, char mode, int capacity, std::string codec,
+    bool checksum){
   struct stat sb;
   if(stat(folder.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode)){
     LOG(INFO)<<"Open shard folder "<<folder;
@@ -13,31 +90,165 @@ Shard::Shard(std::string folder, char mode, int capacity){
   }
 
   path_= folder+"/shard.dat";
+  idx_path_= folder+"/shard.idx";
+  key_path_= folder+"/shard.key";
+  mode_=mode;
+  offset_=0;
+  bufsize_=0;
+  // kMmap needs a buffer only for decompressing blocks, allocated on demand
+  capacity_=mode==Shard::kMmap?0:capacity;
+  count_=0;
+  fileoffset_=0;
+  mmap_=nullptr;
+  mmap_size_=0;
+  mmap_offset_=0;
+  datsize_=0;
+  datastart_=0;
+  block_pos_=0;
+  next_block_=0;
+  wbuf_=nullptr;
+  wsize_=0;
+  flushing_=false;
+  stop_=false;
+  nwritten_=0;
+  vblock_pos_=0;
+  checksum_=false;
+  next_index_=0;
+  ncorrupted_=0;
+  // tuples are read from the mapping directly in kMmap, no buffer is needed
+  buf_=mode==Shard::kMmap?nullptr:new char[capacity];
+  std::string header_codec;
+  if(mode!=Shard::kCreate)
+    datastart_=ReadHeader(&header_codec);
   if(mode==Shard::kRead){
     fdat_.open(path_, std::ios::in|std::ios::binary);
     CHECK(fdat_.is_open())<<"Cannot create file "<<path_;
+    CHECK_EQ(stat(path_.c_str(), &sb), 0)<<"Cannot stat file "<<path_;
+    datsize_=sb.st_size;
+    fdat_.seekg(datastart_);
   }
   if(mode==Shard::kCreate){
     fdat_.open(path_, std::ios::binary|std::ios::out|std::ios::trunc);
     CHECK(fdat_.is_open())<<"Cannot create file "<<path_;
+    fidx_.open(idx_path_, std::ios::binary|std::ios::out|std::ios::trunc);
+    CHECK(fidx_.is_open())<<"Cannot create file "<<idx_path_;
+    fkey_.open(key_path_, std::ios::binary|std::ios::out|std::ios::trunc);
+    CHECK(fkey_.is_open())<<"Cannot create file "<<key_path_;
+    if(codec.size()||checksum)
+      WriteHeader(codec, checksum);
   }
   if(mode==Shard::kAppend){
-    int last_tuple=PrepareForAppend(path_);
+    if(datastart_>0&&(codec!=header_codec||checksum!=checksum_))
+      LOG(WARNING)<<"Append to "<<path_<<" in its own format, i.e., codec '"
+        <<header_codec<<"' and checksum "<<checksum_;
+    size_t last_tuple=PrepareForAppend(path_);
+    if(last_tuple==0&&(codec.size()||checksum)){
+      // new or empty shard
+      fdat_.open(path_, std::ios::binary|std::ios::out|std::ios::trunc);
+      WriteHeader(codec, checksum);
+      fdat_.close();
+      last_tuple=datastart_;
+    }else if(datastart_==0&&(codec.size()||checksum)){
+      LOG(WARNING)<<"Append to raw shard "<<path_<<" without codec and checksum";
+    }
+    // drop the incomplete tuple (if any) left by the crashed write
+    CHECK_EQ(truncate(path_.c_str(), last_tuple), 0)<<"Cannot truncate "<<path_;
     fdat_.open(path_, std::ios::binary|std::ios::out|std::ios::in|std::ios::ate);
     CHECK(fdat_.is_open())<<"Cannot create file "<<path_;
     fdat_.seekp(last_tuple);
+    fileoffset_=last_tuple;
+    std::vector<uint64_t> hashes;
+    LoadKeys(&hashes);
+    // rewrite the index and keys from the ones collected above
+    fidx_.open(idx_path_, std::ios::binary|std::ios::out|std::ios::trunc);
+    CHECK(fidx_.is_open())<<"Cannot create file "<<idx_path_;
+    fkey_.open(key_path_, std::ios::binary|std::ios::out|std::ios::trunc);
+    CHECK(fkey_.is_open())<<"Cannot create file "<<key_path_;
+    count_=index_.size();
+    nwritten_=count_;
+    WriteIndex(index_, block_index_);
+    fkey_.write(reinterpret_cast<char*>(hashes.data()),
+        hashes.size()*sizeof(uint64_t));
+    for(size_t i=0;i<hashes.size();i++)
+      keys_.Insert(hashes[i], i);
+    index_.clear();
+    block_index_.clear();
   }
 
-  mode_=mode;
-  offset_=0;
-  bufsize_=0;
-  capacity_=capacity;
-  buf_=new char[capacity];
+  if(mode==Shard::kMmap){
+    MapFile();
+    datsize_=mmap_size_;
+    mmap_offset_=datastart_;
+  }
+  next_block_=datastart_;
 }
 
 Shard:: ~Shard(){
-  delete buf_;
+  if(flusher_.joinable()){
+    {
+      std::unique_lock<std::mutex> lck(mtx_);
+      stop_=true;
+      filled_.notify_one();
+    }
+    flusher_.join();
+  }
+  delete[] wbuf_;
+  delete[] buf_;
+  if(mmap_!=nullptr)
+    munmap(mmap_, mmap_size_);
   fdat_.close();
+  fidx_.close();
+  fkey_.close();
+}
+
+size_t Shard::ReadHeader(std::string* codec){
+  std::ifstream fin(path_, std::ios::in|std::ios::binary);
+  Header header;
+  if(!fin.is_open())
+    return 0;
+  fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if(!fin.good()||memcmp(header.magic, kMagic, sizeof(kMagic))!=0)
+    return 0;
+  CHECK_LE(header.version, kVersion)<<"Unknown shard version of "<<path_;
+  checksum_=header.flags&kChecksum;
+  if(header.flags&kCompressed){
+    header.codec[sizeof(header.codec)-1]='\0';
+    codec->assign(header.codec);
+    codec_.reset(Codec::Create(*codec));
+  }
+  return sizeof(header);
+}
+
+void Shard::WriteHeader(const std::string& codec, bool checksum){
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version=kVersion;
+  header.flags=(codec.size()?kCompressed:0)|(checksum?kChecksum:0);
+  CHECK_LT(codec.size(), sizeof(header.codec))<<"Codec name is too long";
+  memcpy(header.codec, codec.data(), codec.size());
+  if(codec.size())
+    codec_.reset(Codec::Create(codec));
+  checksum_=checksum;
+  fdat_.write(reinterpret_cast<char*>(&header), sizeof(header));
+  datastart_=sizeof(header);
+  fileoffset_=datastart_;
+}
+
+void Shard::MapFile(){
+  int fd=open(path_.c_str(), O_RDONLY);
+  CHECK_NE(fd, -1)<<"Cannot open file "<<path_;
+  struct stat sb;
+  CHECK_EQ(fstat(fd, &sb), 0)<<"Cannot stat file "<<path_;
+  mmap_size_=sb.st_size;
+  if(mmap_size_>0){
+    void* addr=mmap(nullptr, mmap_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    CHECK(addr!=MAP_FAILED)<<"Cannot mmap file "<<path_;
+    mmap_=static_cast<char*>(addr);
+    // records are mostly read in order, let the kernel read ahead aggressively
+    madvise(mmap_, mmap_size_, MADV_SEQUENTIAL);
+  }
+  close(fd);
 }
 
 bool Shard::Insert(const std::string& key, const Message& val) {
@@ -47,15 +258,48 @@ bool Shard::Insert(const std::string& key, const Message& val) {
 }
 // insert one complete tuple
 bool Shard::Insert(const std::string& key, const std::string& val) {
-  if(keys_.find(key)!=keys_.end()||val.size()==0)
+  if(val.size()==0)
     return false;
-  int size=key.size()+val.size()+2*sizeof(size_t);
-  if(offset_+size>capacity_){
-    fdat_.write(buf_, offset_);
-    offset_=0;
-    CHECK_LE(size, capacity_)<<"Tuple size is larger than capacity"
-      <<"Try a larger capacity size";
+  // computed before locking, which lets multiple producers compute in parallel
+  uint64_t hash=KeySet::Hash(key);
+  uint32_t crc=checksum_?TupleChecksum(key.data(), key.size(), val.data(),
+      val.size()):0;
+  int size=key.size()+val.size()+2*sizeof(size_t)
+    +(checksum_?sizeof(crc):0);
+  CHECK_LE(size, capacity_)<<"Tuple size is larger than capacity"
+    <<"Try a larger capacity size";
+  // small blocks for compressed shards to make Seek() cheap
+  int limit=codec_!=nullptr?std::min(capacity_, kBlockSize):capacity_;
+  std::unique_lock<std::mutex> lck(mtx_);
+  std::vector<int> ids;
+  std::string other;
+  // waiting for the flusher releases mtx_, during which other producers may
+  // insert the same key or swap buf_; hence wait before checking and start
+  // over after every wait
+  while(true){
+    keys_.Find(hash, &ids);
+    // tuples before buf_ are read back from the file once it is written
+    int first=count_-index_.size();
+    bool inbuf=true;
+    for(int id : ids)
+      inbuf&=id>=first;
+    if(flushing_&&(!inbuf||(offset_>0&&offset_+size>limit))){
+      flushed_.wait(lck);
+      continue;
+    }
+    for(int id : ids){
+      ReadKey(id, &other, &lck);
+      if(other==key)
+        return false;
+    }
+    if(offset_>0&&offset_+size>limit)
+      WriteBuffer(&lck);
+    break;
   }
+  index_.push_back(offset_);
+  hashes_.push_back(hash);
+  keys_.Insert(hash, count_);
+  count_++;
   *reinterpret_cast<size_t*>(buf_+offset_)=key.size();
   offset_+=sizeof(size_t);
   memcpy(buf_+offset_, key.data(), key.size());
@@ -64,79 +308,307 @@ bool Shard::Insert(const std::string& key, const std::string& val) {
   offset_+=sizeof(size_t);
   memcpy(buf_+offset_, val.data(), val.size());
   offset_+=val.size();
+  if(checksum_){
+    memcpy(buf_+offset_, &crc, sizeof(crc));
+    offset_+=sizeof(crc);
+  }
   return true;
 }
 
 void Shard::Flush() {
-  fdat_.write(buf_, offset_);
+  std::unique_lock<std::mutex> lck(mtx_);
+  WriteBuffer(&lck);
+  // wait until the flusher has written all tuples
+  while(flushing_)
+    flushed_.wait(lck);
   fdat_.flush();
+  fidx_.flush();
+  fkey_.flush();
+}
+
+void Shard::StartFlusher(){
+  CHECK(mode_==kCreate||mode_==kAppend);
+  std::unique_lock<std::mutex> lck(mtx_);
+  if(flusher_.joinable())
+    return;
+  wbuf_=new char[capacity_];
+  flusher_=std::thread(&Shard::FlushLoop, this);
+}
+
+void Shard::FlushLoop(){
+  std::unique_lock<std::mutex> lck(mtx_);
+  while(true){
+    while(!flushing_&&!stop_)
+      filled_.wait(lck);
+    if(!flushing_)
+      break;
+    // producers keep inserting into buf_ while wbuf_ is being written
+    lck.unlock();
+    WriteBlock(wbuf_, wsize_, &windex_, &whashes_);
+    lck.lock();
+    flushing_=false;
+    flushed_.notify_all();
+  }
+}
+
+void Shard::WriteBuffer(std::unique_lock<std::mutex>* lck) {
+  if(offset_==0)
+    return;
+  if(!flusher_.joinable()){
+    WriteBlock(buf_, offset_, &index_, &hashes_);
+  }else{
+    // wait until the flusher releases the other buffer
+    while(flushing_)
+      flushed_.wait(*lck);
+    // other producers may have swapped buf_ during the wait
+    if(offset_==0)
+      return;
+    std::swap(buf_, wbuf_);
+    index_.swap(windex_);
+    hashes_.swap(whashes_);
+    wsize_=offset_;
+    flushing_=true;
+    filled_.notify_one();
+  }
   offset_=0;
 }
 
+void Shard::WriteBlock(const char* buf, int size, std::vector<size_t>* index,
+    std::vector<uint64_t>* hashes){
+  std::vector<size_t> blocks;
+  if(codec_==nullptr){
+    fdat_.write(buf, size);
+    for(auto& offset : *index)
+      offset+=fileoffset_;
+    fileoffset_+=size;
+  }else{
+    size_t head[2]={static_cast<size_t>(size), 0};
+    cbuf_.resize(codec_->MaxCompressedSize(size));
+    head[1]=codec_->Compress(buf, size, &cbuf_[0]);
+    fdat_.write(reinterpret_cast<char*>(head), sizeof(head));
+    fdat_.write(cbuf_.data(), head[1]);
+    blocks.assign(index->size(), fileoffset_);
+    fileoffset_+=sizeof(head)+head[1];
+  }
+  // index entries are written after the tuples they point to
+  WriteIndex(*index, blocks);
+  fkey_.write(reinterpret_cast<char*>(hashes->data()),
+      hashes->size()*sizeof(uint64_t));
+  nwritten_+=index->size();
+  index->clear();
+  hashes->clear();
+}
+
+void Shard::ReadKey(int id, std::string* key,
+    std::unique_lock<std::mutex>* lck){
+  // id of the first tuple in buf_
+  int first=count_-index_.size();
+  if(id>=first){
+    size_t keylen;
+    memcpy(&keylen, buf_+index_[id-first], sizeof(keylen));
+    key->assign(buf_+index_[id-first]+sizeof(keylen), keylen);
+    return;
+  }
+  // the tuple is in wbuf_ or on disk
+  while(flushing_)
+    flushed_.wait(*lck);
+  CHECK_LT(id, nwritten_);
+  fdat_.flush();
+  fidx_.flush();
+  if(!fidx_in_.is_open()){
+    fidx_in_.open(idx_path_, std::ios::in|std::ios::binary);
+    CHECK(fidx_in_.is_open())<<"Cannot open file "<<idx_path_;
+  }
+  size_t entry[2]={0, 0};
+  size_t width=codec_!=nullptr?2:1;
+  fidx_in_.clear();
+  fidx_in_.seekg(id*width*sizeof(size_t));
+  fidx_in_.read(reinterpret_cast<char*>(entry), width*sizeof(size_t));
+  CHECK(fidx_in_.good())<<"Cannot read index of tuple "<<id;
+  if(codec_!=nullptr)
+    ReadKeyAt(entry[0], entry[1], key);
+  else
+    ReadKeyAt(0, entry[0], key);
+}
+
+void Shard::ReadKeyAt(size_t block, size_t offset, std::string* key){
+  if(!fdat_in_.is_open()){
+    fdat_in_.open(path_, std::ios::in|std::ios::binary);
+    CHECK(fdat_in_.is_open())<<"Cannot open file "<<path_;
+  }
+  size_t keylen;
+  fdat_in_.clear();
+  if(codec_==nullptr){
+    fdat_in_.seekg(offset);
+    fdat_in_.read(reinterpret_cast<char*>(&keylen), sizeof(keylen));
+    key->resize(keylen);
+    fdat_in_.read(&(*key)[0], keylen);
+    CHECK(fdat_in_.good())<<"Cannot read key at "<<offset<<" of "<<path_;
+    return;
+  }
+  // keys are mostly verified in insertion order, hence the block is cached
+  if(vblock_.empty()||vblock_pos_!=block){
+    size_t head[2];
+    fdat_in_.seekg(block);
+    fdat_in_.read(reinterpret_cast<char*>(head), sizeof(head));
+    std::string payload(head[1], '\0');
+    fdat_in_.read(&payload[0], head[1]);
+    CHECK(fdat_in_.good())<<"Cannot read block "<<block<<" of "<<path_;
+    vblock_.resize(head[0]);
+    CHECK(codec_->Decompress(payload.data(), head[1], &vblock_[0], head[0]))
+      <<"Corrupted block "<<block<<" of "<<path_;
+    vblock_pos_=block;
+  }
+  CHECK_LE(offset+sizeof(keylen), vblock_.size());
+  memcpy(&keylen, vblock_.data()+offset, sizeof(keylen));
+  CHECK_LE(offset+sizeof(keylen)+keylen, vblock_.size());
+  key->assign(vblock_.data()+offset+sizeof(keylen), keylen);
+}
+
+void Shard::WriteIndex(const std::vector<size_t>& index,
+    const std::vector<size_t>& blocks){
+  if(codec_==nullptr){
+    fidx_.write(reinterpret_cast<const char*>(index.data()),
+        index.size()*sizeof(size_t));
+  }else{
+    CHECK_EQ(index.size(), blocks.size());
+    std::vector<size_t> entries;
+    for(size_t i=0;i<index.size();i++){
+      entries.push_back(blocks[i]);
+      entries.push_back(index[i]);
+    }
+    fidx_.write(reinterpret_cast<char*>(entries.data()),
+        entries.size()*sizeof(size_t));
+  }
+}
+
 int Shard::Next(std::string *key){
   key->clear();
-  int ssize=sizeof(size_t);
+  size_t ssize=sizeof(size_t), csize=checksum_?sizeof(uint32_t):0;
   if(!PrepareNextField(ssize))
     return 0;
-  CHECK_LE(offset_+ssize, bufsize_);
-  int keylen=*reinterpret_cast<size_t*>(buf_+offset_);
+  size_t keylen=*reinterpret_cast<size_t*>(buf_+offset_);
   offset_+=ssize;
 
-  if(!PrepareNextField(keylen))
+  // lengths larger than the buffer are corrupted
+  if(keylen>static_cast<size_t>(capacity_)||!PrepareNextField(keylen))
     return 0;
-  CHECK_LE(offset_+keylen, bufsize_);
-  for(int i=0;i<keylen;i++)
-    key->push_back(buf_[offset_+i]);
+  key->assign(buf_+offset_, keylen);
   offset_+=keylen;
 
   if(!PrepareNextField(ssize))
     return 0;
-  CHECK_LE(offset_+ssize, bufsize_);
-  int vallen=*reinterpret_cast<size_t*>(buf_+offset_);
+  size_t vallen=*reinterpret_cast<size_t*>(buf_+offset_);
   offset_+=ssize;
 
-  if(!PrepareNextField(vallen))
+  if(vallen==0||vallen+csize>static_cast<size_t>(capacity_)
+      ||!PrepareNextField(vallen+csize))
     return 0;
-  CHECK_LE(offset_+vallen, bufsize_);
+  if(checksum_){
+    uint32_t crc;
+    memcpy(&crc, buf_+offset_+vallen, sizeof(crc));
+    if(crc!=TupleChecksum(key->data(), keylen, buf_+offset_, vallen))
+      return 0;
+  }
   return vallen;
 }
 
-bool Shard::Next(std::string *key, Message* val) {
-  int vallen=Next(key);
-  if(vallen==0)
+bool Shard::Next(std::string *key, const char** val, int* vallen) {
+  while(!NextTuple(key, val, vallen))
+    if(!SkipCorrupted())
+      return false;
+  next_index_++;
+  return true;
+}
+
+bool Shard::NextTuple(std::string *key, const char** val, int* vallen) {
+  size_t len;
+  if(codec_!=nullptr){
+    while(offset_>=bufsize_)
+      if(!LoadBlock(&fdat_, next_block_))
+        return false;
+    size_t offset=offset_;
+    if(!ParseTuple(buf_, bufsize_, &offset, key, val, &len, checksum_, true))
+      return false;
+    offset_=offset;
+    *vallen=len;
+  }else if(mode_==kMmap){
+    if(!ParseTuple(mmap_, mmap_size_, &mmap_offset_, key, val, &len,
+          checksum_, true))
+      return false;
+    *vallen=len;
+  }else{
+    *vallen=Next(key);
+    if(*vallen==0)
+      return false;
+    *val=buf_+offset_;
+    offset_+=*vallen+(checksum_?sizeof(uint32_t):0);
+  }
+  return true;
+}
+
+bool Shard::SkipCorrupted(){
+  LoadIndex();
+  int count=index_.size();
+  // the end, or an incomplete tuple left by a crashed write
+  if(next_index_>=count)
+    return false;
+  int next=next_index_+1;
+  if(codec_!=nullptr&&!LoadBlock(&fdat_, block_index_[next_index_])){
+    // skip all tuples of the corrupted block
+    while(next<count&&block_index_[next]==block_index_[next_index_])
+      next++;
+  }
+  LOG(WARNING)<<"Skip "<<next-next_index_<<" corrupted tuples from the "
+    <<next_index_<<"-th tuple of "<<path_;
+  ncorrupted_+=next-next_index_;
+  if(next>=count){
+    next_index_=count;
     return false;
-  val->ParseFromArray(buf_+offset_, vallen);
-  offset_+=vallen;
+  }
+  Seek(next);
+  return true;
+}
+
+bool Reader::Next(std::string *key, Message* val) {
+  const char* ptr;
+  int vallen;
+  if(!Next(key, &ptr, &vallen))
+    return false;
+  val->ParseFromArray(ptr, vallen);
   return true;
 }
 
-bool Shard::Next(std::string *key, std::string* val) {
-  int vallen=Next(key);
-  if(vallen==0)
+bool Reader::Next(std::string *key, std::string* val) {
+  const char* ptr;
+  int vallen;
+  if(!Next(key, &ptr, &vallen))
     return false;
-  val->clear();
-  for(int i=0;i<vallen;i++)
-    val->push_back(buf_[offset_+i]);
-  offset_+=vallen;
+  val->assign(ptr, vallen);
   return true;
 }
 
 void Shard::SeekToFirst(){
-  CHECK_EQ(mode_, kRead);
+  CHECK(mode_==kRead||mode_==kMmap);
   bufsize_=0;
   offset_=0;
+  next_block_=datastart_;
+  next_index_=0;
+  if(mode_==kMmap){
+    mmap_offset_=datastart_;
+    return;
+  }
   fdat_.close();
   fdat_.open(path_, std::ios::in|std::ios::binary);
   CHECK(fdat_.is_open())<<"Cannot create file "<<path_;
+  fdat_.seekg(datastart_);
 }
 
 // if the buf does not have the next complete field, read data from disk
 bool Shard::PrepareNextField(int size){
   if(offset_+size>bufsize_){
     bufsize_-=offset_;
-    CHECK_LE(bufsize_, offset_);
-    for(int i=0;i<bufsize_;i++)
-      buf_[i]=buf_[i+offset_];
+    memmove(buf_, buf_+offset_, bufsize_);
     offset_=0;
     if(fdat_.eof())
       return false;
@@ -145,34 +617,227 @@ bool Shard::PrepareNextField(int size){
       bufsize_+=fdat_.gcount();
     }
   }
+  return offset_+size<=bufsize_;
+}
+
+bool Shard::LoadBlock(std::istream* fin, size_t pos){
+  size_t head[2];
+  if(pos+sizeof(head)>datsize_)
+    return false;
+  if(mmap_!=nullptr){
+    memcpy(head, mmap_+pos, sizeof(head));
+  }else{
+    fin->clear();
+    fin->seekg(pos);
+    fin->read(reinterpret_cast<char*>(head), sizeof(head));
+    if(!fin->good())
+      return false;
+  }
+  size_t rawsize=head[0], compsize=head[1];
+  if(compsize>datsize_||pos+sizeof(head)+compsize>datsize_
+      ||rawsize>static_cast<size_t>(INT_MAX))
+    return false;
+  const char* payload;
+  if(mmap_!=nullptr){
+    payload=mmap_+pos+sizeof(head);
+  }else{
+    cbuf_.resize(compsize);
+    fin->read(&cbuf_[0], compsize);
+    if(!fin->good())
+      return false;
+    payload=cbuf_.data();
+  }
+  if(rawsize>static_cast<size_t>(capacity_)){
+    delete[] buf_;
+    capacity_=rawsize;
+    buf_=new char[capacity_];
+  }
+  if(!codec_->Decompress(payload, compsize, buf_, rawsize)){
+    LOG(ERROR)<<"Corrupted block "<<pos<<" of "<<path_;
+    bufsize_=offset_=0;
+    return false;
+  }
+  bufsize_=rawsize;
+  offset_=0;
+  block_pos_=pos;
+  next_block_=pos+sizeof(head)+compsize;
   return true;
 }
 
+size_t Shard::ScanBlocks(std::istream* fin, size_t pos){
+  std::string key;
+  const char* val;
+  size_t vallen;
+  while(LoadBlock(fin, pos)){
+    size_t start=0, offset=0;
+    std::vector<size_t> offsets;
+    while(ParseTuple(buf_, bufsize_, &offset, &key, &val, &vallen, checksum_,
+          false)){
+      offsets.push_back(start);
+      start=offset;
+    }
+    if(offset!=static_cast<size_t>(bufsize_))
+      break;
+    index_.insert(index_.end(), offsets.begin(), offsets.end());
+    block_index_.resize(index_.size(), pos);
+    pos=next_block_;
+  }
+  bufsize_=offset_=0;
+  return pos;
+}
+
+void Shard::Seek(int index){
+  CHECK(mode_==kRead||mode_==kMmap);
+  LoadIndex();
+  CHECK_GE(index, 0);
+  CHECK_LT(index, static_cast<int>(index_.size()))<<"Seek out of range";
+  next_index_=index;
+  if(codec_!=nullptr){
+    if(bufsize_==0||block_pos_!=block_index_[index]){
+      if(!LoadBlock(&fdat_, block_index_[index])){
+        // let Next() load the block again and skip it
+        bufsize_=offset_=0;
+        next_block_=block_index_[index];
+        return;
+      }
+    }
+    offset_=index_[index];
+  }else if(mode_==kMmap){
+    mmap_offset_=index_[index];
+  }else{
+    bufsize_=0;
+    offset_=0;
+    fdat_.clear();
+    fdat_.seekg(index_[index]);
+  }
+}
+
+bool Shard::Read(int index, std::string *key, Message* val){
+  Seek(index);
+  return Next(key, val);
+}
+
+bool Shard::Read(int index, std::string *key, std::string* val){
+  Seek(index);
+  return Next(key, val);
+}
+
 const int Shard::Count() {
+  if(mode_==kCreate||mode_==kAppend){
+    std::unique_lock<std::mutex> lck(mtx_);
+    return count_;
+  }
+  LoadIndex();
+  return index_.size();
+}
+
+void Shard::LoadIndex(){
+  if(count_>0)
+    return;
+  size_t cur_block=block_pos_, cur_next=next_block_, cur_offset=offset_;
+  bool loaded=bufsize_>0;
   std::ifstream fin(path_, std::ios::in|std::ios::binary);
-  CHECK(fdat_.is_open())<<"Cannot create file "<<path_;
-  int count=0;
-  while(true){
-    size_t len;
-    fin.read(reinterpret_cast<char*>(&len), sizeof(len));
-    if(fin.good())
-      fin.seekg(len, std::ios_base::cur);
-    else break;
-    if(fin.good())
-      fin.read(reinterpret_cast<char*>(&len), sizeof(len));
-    else break;
-    if(fin.good())
-      fin.seekg(len, std::ios_base::cur);
-    else break;
-    if(!fin.good())
-      break;
-    count++;
+  CHECK(fin.is_open())<<"Cannot open file "<<path_;
+  size_t end=BuildIndex(&fin);
+  if(end!=datsize_)
+    LOG(WARNING)<<"Ignore the incomplete tuple at "<<end<<" of "<<path_;
+  if(codec_!=nullptr){
+    // restore the block being read, which is replaced by the above loading
+    bufsize_=offset_=0;
+    next_block_=cur_next;
+    if(loaded){
+      CHECK(LoadBlock(&fin, cur_block));
+      offset_=cur_offset;
+    }
   }
-  fin.close();
-  return count;
+  count_=index_.size();
+}
+
+size_t Shard::BuildIndex(std::istream* fin){
+  index_.clear();
+  block_index_.clear();
+  // compressed shards store (block offset, offset in block) for every tuple
+  size_t width=codec_!=nullptr?2:1;
+  std::ifstream fidx(idx_path_, std::ios::in|std::ios::binary);
+  if(fidx.is_open()){
+    fidx.seekg(0, std::ios_base::end);
+    size_t n=fidx.tellg()/sizeof(size_t)/width;
+    fidx.seekg(0, std::ios_base::beg);
+    std::vector<size_t> entries(n*width);
+    fidx.read(reinterpret_cast<char*>(entries.data()),
+        entries.size()*sizeof(size_t));
+    fidx.close();
+    for(size_t i=0;i<n;i++){
+      if(width==2){
+        block_index_.push_back(entries[2*i]);
+        index_.push_back(entries[2*i+1]);
+      }else{
+        index_.push_back(entries[i]);
+      }
+    }
+    // entries beyond shard.dat are from an unfinished write
+    std::vector<size_t>& pos=width==2?block_index_:index_;
+    while(pos.size()&&pos.back()>=datsize_){
+      pos.pop_back();
+      index_.resize(pos.size());
+    }
+  }
+  // tuples are written before their index entries, hence the last indexed
+  // tuple (or block) must be complete if the index is valid
+  size_t pos=datastart_;
+  bool valid=true;
+  if(codec_==nullptr){
+    if(index_.size()&&(pos=TupleEnd(fin, index_.back(), datsize_))==0)
+      valid=false;
+  }else if(block_index_.size()){
+    // entries of the last block may be written partially, scan it again
+    pos=block_index_.back();
+    while(block_index_.size()&&block_index_.back()==pos){
+      block_index_.pop_back();
+      index_.pop_back();
+    }
+    valid=pos>=datastart_&&LoadBlock(fin, pos);
+  }
+  if(!valid){
+    LOG(WARNING)<<"Index "<<idx_path_<<" is invalid, rebuilding";
+    index_.clear();
+    block_index_.clear();
+    pos=datastart_;
+  }
+  // scan the tuples after the last indexed one
+  size_t nindexed=index_.size();
+  if(codec_==nullptr){
+    size_t end;
+    while((end=TupleEnd(fin, pos, datsize_))!=0){
+      index_.push_back(pos);
+      pos=end;
+    }
+  }else{
+    pos=ScanBlocks(fin, pos);
+  }
+  if(index_.size()>nindexed&&nindexed>0)
+    LOG(WARNING)<<"Index "<<idx_path_<<" is stale, "<<index_.size()-nindexed
+      <<" tuples are indexed by scanning";
+  return pos;
+}
+
+size_t Shard::TupleEnd(std::istream* fin, size_t offset, size_t datsize){
+  size_t keylen, vallen;
+  fin->clear();
+  fin->seekg(offset);
+  fin->read(reinterpret_cast<char*>(&keylen), sizeof(keylen));
+  if(!fin->good()||keylen>datsize)
+    return 0;
+  fin->seekg(keylen, std::ios_base::cur);
+  fin->read(reinterpret_cast<char*>(&vallen), sizeof(vallen));
+  if(!fin->good()||vallen>datsize)
+    return 0;
+  size_t end=offset+2*sizeof(size_t)+keylen+vallen
+    +(checksum_?sizeof(uint32_t):0);
+  return end<=datsize?end:0;
 }
 
-int Shard::PrepareForAppend(std::string path){
+size_t Shard::PrepareForAppend(std::string path){
   std::ifstream fin(path, std::ios::in|std::ios::binary);
   if(!fin.is_open()){
     fdat_.open(path, std::ios::out|std::ios::binary);
@@ -181,27 +846,272 @@ int Shard::PrepareForAppend(std::string path){
     return 0;
   }
 
-  int last_tuple_offset=0;
-  char buf[256];
-  size_t len;
-  while(true){
-    memset(buf, 0, 256);
-    fin.read(reinterpret_cast<char*>(&len), sizeof(len));
-    if(fin.good())
-      fin.read(buf, len);
-    else break;
-    if(fin.good())
-      fin.read(reinterpret_cast<char*>(&len), sizeof(len));
-    else break;
-    if(fin.good())
-      fin.seekg(len, std::ios_base::cur);
-    else break;
-    if(fin.good())
-      keys_.insert(std::string(buf));
-    else break;
-    last_tuple_offset=fin.tellg();
-  }
+  struct stat sb;
+  CHECK_EQ(stat(path.c_str(), &sb), 0)<<"Cannot stat file "<<path;
+  datsize_=sb.st_size;
+  size_t end=BuildIndex(&fin);
+  datsize_=0;
   fin.close();
-  return last_tuple_offset;
+  return end;
+}
+
+void Shard::LoadKeys(std::vector<uint64_t>* hashes){
+  size_t n=0;
+  std::ifstream fkey(key_path_, std::ios::in|std::ios::binary);
+  if(fkey.is_open()){
+    fkey.seekg(0, std::ios_base::end);
+    // hashes of dropped tuples are ignored
+    n=std::min<size_t>(fkey.tellg()/sizeof(uint64_t), index_.size());
+    fkey.seekg(0, std::ios_base::beg);
+    hashes->resize(n);
+    fkey.read(reinterpret_cast<char*>(hashes->data()), n*sizeof(uint64_t));
+    CHECK(fkey.good())<<"Cannot read file "<<key_path_;
+  }
+  if(n<index_.size())
+    LOG(INFO)<<"Read keys of "<<index_.size()-n<<" tuples from "<<path_;
+  std::string key;
+  for(size_t i=n;i<index_.size();i++){
+    ReadKeyAt(codec_!=nullptr?block_index_[i]:0, index_[i], &key);
+    hashes->push_back(KeySet::Hash(key));
+  }
+}
+
+/*************************KeySet*******************************************/
+KeySet::KeySet(): hashes_(1024), ids_(1024, -1), size_(0){}
+
+uint64_t KeySet::Hash(const std::string& key){
+  // FNV-1a, followed by the finalizer of MurmurHash3 to mix all bits
+  uint64_t h=14695981039346656037ULL;
+  for(unsigned char c : key){
+    h^=c;
+    h*=1099511628211ULL;
+  }
+  h^=h>>33;
+  h*=0xff51afd7ed558ccdULL;
+  h^=h>>33;
+  h*=0xc4ceb9fe1a85ec53ULL;
+  h^=h>>33;
+  return h;
+}
+
+void KeySet::Insert(uint64_t hash, int id){
+  // keep the load factor below 0.7
+  if((size_+1)*10>ids_.size()*7)
+    Grow();
+  size_t mask=ids_.size()-1, slot=hash&mask;
+  while(ids_[slot]!=-1)
+    slot=(slot+1)&mask;
+  hashes_[slot]=hash;
+  ids_[slot]=id;
+  size_++;
+}
+
+void KeySet::Find(uint64_t hash, std::vector<int>* ids) const{
+  ids->clear();
+  size_t mask=ids_.size()-1;
+  for(size_t slot=hash&mask;ids_[slot]!=-1;slot=(slot+1)&mask)
+    if(hashes_[slot]==hash)
+      ids->push_back(ids_[slot]);
+}
+
+void KeySet::Grow(){
+  std::vector<uint64_t> hashes(hashes_.size()*2);
+  std::vector<int> ids(ids_.size()*2, -1);
+  hashes.swap(hashes_);
+  ids.swap(ids_);
+  size_=0;
+  for(size_t i=0;i<ids.size();i++)
+    if(ids[i]!=-1)
+      Insert(hashes[i], ids[i]);
+}
+
+/*************************Dataset******************************************/
+Dataset::Dataset(const std::string& manifest, char mode): mode_(mode){
+  CHECK(mode==Shard::kRead||mode==Shard::kMmap);
+  std::ifstream fin(manifest);
+  CHECK(fin.is_open())<<"Cannot open manifest "<<manifest;
+  size_t slash=manifest.rfind('/');
+  std::string dir=slash==std::string::npos?".":manifest.substr(0, slash);
+  offsets_.push_back(0);
+  std::string line;
+  while(std::getline(fin, line)){
+    std::istringstream in(line);
+    std::string folder;
+    int count;
+    if(!(in>>folder)||folder[0]=='#')
+      continue;
+    CHECK(in>>count)<<"Wrong manifest line '"<<line<<"' in "<<manifest;
+    folders_.push_back(folder[0]=='/'?folder:dir+"/"+folder);
+    offsets_.push_back(offsets_.back()+count);
+  }
+  shards_.resize(folders_.size());
+  SetPartition(0, 1);
+}
+
+void Dataset::SetPartition(int k, int n){
+  CHECK_GE(k, 0);
+  CHECK_LT(k, n);
+  long total=offsets_.back();
+  begin_=total*k/n;
+  end_=total*(k+1)/n;
+  SeekToFirst();
+}
+
+Shard* Dataset::OpenShard(int i){
+  if(shards_[i]==nullptr){
+    shards_[i]=std::make_shared<Shard>(folders_[i], mode_);
+    CHECK_EQ(shards_[i]->Count(), offsets_[i+1]-offsets_[i])
+      <<"Shard "<<folders_[i]<<" does not match the manifest";
+  }
+  return shards_[i].get();
+}
+
+int Dataset::Locate(int index){
+  // shards before (and empty shards at) the index are skipped
+  return std::upper_bound(offsets_.begin(), offsets_.end(), index)
+    -offsets_.begin()-1;
+}
+
+bool Dataset::Next(std::string *key, const char** val, int* vallen){
+  while(pos_<end_){
+    while(pos_>=offsets_[cur_+1]){
+      cur_++;
+      OpenShard(cur_)->SeekToFirst();
+    }
+    Shard* shard=OpenShard(cur_);
+    int skipped=shard->ncorrupted();
+    if(!shard->Next(key, val, vallen)){
+      // the rest of this shard is corrupted, continue with the next shard
+      pos_=offsets_[cur_+1];
+      continue;
+    }
+    // corrupted tuples skipped by Next()
+    pos_+=shard->ncorrupted()-skipped;
+    if(pos_>=end_)
+      return false;
+    pos_++;
+    return true;
+  }
+  return false;
+}
+
+void Dataset::SeekToFirst(){
+  pos_=begin_;
+  cur_=Locate(begin_);
+  if(begin_<end_)
+    OpenShard(cur_)->Seek(begin_-offsets_[cur_]);
+}
+
+void Dataset::Seek(int index){
+  CHECK_GE(index, 0);
+  CHECK_LT(index, end_-begin_)<<"Seek out of range";
+  pos_=begin_+index;
+  cur_=Locate(pos_);
+  OpenShard(cur_)->Seek(pos_-offsets_[cur_]);
+}
+
+const int Dataset::Count(){
+  return end_-begin_;
+}
+
+int Dataset::ncorrupted() const{
+  int n=0;
+  for(auto& shard : shards_)
+    if(shard!=nullptr)
+      n+=shard->ncorrupted();
+  return n;
+}
+
+void Dataset::WriteManifest(const std::string& manifest,
+    const std::vector<std::string>& folders){
+  std::ofstream fout(manifest, std::ios::out|std::ios::trunc);
+  CHECK(fout.is_open())<<"Cannot create manifest "<<manifest;
+  fout<<"# shard folder, num of tuples\n";
+  for(auto& folder : folders){
+    // Count() reads shard.idx, without scanning shard.dat
+    Shard shard(folder, Shard::kMmap);
+    fout<<folder<<" "<<shard.Count()<<"\n";
+  }
+  fout.close();
+  CHECK(fout.good())<<"Cannot write manifest "<<manifest;
+}
+
+/*************************ShuffleReader*************************************/
+ShuffleReader::ShuffleReader(Reader* shard, int blocksize, int window,
+    unsigned seed): shard_(shard), blocksize_(blocksize), window_(window),
+  epoch_(0), rng_(seed){
+  CHECK_GT(blocksize_, 0);
+  CHECK_GT(window_, 0);
+  count_=shard_->Count();
+  int nblocks=(count_+blocksize_-1)/blocksize_;
+  for(int i=0;i<nblocks;i++)
+    blocks_.push_back(i);
+  keys_.resize(blocksize_*window_);
+  vals_.resize(blocksize_*window_);
+  NextEpoch();
+}
+
+void ShuffleReader::NextEpoch(){
+  std::shuffle(blocks_.begin(), blocks_.end(), rng_);
+  next_block_=0;
+  nloaded_=0;
+  order_.clear();
+  pos_=0;
+  epoch_++;
+}
+
+bool ShuffleReader::LoadWindow(){
+  nloaded_=0;
+  for(int w=0;w<window_&&next_block_<blocks_.size();w++){
+    int start=blocks_[next_block_++]*blocksize_;
+    int end=std::min(start+blocksize_, count_);
+    shard_->Seek(start);
+    int i=start;
+    while(i<end){
+      int skipped=shard_->ncorrupted();
+      if(!shard_->Next(&keys_[nloaded_], &vals_[nloaded_]))
+        break;
+      // corrupted tuples skipped by Next()
+      i+=shard_->ncorrupted()-skipped;
+      if(i>=end)
+        break;
+      nloaded_++;
+      i++;
+    }
+  }
+  order_.resize(nloaded_);
+  for(int i=0;i<nloaded_;i++)
+    order_[i]=i;
+  std::shuffle(order_.begin(), order_.end(), rng_);
+  pos_=0;
+  return nloaded_>0;
+}
+
+bool ShuffleReader::Next(std::string *key, std::string* val){
+  if(pos_==order_.size()&&!LoadWindow())
+    return false;
+  int k=order_[pos_++];
+  key->swap(keys_[k]);
+  val->swap(vals_[k]);
+  return true;
+}
+
+bool ShuffleReader::Next(std::string *key, Message* val){
+  if(pos_==order_.size()&&!LoadWindow())
+    return false;
+  int k=order_[pos_++];
+  key->swap(keys_[k]);
+  val->ParseFromString(vals_[k]);
+  return true;
+}
+
+bool ShuffleReader::Next(std::string *key, const char** val, int* vallen){
+  if(pos_==order_.size()&&!LoadWindow())
+    return false;
+  int k=order_[pos_++];
+  key->swap(keys_[k]);
+  *val=vals_[k].data();
+  *vallen=vals_[k].size();
+  return true;
 }
 } /* shard */
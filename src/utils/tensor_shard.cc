@@ -0,0 +1,190 @@
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+
+#include "utils/tensor_shard.h"
+namespace shard {
+
+const int kMaxDims=8;
+// header of tensor.dat, padded to 64 bytes to align the tensors
+struct TensorHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype;
+  uint32_t ndim;
+  int32_t shape[kMaxDims];
+  uint32_t reserved[3];
+};
+const char kTensorMagic[8]={'S', 'G', 'T', 'E', 'N', 'S', 'O', 'R'};
+const uint32_t kTensorVersion=1;
+
+TensorShard::TensorShard(std::string folder, char mode, DType dtype,
+    const std::vector<int>& shape): mode_(mode), dtype_(dtype), shape_(shape),
+    record_size_(0), count_(0), tensors_(nullptr), labels_(nullptr),
+    mmap_dat_(nullptr), mmap_label_(nullptr), dat_size_(0), label_size_(0){
+  static_assert(sizeof(TensorHeader)==64, "TensorHeader must be 64 bytes");
+  if(folder.back()!='/')
+    folder+='/';
+  path_=folder+"tensor.dat";
+  label_path_=folder+"label.dat";
+  if(mode==kAppend&&!Exists(folder))
+    mode=kCreate;
+  if(mode==kRead){
+    CHECK(ReadHeader())<<"Not a tensor shard "<<path_;
+    mmap_dat_=MapFile(path_, &dat_size_);
+    mmap_label_=MapFile(label_path_, &label_size_);
+    tensors_=mmap_dat_+sizeof(TensorHeader);
+    labels_=reinterpret_cast<const int32_t*>(mmap_label_);
+    count_=std::min((dat_size_-sizeof(TensorHeader))/record_size_,
+        label_size_/sizeof(int32_t));
+  }else if(mode==kCreate){
+    WriteHeader();
+    flabel_.open(label_path_, std::ios::out|std::ios::binary|std::ios::trunc);
+    CHECK(flabel_.is_open())<<"Cannot create file "<<label_path_;
+  }else if(mode==kAppend){
+    std::vector<int> expected=shape_;
+    DType expected_dtype=dtype_;
+    CHECK(ReadHeader())<<"Not a tensor shard "<<path_;
+    CHECK(expected.empty()||(expected==shape_&&expected_dtype==dtype_))
+      <<"Cannot append records of different shape or type to "<<path_;
+    struct stat dat, label;
+    CHECK_EQ(stat(path_.c_str(), &dat), 0);
+    if(stat(label_path_.c_str(), &label)!=0)
+      label.st_size=0;
+    count_=std::min((dat.st_size-sizeof(TensorHeader))/record_size_,
+        label.st_size/sizeof(int32_t));
+    // drop records that were written partially
+    CHECK_EQ(truncate(path_.c_str(), sizeof(TensorHeader)+count_*record_size_),
+        0)<<"Cannot truncate "<<path_;
+    std::ofstream touch(label_path_, std::ios::out|std::ios::binary
+        |std::ios::app);
+    touch.close();
+    CHECK_EQ(truncate(label_path_.c_str(), count_*sizeof(int32_t)), 0)
+      <<"Cannot truncate "<<label_path_;
+    fdat_.open(path_, std::ios::out|std::ios::binary|std::ios::app);
+    flabel_.open(label_path_, std::ios::out|std::ios::binary|std::ios::app);
+    CHECK(fdat_.is_open()&&flabel_.is_open())<<"Cannot open "<<path_;
+  }else{
+    LOG(FATAL)<<"Unknown mode "<<static_cast<int>(mode);
+  }
+}
+
+TensorShard::~TensorShard(){
+  if(mmap_dat_!=nullptr)
+    munmap(mmap_dat_, dat_size_);
+  if(mmap_label_!=nullptr)
+    munmap(mmap_label_, label_size_);
+  fdat_.close();
+  flabel_.close();
+}
+
+size_t TensorShard::DTypeSize(DType dtype){
+  return dtype==kFloat?sizeof(float):sizeof(uint8_t);
+}
+
+bool TensorShard::Exists(const std::string& folder){
+  struct stat sb;
+  std::string path=folder+(folder.back()=='/'?"":"/")+"tensor.dat";
+  return stat(path.c_str(), &sb)==0&&S_ISREG(sb.st_mode);
+}
+
+bool TensorShard::ReadHeader(){
+  std::ifstream fin(path_, std::ios::in|std::ios::binary);
+  TensorHeader header;
+  if(!fin.is_open())
+    return false;
+  fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if(!fin.good()||memcmp(header.magic, kTensorMagic, sizeof(kTensorMagic))!=0)
+    return false;
+  CHECK_LE(header.version, kTensorVersion)<<"Unknown version of "<<path_;
+  CHECK_LE(header.ndim, kMaxDims);
+  dtype_=static_cast<DType>(header.dtype);
+  shape_.assign(header.shape, header.shape+header.ndim);
+  record_size_=DTypeSize(dtype_);
+  for(int x: shape_)
+    record_size_*=x;
+  CHECK_GT(record_size_, 0)<<"Empty records in "<<path_;
+  return true;
+}
+
+void TensorShard::WriteHeader(){
+  CHECK(shape_.size()>0&&shape_.size()<=kMaxDims)
+    <<"Invalid record shape for "<<path_;
+  TensorHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kTensorMagic, sizeof(kTensorMagic));
+  header.version=kTensorVersion;
+  header.dtype=dtype_;
+  header.ndim=shape_.size();
+  record_size_=DTypeSize(dtype_);
+  for(size_t i=0;i<shape_.size();i++){
+    CHECK_GT(shape_[i], 0);
+    header.shape[i]=shape_[i];
+    record_size_*=shape_[i];
+  }
+  fdat_.open(path_, std::ios::out|std::ios::binary|std::ios::trunc);
+  CHECK(fdat_.is_open())<<"Cannot create file "<<path_;
+  fdat_.write(reinterpret_cast<char*>(&header), sizeof(header));
+}
+
+char* TensorShard::MapFile(const std::string& path, size_t* size){
+  int fd=open(path.c_str(), O_RDONLY);
+  CHECK_NE(fd, -1)<<"Cannot open file "<<path;
+  struct stat sb;
+  CHECK_EQ(fstat(fd, &sb), 0)<<"Cannot stat file "<<path;
+  *size=sb.st_size;
+  char* ret=nullptr;
+  if(*size>0){
+    void* addr=mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    CHECK(addr!=MAP_FAILED)<<"Cannot mmap file "<<path;
+    ret=static_cast<char*>(addr);
+    madvise(ret, *size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return ret;
+}
+
+void TensorShard::Insert(const char* tensor, int label){
+  CHECK(mode_!=kRead)<<"Cannot insert into "<<path_<<" in read mode";
+  int32_t val=label;
+  fdat_.write(tensor, record_size_);
+  flabel_.write(reinterpret_cast<char*>(&val), sizeof(val));
+  count_++;
+}
+
+void TensorShard::Flush(){
+  fdat_.flush();
+  flabel_.flush();
+}
+
+int TensorShard::Read(int start, int n, char* tensors, int* labels) const{
+  CHECK_GT(count_, 0)<<"Empty shard "<<path_;
+  CHECK(start>=0&&start<count_);
+  while(n>0){
+    int m=std::min(n, count_-start);
+    memcpy(tensors, tensor(start), m*record_size_);
+    tensors+=m*record_size_;
+    if(labels!=nullptr){
+      memcpy(labels, labels_+start, m*sizeof(int32_t));
+      labels+=m;
+    }
+    n-=m;
+    start=(start+m)%count_;
+  }
+  return start;
+}
+
+const char* TensorShard::tensor(int index) const{
+  CHECK(tensors_!=nullptr)<<path_<<" is not opened in read mode";
+  return tensors_+index*record_size_;
+}
+
+int TensorShard::label(int index) const{
+  CHECK(labels_!=nullptr)<<path_<<" is not opened in read mode";
+  return labels_[index];
+}
+} /* shard */
@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <atomic>
+#include "utils/thread_pool.h"
+
+namespace singa {
+
+ThreadPool::ThreadPool(int nthreads): stop_(false){
+  for(int i=0;i<nthreads;i++)
+    threads_.push_back(std::thread(&ThreadPool::Run, this));
+}
+
+ThreadPool::~ThreadPool(){
+  {
+    std::unique_lock<std::mutex> lck(mtx_);
+    stop_=true;
+  }
+  task_cv_.notify_all();
+  for(auto& th: threads_)
+    th.join();
+}
+
+void ThreadPool::Run(){
+  std::unique_lock<std::mutex> lck(mtx_);
+  while(true){
+    while(tasks_.empty()&&!stop_)
+      task_cv_.wait(lck);
+    if(tasks_.empty())
+      return;
+    auto task=std::move(tasks_.front());
+    tasks_.pop_front();
+    lck.unlock();
+    task();
+    lck.lock();
+  }
+}
+
+void ThreadPool::ParallelFor(int n, const std::function<void(int, int)>& func){
+  int nchunks=std::min(n, nthreads()+1);
+  if(nchunks<=1){
+    if(n>0)
+      func(0, n);
+    return;
+  }
+  std::atomic<int> pending(nchunks-1);
+  {
+    std::unique_lock<std::mutex> lck(mtx_);
+    for(int k=1;k<nchunks;k++){
+      int begin=static_cast<int64_t>(n)*k/nchunks;
+      int end=static_cast<int64_t>(n)*(k+1)/nchunks;
+      tasks_.push_back([this, &func, &pending, begin, end](){
+          func(begin, end);
+          if(--pending==0){
+            std::unique_lock<std::mutex> lck(mtx_);
+            done_cv_.notify_all();
+          }
+        });
+    }
+  }
+  task_cv_.notify_all();
+  func(0, n/nchunks);
+  std::unique_lock<std::mutex> lck(mtx_);
+  while(pending>0){
+    if(!tasks_.empty()){
+      auto task=std::move(tasks_.front());
+      tasks_.pop_front();
+      lck.unlock();
+      task();
+      lck.lock();
+    }else{
+      done_cv_.wait(lck);
+    }
+  }
+}
+} /* singa */
@@ -3,11 +3,37 @@
 #include <cblas.h>
 #include <math.h>
 #include <cfloat>
+#include "mshadow/tensor.h"
 #include "worker/base_layer.h"
+#include "utils/cluster.h"
 namespace singa {
 /*****************************************************************************
  * Implementation for Layer
  *****************************************************************************/
+ThreadPool* Layer::intra_op_pool(){
+  static std::unique_ptr<ThreadPool> pool;
+  static std::once_flag flag;
+  std::call_once(flag, [](){
+      auto cluster=Cluster::Get();
+      if(cluster!=nullptr&&cluster->nintra_op_threads()>0){
+        pool.reset(new ThreadPool(cluster->nintra_op_threads()));
+        mshadow::CPUParallelFor()=[](mshadow::index_t n,
+            const std::function<void(mshadow::index_t, mshadow::index_t)>& func){
+          pool->ParallelFor(n, [&func](int begin, int end){func(begin, end);});
+        };
+      }
+    });
+  return pool.get();
+}
+
+void IntraOpFor(int n, const std::function<void(int, int)>& func){
+  ThreadPool* pool=Layer::intra_op_pool();
+  if(pool!=nullptr)
+    pool->ParallelFor(n, func);
+  else
+    func(0, n);
+}
+
 void Layer::Init(const LayerProto &proto) {
   layer_proto_=proto;
 }
@@ -79,6 +105,91 @@ void BridgeDstLayer::ComputeGradient(const vector<shared_ptr<Layer>>& srclayers)
 
 }
 
+/*******************************
+ * Implementation for DenseBatch
+ *******************************/
+int DenseBatch::record_dim() const {
+  int dim=1;
+  for(int x: shape)
+    dim*=x;
+  return dim;
+}
+
+void DenseBatch::Convert(int begin, int end, float scale, float bias,
+    float* dst) const {
+  CHECK_LE(end*(is_float?sizeof(float):sizeof(uint8_t)), tensors.size());
+  if(is_float){
+    const float* src=reinterpret_cast<const float*>(tensors.data())+begin;
+    for(int i=0;i<end-begin;i++)
+      dst[i]=src[i]*scale+bias;
+  }else{
+    const uint8_t* src=reinterpret_cast<const uint8_t*>(tensors.data())+begin;
+    for(int i=0;i<end-begin;i++)
+      dst[i]=src[i]*scale+bias;
+  }
+}
+
+/*******************************
+ * Implementation for ParserLayer
+ *******************************/
+void ParserLayer::SetupTransforms(const LayerProto& proto){
+  transforms_.clear();
+  stages_.clear();
+  if(proto.transform_size()==0)
+    return;
+  vector<int> shape=data_.shape();
+  CHECK(shape.size()==3||shape.size()==4)
+    <<"Transforms of "<<name()<<" apply to batches of images";
+  // image shape {channels, height, width}
+  vector<int> image(shape.begin()+1, shape.end());
+  if(image.size()==2)
+    image.insert(image.begin(), 1);
+  stages_.resize(proto.transform_size());
+  stages_[0].ReshapeLike(data_);
+  for(int k=0;k<proto.transform_size();k++){
+    if(k>0)
+      stages_[k].Reshape(vector<int>{shape[0], image[0], image[1], image[2]});
+    transforms_.push_back(std::unique_ptr<Transform>(
+          Transform::Create(proto.transform(k).type())));
+    transforms_.back()->Setup(proto.transform(k), image);
+    image=transforms_.back()->shape();
+  }
+  if(shape.size()==3){
+    CHECK_EQ(image[0], 1);
+    data_.Reshape(vector<int>{shape[0], image[1], image[2]});
+  }else{
+    data_.Reshape(vector<int>{shape[0], image[0], image[1], image[2]});
+  }
+}
+
+void ParserLayer::Augment(bool training, Blob<float>* blob){
+  int n=blob->shape()[0];
+  for(auto& transform: transforms_)
+    transform->Sample(training, n);
+  // the input and output of every transform
+  vector<const float*> srcs;
+  vector<float*> dsts;
+  for(size_t k=0;k<transforms_.size();k++){
+    srcs.push_back(stages_[k].cpu_data());
+    dsts.push_back(k+1<stages_.size()?stages_[k+1].mutable_cpu_data()
+        :blob->mutable_cpu_data());
+  }
+  auto apply=[&](int begin, int end){
+    for(int rid=begin;rid<end;rid++){
+      for(size_t k=0;k<transforms_.size();k++){
+        int srcdim=stages_[k].count()/n;
+        int dstdim=(k+1<stages_.size()?stages_[k+1].count():blob->count())/n;
+        transforms_[k]->Apply(rid, srcs[k]+rid*srcdim, dsts[k]+rid*dstdim);
+      }
+    }
+  };
+  ThreadPool* pool=Transform::pool();
+  if(pool!=nullptr)
+    pool->ParallelFor(n, apply);
+  else
+    apply(0, n);
+}
+
 /*******************************
  * Implementation for ConcateLayer
  *******************************/
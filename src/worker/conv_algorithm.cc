@@ -0,0 +1,463 @@
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include "mshadow/tensor.h"
+#include "worker/conv_algorithm.h"
+#include "worker/winograd.h"
+#include "worker/base_layer.h"
+#include "utils/cluster.h"
+#include "utils/factory.h"
+#include "utils/singleton.h"
+
+using namespace mshadow;
+using namespace mshadow::expr;
+
+namespace singa {
+
+string ConvShape::ToString() const {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "b%d_c%d_h%d_w%d_f%d_k%d_p%d_s%d", batchsize,
+      channels, height, width, num_filters, kernel, pad, stride);
+  return string(buf);
+}
+
+/***************************ConvAlgorithm**********************************/
+ConvAlgorithm* ConvAlgorithm::Create(const string& type){
+  static std::once_flag flag;
+  std::call_once(flag, [](){
+      auto* factory=Singleton<Factory<ConvAlgorithm>>::Instance();
+      factory->Register("kIm2col", CreateInstance(Im2colConv, ConvAlgorithm));
+      factory->Register("kIm2colPerImage",
+        CreateInstance(Im2colPerImageConv, ConvAlgorithm));
+      factory->Register("kDirect", CreateInstance(DirectConv, ConvAlgorithm));
+      factory->Register("kWinograd2x2",
+        []()->ConvAlgorithm* {return new Winograd(2);});
+      factory->Register("kWinograd4x4",
+        []()->ConvAlgorithm* {return new Winograd(4);});
+    });
+  return Singleton<Factory<ConvAlgorithm>>::Instance()->Create(type);
+}
+
+/**
+ * Time one forward and backward pass of every algorithm of
+ * ConvolutionProto::ConvAlgorithm supporting the shape on random data.
+ * @return name of the fastest algorithm
+ */
+string FastestAlgorithm(const ConvShape& shape, const ConvolutionProto& proto){
+  int srcsize=shape.batchsize*shape.channels*shape.height*shape.width;
+  int dstsize=shape.batchsize*shape.num_filters*shape.conv_height
+    *shape.conv_width;
+  int wsize=shape.num_filters*shape.channels*shape.kernel*shape.kernel;
+  vector<float> src(srcsize), gsrc(srcsize), dst(dstsize), grad(dstsize);
+  vector<float> weight(wsize), gweight(wsize);
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  for(auto* v: {&src, &grad, &weight})
+    for(float& x: *v)
+      x=dist(gen);
+  string best;
+  double besttime=0;
+  for(int i=ConvolutionProto::ConvAlgorithm_MIN;
+      i<=ConvolutionProto::ConvAlgorithm_MAX;i++){
+    if(!ConvolutionProto::ConvAlgorithm_IsValid(i)||i==ConvolutionProto::kAuto)
+      continue;
+    string type=ConvolutionProto::ConvAlgorithm_Name(
+        static_cast<ConvolutionProto::ConvAlgorithm>(i));
+    std::unique_ptr<ConvAlgorithm> algorithm(ConvAlgorithm::Create(type));
+    if(!algorithm->Setup(shape, proto))
+      continue;
+    // the first pass allocates buffers
+    for(int k=0;k<2;k++){
+      auto start=std::chrono::steady_clock::now();
+      algorithm->Forward(src.data(), weight.data(), dst.data());
+      // stop timing algorithms slower than the best in the forward pass,
+      // except in the first pass whose time includes allocation
+      if(k==1&&!best.empty()&&std::chrono::duration<double>(
+            std::chrono::steady_clock::now()-start).count()>besttime)
+        break;
+      algorithm->Backward(src.data(), weight.data(), grad.data(),
+          gweight.data(), gsrc.data());
+      double time=std::chrono::duration<double>(
+          std::chrono::steady_clock::now()-start).count();
+      if(k==1){
+        LOG(INFO)<<"Convolution "<<shape.ToString()<<" by "<<type<<" takes "
+          <<time*1000<<" ms";
+        if(best.empty()||time<besttime){
+          best=type;
+          besttime=time;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+/**
+ * Return the fastest algorithm for the shape, from the cache of previous
+ * choices if possible.
+ */
+string TunedAlgorithm(const ConvShape& shape, const ConvolutionProto& proto){
+  // tuning is serialized so that concurrent workers do not disturb timing
+  static std::mutex mtx;
+  static std::map<string, string> cache;
+  static string path;
+  static bool loaded=false;
+  std::lock_guard<std::mutex> lock(mtx);
+  if(!loaded){
+    loaded=true;
+    auto cluster=Cluster::Get();
+    if(cluster!=nullptr){
+      path=cluster->workerspace()+"/conv_algorithms";
+      std::ifstream fin(path);
+      string key, type;
+      while(fin>>key>>type)
+        cache[key]=type;
+    }
+  }
+  // the choice also depends on the buffer size and the num of threads
+  ThreadPool* pool=Layer::intra_op_pool();
+  string key=shape.ToString()+"_mb"+std::to_string(proto.col_buffer_mb())
+    +"_t"+std::to_string(pool!=nullptr?pool->nthreads()+1:1);
+  auto it=cache.find(key);
+  if(it!=cache.end())
+    return it->second;
+  string type=FastestAlgorithm(shape, proto);
+  LOG(INFO)<<"Convolution "<<key<<" uses "<<type;
+  cache[key]=type;
+  if(!path.empty()){
+    std::ofstream fout(path, std::ios::app);
+    fout<<key<<" "<<type<<"\n";
+  }
+  return type;
+}
+
+ConvAlgorithm* ConvAlgorithm::Create(const ConvShape& shape,
+    const ConvolutionProto& proto){
+  string type=ConvolutionProto::ConvAlgorithm_Name(proto.algorithm());
+  if(proto.algorithm()==ConvolutionProto::kAuto)
+    type=TunedAlgorithm(shape, proto);
+  ConvAlgorithm* algorithm=Create(type);
+  if(!algorithm->Setup(shape, proto)){
+    LOG(WARNING)<<type<<" does not support convolution "<<shape.ToString()
+      <<", use kIm2col instead";
+    delete algorithm;
+    algorithm=Create("kIm2col");
+    CHECK(algorithm->Setup(shape, proto));
+  }
+  return algorithm;
+}
+
+/***************************Im2colConv**********************************/
+/**
+ * Range [begin, end) of output columns x whose input column
+ * x*stride-pad+offset is inside [0, size).
+ */
+inline void ValidRange(int size, int pad, int stride, int offset, int outsize,
+    int* begin, int* end){
+  *begin=pad>offset?(pad-offset+stride-1)/stride:0;
+  int last=size-1+pad-offset;
+  *end=last<0?0:std::min(outsize, last/stride+1);
+  *begin=std::min(*begin, outsize);
+  *end=std::max(*end, *begin);
+}
+
+/**
+ * Unpack the patches of one image {channels, height, width} into the columns
+ * col[r*ld+j], where r indexes (channel, kernel row, kernel column) and j
+ * indexes output pixels. ld is larger than the num of output pixels if
+ * columns of multiple images are interleaved for one GEMM. Rows of the image
+ * are copied by segments, with zeros for padding.
+ */
+void Im2col(const float* img, int channels, int height, int width,
+    int kernel, int pad, int stride, int ld, float* col){
+  int oheight=(height+2*pad-kernel)/stride+1;
+  int owidth=(width+2*pad-kernel)/stride+1;
+  for(int c=0;c<channels;c++){
+    for(int ki=0;ki<kernel;ki++){
+      for(int kj=0;kj<kernel;kj++){
+        float* row=col+((c*kernel+ki)*kernel+kj)*ld;
+        int xbegin, xend;
+        ValidRange(width, pad, stride, kj, owidth, &xbegin, &xend);
+        for(int y=0;y<oheight;y++){
+          float* out=row+y*owidth;
+          int h=y*stride-pad+ki;
+          if(h<0||h>=height){
+            memset(out, 0, owidth*sizeof(float));
+            continue;
+          }
+          const float* in=img+(c*height+h)*width+kj-pad;
+          memset(out, 0, xbegin*sizeof(float));
+          if(stride==1){
+            memcpy(out+xbegin, in+xbegin, (xend-xbegin)*sizeof(float));
+          }else{
+            for(int x=xbegin;x<xend;x++)
+              out[x]=in[x*stride];
+          }
+          memset(out+xend, 0, (owidth-xend)*sizeof(float));
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Reverse of Im2col, summing the columns of every pixel into img.
+ */
+void Col2im(const float* col, int channels, int height, int width,
+    int kernel, int pad, int stride, int ld, float* img){
+  int oheight=(height+2*pad-kernel)/stride+1;
+  int owidth=(width+2*pad-kernel)/stride+1;
+  memset(img, 0, channels*height*width*sizeof(float));
+  for(int c=0;c<channels;c++){
+    for(int ki=0;ki<kernel;ki++){
+      for(int kj=0;kj<kernel;kj++){
+        const float* row=col+((c*kernel+ki)*kernel+kj)*ld;
+        int xbegin, xend;
+        ValidRange(width, pad, stride, kj, owidth, &xbegin, &xend);
+        for(int y=0;y<oheight;y++){
+          int h=y*stride-pad+ki;
+          if(h<0||h>=height)
+            continue;
+          const float* in=row+y*owidth;
+          float* out=img+(c*height+h)*width+kj-pad;
+          for(int x=xbegin;x<xend;x++)
+            out[x*stride]+=in[x];
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Copy the {rows, g*area} matrix of a group of images (the layout of one GEMM
+ * over the group) into g images of {rows, area}.
+ */
+void GroupToImages(const float* group, int g, int rows, int area,
+    float* images){
+  for(int r=0;r<rows;r++)
+    for(int k=0;k<g;k++)
+      memcpy(images+(k*rows+r)*area, group+(r*g+k)*area, area*sizeof(float));
+}
+
+/**
+ * Reverse of GroupToImages.
+ */
+void ImagesToGroup(const float* images, int g, int rows, int area,
+    float* group){
+  for(int r=0;r<rows;r++)
+    for(int k=0;k<g;k++)
+      memcpy(group+(r*g+k)*area, images+(k*rows+r)*area, area*sizeof(float));
+}
+
+bool Im2colConv::Setup(const ConvShape& shape,
+    const ConvolutionProto& proto){
+  shape_=shape;
+  col_height_=shape.channels*shape.kernel*shape.kernel;
+  col_width_=shape.conv_height*shape.conv_width;
+  int64_t colsize=static_cast<int64_t>(col_height_)*col_width_*sizeof(float);
+  group_=std::max(1, static_cast<int>(std::min<int64_t>(shape.batchsize,
+          (static_cast<int64_t>(proto.col_buffer_mb())<<20)/colsize)));
+  col_data_.Reshape(vector<int>{col_height_, group_*col_width_});
+  col_grad_.Reshape(vector<int>{col_height_, group_*col_width_});
+  if(group_>1)
+    group_data_.Reshape(vector<int>{shape.num_filters, group_*col_width_});
+  return true;
+}
+
+void Im2colConv::Unpack(const float* src, int g, float* col) const {
+  int channels=shape_.channels, kernel=shape_.kernel;
+  int area=shape_.height*shape_.width, ld=g*col_width_;
+  // every (image, channel) pair fills its own kernel*kernel rows of col
+  IntraOpFor(g*channels, [&](int begin, int end){
+      for(int i=begin;i<end;i++){
+        int k=i/channels, c=i%channels;
+        Im2col(src+(k*channels+c)*area, 1, shape_.height, shape_.width,
+            kernel, shape_.pad, shape_.stride, ld,
+            col+c*kernel*kernel*ld+k*col_width_);
+      }
+    });
+}
+
+void Im2colConv::Pack(const float* col, int g, float* dst) const {
+  int channels=shape_.channels, kernel=shape_.kernel;
+  int area=shape_.height*shape_.width, ld=g*col_width_;
+  IntraOpFor(g*channels, [&](int begin, int end){
+      for(int i=begin;i<end;i++){
+        int k=i/channels, c=i%channels;
+        Col2im(col+c*kernel*kernel*ld+k*col_width_, 1, shape_.height,
+            shape_.width, kernel, shape_.pad, shape_.stride, ld,
+            dst+(k*channels+c)*area);
+      }
+    });
+}
+
+void Im2colConv::Forward(const float* src, const float* weight, float* dst){
+  int batchsize=shape_.batchsize, num_filters=shape_.num_filters;
+  Tensor<cpu, 3> data(dst, Shape3(batchsize, num_filters, col_width_));
+  Tensor<cpu, 2> filters(const_cast<float*>(weight),
+      Shape2(num_filters, col_height_));
+  int imgsize=shape_.channels*shape_.height*shape_.width;
+  for(int n=0;n<batchsize;n+=group_){
+    int g=std::min(group_, batchsize-n);
+    Tensor<cpu, 2> col(col_data_.mutable_cpu_data(),
+        Shape2(col_height_, g*col_width_));
+    Unpack(src+n*imgsize, g, col.dptr);
+    // a single image is computed in place
+    float* out=g>1?group_data_.mutable_cpu_data():data[n].dptr;
+    Tensor<cpu, 2> outgroup(out, Shape2(num_filters, g*col_width_));
+    outgroup=dot(filters, col);
+    if(g>1)
+      GroupToImages(out, g, num_filters, col_width_, data[n].dptr);
+  }
+}
+
+void Im2colConv::Backward(const float* src, const float* weight,
+    const float* grad, float* gweight, float* gsrc){
+  int batchsize=shape_.batchsize, num_filters=shape_.num_filters;
+  Tensor<cpu, 2> filters(const_cast<float*>(weight),
+      Shape2(num_filters, col_height_));
+  Tensor<cpu, 3> gdata(const_cast<float*>(grad),
+      Shape3(batchsize, num_filters, col_width_));
+  Tensor<cpu, 2> gfilters(gweight, Shape2(num_filters, col_height_));
+  gfilters=0.0f;
+  int imgsize=shape_.channels*shape_.height*shape_.width;
+  for(int n=0;n<batchsize;n+=group_){
+    int g=std::min(group_, batchsize-n);
+    Tensor<cpu, 2> col(col_data_.mutable_cpu_data(),
+        Shape2(col_height_, g*col_width_));
+    Unpack(src+n*imgsize, g, col.dptr);
+    float* out=gdata[n].dptr;
+    if(g>1){
+      out=group_data_.mutable_cpu_data();
+      ImagesToGroup(gdata[n].dptr, g, num_filters, col_width_, out);
+    }
+    Tensor<cpu, 2> gradgroup(out, Shape2(num_filters, g*col_width_));
+    gfilters+=dot(gradgroup, col.T());
+
+    if(gsrc!=nullptr){
+      Tensor<cpu, 2> gcol(col_grad_.mutable_cpu_data(),
+          Shape2(col_height_, g*col_width_));
+      gcol=dot(filters.T(), gradgroup);
+      Pack(gcol.dptr, g, gsrc+n*imgsize);
+    }
+  }
+}
+
+bool Im2colPerImageConv::Setup(const ConvShape& shape,
+    const ConvolutionProto& proto){
+  ConvolutionProto conf(proto);
+  conf.set_col_buffer_mb(0);
+  return Im2colConv::Setup(shape, conf);
+}
+
+/***************************DirectConv**********************************/
+bool DirectConv::Setup(const ConvShape& shape,
+    const ConvolutionProto& proto){
+  shape_=shape;
+  return true;
+}
+
+void DirectConv::Forward(const float* src, const float* weight, float* dst){
+  const ConvShape& s=shape_;
+  int area=s.height*s.width, oarea=s.conv_height*s.conv_width;
+  IntraOpFor(s.batchsize*s.num_filters, [&](int begin, int end){
+      for(int i=begin;i<end;i++){
+        int n=i/s.num_filters, f=i%s.num_filters;
+        float* out=dst+static_cast<size_t>(i)*oarea;
+        memset(out, 0, oarea*sizeof(float));
+        for(int c=0;c<s.channels;c++){
+          const float* img=src+static_cast<size_t>(n*s.channels+c)*area;
+          const float* w=weight+(f*s.channels+c)*s.kernel*s.kernel;
+          for(int ki=0;ki<s.kernel;ki++){
+            for(int kj=0;kj<s.kernel;kj++){
+              float wt=w[ki*s.kernel+kj];
+              int xbegin, xend;
+              ValidRange(s.width, s.pad, s.stride, kj, s.conv_width,
+                  &xbegin, &xend);
+              for(int y=0;y<s.conv_height;y++){
+                int h=y*s.stride-s.pad+ki;
+                if(h<0||h>=s.height)
+                  continue;
+                const float* in=img+h*s.width+kj-s.pad;
+                float* row=out+y*s.conv_width;
+                for(int x=xbegin;x<xend;x++)
+                  row[x]+=wt*in[x*s.stride];
+              }
+            }
+          }
+        }
+      }
+    });
+}
+
+void DirectConv::Backward(const float* src, const float* weight,
+    const float* grad, float* gweight, float* gsrc){
+  const ConvShape& s=shape_;
+  int area=s.height*s.width, oarea=s.conv_height*s.conv_width;
+  int ksize=s.kernel*s.kernel;
+  IntraOpFor(s.num_filters*s.channels, [&](int begin, int end){
+      for(int i=begin;i<end;i++){
+        int f=i/s.channels, c=i%s.channels;
+        float* gw=gweight+i*ksize;
+        for(int ki=0;ki<s.kernel;ki++){
+          for(int kj=0;kj<s.kernel;kj++){
+            int xbegin, xend;
+            ValidRange(s.width, s.pad, s.stride, kj, s.conv_width,
+                &xbegin, &xend);
+            float sum=0;
+            for(int n=0;n<s.batchsize;n++){
+              const float* img=src+static_cast<size_t>(n*s.channels+c)*area;
+              const float* g=grad+static_cast<size_t>(n*s.num_filters+f)*oarea;
+              for(int y=0;y<s.conv_height;y++){
+                int h=y*s.stride-s.pad+ki;
+                if(h<0||h>=s.height)
+                  continue;
+                const float* in=img+h*s.width+kj-s.pad;
+                const float* row=g+y*s.conv_width;
+                for(int x=xbegin;x<xend;x++)
+                  sum+=row[x]*in[x*s.stride];
+              }
+            }
+            gw[ki*s.kernel+kj]=sum;
+          }
+        }
+      }
+    });
+  if(gsrc==nullptr)
+    return;
+  IntraOpFor(s.batchsize*s.channels, [&](int begin, int end){
+      for(int i=begin;i<end;i++){
+        int n=i/s.channels, c=i%s.channels;
+        float* img=gsrc+static_cast<size_t>(i)*area;
+        memset(img, 0, area*sizeof(float));
+        for(int f=0;f<s.num_filters;f++){
+          const float* g=grad+static_cast<size_t>(n*s.num_filters+f)*oarea;
+          const float* w=weight+(f*s.channels+c)*ksize;
+          for(int ki=0;ki<s.kernel;ki++){
+            for(int kj=0;kj<s.kernel;kj++){
+              float wt=w[ki*s.kernel+kj];
+              int xbegin, xend;
+              ValidRange(s.width, s.pad, s.stride, kj, s.conv_width,
+                  &xbegin, &xend);
+              for(int y=0;y<s.conv_height;y++){
+                int h=y*s.stride-s.pad+ki;
+                if(h<0||h>=s.height)
+                  continue;
+                float* out=img+h*s.width+kj-s.pad;
+                const float* row=g+y*s.conv_width;
+                for(int x=xbegin;x<xend;x++)
+                  out[x*s.stride]+=wt*row[x];
+              }
+            }
+          }
+        }
+      }
+    });
+}
+}  // namespace singa
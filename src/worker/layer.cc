@@ -1,4 +1,12 @@
 #include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <sys/stat.h>
+#include <cctype>
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <memory>
 #include <algorithm>
 #include <opencv2/highgui/highgui.hpp>
@@ -6,6 +14,7 @@
 #include "mshadow/tensor.h"
 #include "mshadow/cxxnet_op.h"
 #include "worker/layer.h"
+#include "utils/cluster.h"
 #include "utils/singleton.h"
 #include "utils/factory.h"
 
@@ -41,8 +50,9 @@ void ConvolutionLayer::Setup(const LayerProto& proto,
   vector<int> shape{batchsize_, num_filters_, conv_height_, conv_width_};
   data_.Reshape(shape);
   grad_.Reshape(shape);
-  col_data_.Reshape(vector<int>{col_height_, col_width_});
-  col_grad_.Reshape(vector<int>{col_height_, col_width_});
+  ConvShape convshape{batchsize_, channels_, height_, width_, num_filters_,
+    kernel_, pad_, stride_, conv_height_, conv_width_};
+  algorithm_.reset(ConvAlgorithm::Create(convshape, conv_param));
 
   Factory<Param>* factory=Singleton<Factory<Param>>::Instance();
   weight_=shared_ptr<Param>(factory->Create("Param"));
@@ -61,65 +71,28 @@ void ConvolutionLayer::SetupAfterPartition(const LayerProto& proto,
 }
 
 void ConvolutionLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers){
-  Tensor<cpu, 4> src(srclayers[0]->mutable_data(this)->mutable_cpu_data(),
-      Shape4(batchsize_, channels_, height_, width_));
+  const float* src=srclayers[0]->data(this).cpu_data();
   Tensor<cpu, 3> data(data_.mutable_cpu_data(),
       Shape3(batchsize_, num_filters_, conv_height_* conv_width_));
-  Tensor<cpu, 2> col(col_data_.mutable_cpu_data(),
-      Shape2(col_height_, col_width_));
-  Tensor<cpu, 2> weight(weight_->mutable_cpu_data(),
-      Shape2(num_filters_, col_height_));
   Tensor<cpu, 1> bias(bias_->mutable_cpu_data(),
       Shape1(num_filters_));
 
-  for(int n=0;n<batchsize_;n++){
-    if(pad_>0)
-      col=unpack_patch2col(pad(src[n], pad_), kernel_, stride_);
-    else
-      col=unpack_patch2col(src[n], kernel_, stride_);
-    data[n]=dot(weight, col);
-  }
+  algorithm_->Forward(src, weight_->mutable_cpu_data(), data.dptr);
   data+=broadcast<1>(bias, data.shape);
 }
 
 void ConvolutionLayer::ComputeGradient(const vector<SLayer>& srclayers) {
-  Tensor<cpu, 4> src(srclayers[0]->mutable_data(this)->mutable_cpu_data(),
-      Shape4(batchsize_, channels_, height_, width_));
-  Tensor<cpu, 2> col(col_data_.mutable_cpu_data(),
-      Shape2(col_height_, col_width_));
-  Tensor<cpu, 2> weight(weight_->mutable_cpu_data(),
-      Shape2(num_filters_, col_height_));
-
+  const float* src=srclayers[0]->data(this).cpu_data();
   Blob<float>* gsrcblob=srclayers[0]->mutable_grad(this);
-  Tensor<cpu, 4> gsrc(Shape4(batchsize_, channels_, height_, width_));
-  if(gsrcblob!=nullptr)
-    gsrc.dptr=gsrcblob->mutable_cpu_data();
+  float* gsrc=gsrcblob!=nullptr?gsrcblob->mutable_cpu_data():nullptr;
   Tensor<cpu, 3> grad(grad_.mutable_cpu_data(),
       Shape3(batchsize_, num_filters_, conv_height_* conv_width_));
-  Tensor<cpu, 2> gcol(col_grad_.mutable_cpu_data(),
-      Shape2(col_height_, col_width_));
-  Tensor<cpu, 2> gweight(weight_->mutable_cpu_grad(),
-      Shape2(num_filters_, col_height_));
   Tensor<cpu, 1> gbias(bias_->mutable_cpu_grad(),
       Shape1(num_filters_));
 
-  gweight=0.0f;
   gbias=sumall_except_dim<1>(grad);
-  Shape<3> padshape(gsrc.shape.SubShape());
-  padshape[0]+=2*pad_;padshape[1]+=2*pad_;
-  Shape<2> imgshape=Shape2(height_, width_);
-  for(int n=0;n<batchsize_;n++){
-    if(pad_>0)
-      col=unpack_patch2col(pad(src[n], pad_), kernel_, stride_);
-    else
-      col=unpack_patch2col(src[n], kernel_, stride_);
-    gweight+=dot(grad[n], col.T());
-
-    if(gsrcblob!=nullptr){
-      gcol=dot(weight.T(), grad[n]);
-      gsrc[n]=crop(pack_col2patch(gcol, padshape, kernel_, stride_), imgshape);
-    }
-  }
+  algorithm_->Backward(src, weight_->mutable_cpu_data(), grad.dptr,
+      weight_->mutable_cpu_grad(), gsrc);
 }
 
 /****************** Implementation for DropoutLayer ***********************/
@@ -232,47 +205,279 @@ void LabelLayer::ParseRecords(bool training, const vector<Record>& records, Blob
   CHECK_EQ(rid, blob->shape()[0]);
 }
 
+void LabelLayer::ParseDenseBatch(bool training, const DenseBatch& batch,
+    Blob<float>* blob){
+  CHECK_EQ(batch.size(), blob->shape()[0]);
+  float *label= blob->mutable_cpu_data() ;
+  for(int rid=0;rid<batch.size();rid++){
+    label[rid]=batch.labels[rid];
+    CHECK_LT(batch.labels[rid],10);
+  }
+}
+
+
+/*********************ImageDecoder**********************************/
+vector<int> ImageDecoder::Shape(const void* data, int size){
+  cv::Mat buf(1, size, CV_8UC1, const_cast<void*>(data));
+  cv::Mat img=cv::imdecode(buf, cv::IMREAD_ANYCOLOR);
+  CHECK(!img.empty())<<"Cannot decode the image";
+  return vector<int>{img.channels()==1?1:3, img.rows, img.cols};
+}
+
+void ImageDecoder::Setup(const vector<int>& shape, int batchsize,
+    int nthreads){
+  CHECK_EQ(shape.size(), 3);
+  CHECK(shape[0]==1||shape[0]==3)<<"Images must be grayscale or BGR";
+  shape_=shape;
+  images_.resize(batchsize);
+  pool_.reset(nthreads>0?new ThreadPool(nthreads):nullptr);
+}
+
+void ImageDecoder::Add(int rid, const void* data, int size){
+  images_[rid].assign(static_cast<const char*>(data), size);
+}
+
+void ImageDecoder::DecodeImage(const void* data, int size,
+    uint8_t* dst) const {
+  // scratch buffers of the calling thread, reused across images
+  thread_local cv::Mat decoded, resized;
+  int channels=shape_[0], height=shape_[1], width=shape_[2];
+  cv::Mat buf(1, size, CV_8UC1, const_cast<void*>(data));
+  cv::imdecode(buf, channels==1?cv::IMREAD_GRAYSCALE:cv::IMREAD_COLOR,
+      &decoded);
+  CHECK(!decoded.empty())<<"Cannot decode the image";
+  const cv::Mat* img=&decoded;
+  if(decoded.rows!=height||decoded.cols!=width){
+    cv::resize(decoded, resized, cv::Size(width, height));
+    img=&resized;
+  }
+  // interleaved rows into planar channels
+  for(int h=0;h<height;h++){
+    const uint8_t* row=img->ptr(h);
+    for(int c=0;c<channels;c++){
+      uint8_t* out=dst+(c*height+h)*width;
+      for(int w=0;w<width;w++)
+        out[w]=row[w*channels+c];
+    }
+  }
+}
+
+void ImageDecoder::Decode(DenseBatch* batch){
+  CHECK(!batch->is_float);
+  CHECK(batch->shape==shape_);
+  size_t size=batch->record_dim();
+  int n=batch->size();
+  CHECK_LE(n, static_cast<int>(images_.size()));
+  auto decode=[this, batch, size](int begin, int end){
+    for(int rid=begin;rid<end;rid++){
+      uint8_t* dst=reinterpret_cast<uint8_t*>(batch->tensors.data())+rid*size;
+      DecodeImage(images_[rid].data(), images_[rid].size(), dst);
+    }
+  };
+  if(pool_)
+    pool_->ParallelFor(n, decode);
+  else
+    decode(0, n);
+}
 
 /*********************LMDBDataLayer**********************************/
-void LMDBDataLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers){
-  if(random_skip_){
-    int nskip=rand()%random_skip_;
-    int n=0;
-    CHECK_EQ(mdb_cursor_get(mdb_cursor_, &mdb_key_,
-          &mdb_value_, MDB_FIRST), MDB_SUCCESS);
-    while (mdb_cursor_get(mdb_cursor_, &mdb_key_,
-          &mdb_value_, MDB_NEXT) == MDB_SUCCESS)
-      n++;
-    LOG(INFO)<<"Random Skip "<<nskip<<" records of total "<<n<<"records";
+/**
+ * Fields of a serialized Datum, bytes fields point into the serialized data.
+ */
+struct DatumView {
+  int channels, height, width, label;
+  bool encoded;
+  const void* data;
+  int datasize;
+  //!< packed float_data
+  const void* float_data;
+  int float_datasize;
+};
+
+/**
+ * Scan the fields of the serialized Datum without parsing it into a message.
+ * @return false if it cannot be viewed, e.g., float_data is not packed
+ */
+bool ScanDatum(const void* serialized, int size, DatumView* view){
+  google::protobuf::io::CodedInputStream in(
+      static_cast<const uint8_t*>(serialized), size);
+  memset(view, 0, sizeof(DatumView));
+  uint32_t tag, val;
+  while((tag=in.ReadTag())!=0){
+    int field=tag>>3, wiretype=tag&7;
+    if(wiretype==0){
+      if(!in.ReadVarint32(&val))
+        return false;
+      switch(field){
+        case 1: view->channels=val; break;
+        case 2: view->height=val; break;
+        case 3: view->width=val; break;
+        case 5: view->label=val; break;
+        case 7: view->encoded=val; break;
+      }
+    }else if(wiretype==2){
+      const void* ptr;
+      int avail;
+      if(!in.ReadVarint32(&val)||!in.GetDirectBufferPointer(&ptr, &avail)
+          ||avail<static_cast<int>(val))
+        return false;
+      if(field==4){
+        view->data=ptr;
+        view->datasize=val;
+      }else if(field==6){
+        view->float_data=ptr;
+        view->float_datasize=val;
+      }
+      in.Skip(val);
+    }else if(wiretype==5&&field!=6){
+      in.Skip(4);
+    }else if(wiretype==1){
+      in.Skip(8);
+    }else{
+      return false;
+    }
+  }
+  return in.ConsumedEntireMessage();
+}
+
+/**
+ * @return the key at fraction of the way from first to last. Keys are compared
+ * after their common prefix; if both continue with digits of the same length,
+ * e.g., zero-padded indices, the digits are interpolated as decimal numbers,
+ * otherwise the next 8 bytes are interpolated as big-endian integers.
+ */
+string InterpolateKey(const string& first, const string& last,
+    double fraction){
+  if(fraction<=0)
+    return first;
+  if(fraction>=1)
+    return last;
+  size_t prefix=0;
+  while(prefix<first.size()&&prefix<last.size()
+      &&first[prefix]==last[prefix])
+    prefix++;
+  // start of the digits containing the first different character
+  size_t start=prefix;
+  while(start>0&&isdigit(first[start-1]))
+    start--;
+  size_t end1=start, end2=start;
+  while(end1<first.size()&&isdigit(first[end1]))
+    end1++;
+  while(end2<last.size()&&isdigit(last[end2]))
+    end2++;
+  if(end1==end2&&end1>prefix&&end1-start<=18){
+    uint64_t a=std::stoull(first.substr(start, end1-start));
+    uint64_t b=std::stoull(last.substr(start, end2-start));
+    string digits=std::to_string(a+llround((b-a)*fraction));
+    return first.substr(0, start)+string(end1-start-digits.size(), '0')
+      +digits;
+  }
+  uint64_t a=0, b=0;
+  for(size_t k=prefix;k<prefix+8;k++){
+    a=a<<8|(k<first.size()?static_cast<uint8_t>(first[k]):0);
+    b=b<<8|(k<last.size()?static_cast<uint8_t>(last[k]):0);
+  }
+  uint64_t x=a+static_cast<uint64_t>((b-a)*fraction);
+  string key=first.substr(0, prefix);
+  for(int k=7;k>=0;k--)
+    key.push_back(static_cast<char>((x>>(8*k))&0xff));
+  key.resize(std::min(key.size(), std::max(first.size(), last.size())));
+  return key;
+}
+
+void LMDBDataLayer::NextEntry(){
+  if (mdb_cursor_get(mdb_cursor_, &mdb_key_,
+        &mdb_value_, MDB_NEXT) != MDB_SUCCESS) {
     // We have reached the end. Restart from the first.
+    DLOG(INFO) << "Restarting data prefetching from start.";
     CHECK_EQ(mdb_cursor_get(mdb_cursor_, &mdb_key_,
           &mdb_value_, MDB_FIRST), MDB_SUCCESS);
-    for(int i=0;i<nskip;i++){
-      if (mdb_cursor_get(mdb_cursor_, &mdb_key_,
-            &mdb_value_, MDB_NEXT) != MDB_SUCCESS) {
-        // We have reached the end. Restart from the first.
-        DLOG(INFO) << "Restarting data prefetching from start.";
-        CHECK_EQ(mdb_cursor_get(mdb_cursor_, &mdb_key_,
-              &mdb_value_, MDB_FIRST), MDB_SUCCESS);
-      }
+  }
+}
+
+void LMDBDataLayer::RandomSkip(){
+  MDB_stat stat;
+  CHECK_EQ(mdb_stat(mdb_txn_, mdb_dbi_, &stat), MDB_SUCCESS);
+  size_t count=stat.ms_entries;
+  CHECK_GT(count, 0);
+  int nskip=rand()%random_skip_%count;
+  LOG(INFO)<<"Random Skip "<<nskip<<" records of total "<<count<<" records";
+  CHECK_EQ(mdb_cursor_get(mdb_cursor_, &mdb_key_,
+        &mdb_value_, MDB_LAST), MDB_SUCCESS);
+  string last(static_cast<char*>(mdb_key_.mv_data), mdb_key_.mv_size);
+  CHECK_EQ(mdb_cursor_get(mdb_cursor_, &mdb_key_,
+        &mdb_value_, MDB_FIRST), MDB_SUCCESS);
+  string first(static_cast<char*>(mdb_key_.mv_data), mdb_key_.mv_size);
+  string key=InterpolateKey(first, last,
+      count>1?nskip/static_cast<double>(count-1):0);
+  mdb_key_.mv_size=key.size();
+  mdb_key_.mv_data=&key[0];
+  // key<=last, hence there is always an entry not less than it
+  CHECK_EQ(mdb_cursor_get(mdb_cursor_, &mdb_key_,
+        &mdb_value_, MDB_SET_RANGE), MDB_SUCCESS);
+  random_skip_=0;
+}
+
+void LMDBDataLayer::CopyDatum(const MDB_val& value, int rid){
+  size_t size=batch_.tensors.size()/batchsize_;
+  char* dst=batch_.tensors.data()+rid*size;
+  DatumView view;
+  if(ScanDatum(value.mv_data, value.mv_size, &view)&&!view.encoded){
+    const void* src=batch_.is_float?view.float_data:view.data;
+    CHECK_EQ(batch_.is_float?view.float_datasize:view.datasize, size)
+      <<"Datums are of different shapes";
+    memcpy(dst, src, size);
+    batch_.labels[rid]=view.label;
+  }else{
+    // e.g., float_data is not packed
+    Datum datum;
+    datum.ParseFromArray(value.mv_data, value.mv_size);
+    CHECK(!datum.encoded())<<"Datums are encoded";
+    if(batch_.is_float){
+      CHECK_EQ(datum.float_data_size()*sizeof(float), size);
+      memcpy(dst, datum.float_data().data(), size);
+    }else{
+      CHECK_EQ(datum.data().size(), size);
+      memcpy(dst, datum.data().data(), size);
     }
-    random_skip_=0;
+    batch_.labels[rid]=datum.label();
+  }
+}
+
+void LMDBDataLayer::AddEncodedDatum(const MDB_val& value, int rid){
+  DatumView view;
+  if(ScanDatum(value.mv_data, value.mv_size, &view)){
+    CHECK(view.encoded)<<"Datums are not all encoded";
+    decoder_.Add(rid, view.data, view.datasize);
+    batch_.labels[rid]=view.label;
+  }else{
+    Datum datum;
+    datum.ParseFromArray(value.mv_data, value.mv_size);
+    CHECK(datum.encoded())<<"Datums are not all encoded";
+    decoder_.Add(rid, datum.data().data(), datum.data().size());
+    batch_.labels[rid]=datum.label();
   }
+}
+
+void LMDBDataLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers){
+  if(random_skip_)
+    RandomSkip();
   Datum datum;
-  for(auto& record: records_){
-    SingleLabelImageRecord* image=record.mutable_image();
+  for(int rid=0;rid<batchsize_;rid++){
     CHECK_EQ(mdb_cursor_get(mdb_cursor_, &mdb_key_,
           &mdb_value_, MDB_GET_CURRENT), MDB_SUCCESS);
-    datum.ParseFromArray(mdb_value_.mv_data, mdb_value_.mv_size);
-    ConvertDatumToSingleLableImageRecord(datum, image);
-    if (mdb_cursor_get(mdb_cursor_, &mdb_key_,
-          &mdb_value_, MDB_NEXT) != MDB_SUCCESS) {
-      // We have reached the end. Restart from the first.
-      DLOG(INFO) << "Restarting data prefetching from start.";
-      CHECK_EQ(mdb_cursor_get(mdb_cursor_, &mdb_key_,
-            &mdb_value_, MDB_FIRST), MDB_SUCCESS);
+    if(encoded_){
+      AddEncodedDatum(mdb_value_, rid);
+    }else if(dense_){
+      CopyDatum(mdb_value_, rid);
+    }else{
+      datum.ParseFromArray(mdb_value_.mv_data, mdb_value_.mv_size);
+      ConvertDatumToSingleLableImageRecord(datum, records_[rid].mutable_image());
     }
+    NextEntry();
   }
+  if(encoded_)
+    decoder_.Decode(&batch_);
 }
 
 void LMDBDataLayer::ConvertDatumToSingleLableImageRecord(const Datum& datum,
@@ -320,11 +525,38 @@ void LMDBDataLayer::Setup(const LayerProto& proto,
   Datum datum;
   datum.ParseFromArray(mdb_value_.mv_data, mdb_value_.mv_size);
   SingleLabelImageRecord* record=sample_.mutable_image();
-  ConvertDatumToSingleLableImageRecord(datum, record);
-
   batchsize_=proto.data_param().batchsize();
-  records_.resize(batchsize_);
   random_skip_=proto.data_param().random_skip();
+  encoded_=datum.encoded();
+  if(encoded_){
+    // all images are decoded (and resized) to the shape of the sample
+    vector<int> shape=ImageDecoder::Shape(datum.data().data(),
+        datum.data().size());
+    decoder_.Setup(shape, batchsize_, proto.data_param().decode_threads());
+    string pixel(shape[0]*shape[1]*shape[2], 0);
+    decoder_.DecodeImage(datum.data().data(), datum.data().size(),
+        reinterpret_cast<uint8_t*>(&pixel[0]));
+    datum.set_channels(shape[0]);
+    datum.set_height(shape[1]);
+    datum.set_width(shape[2]);
+    datum.set_data(pixel);
+    datum.set_encoded(false);
+  }
+  ConvertDatumToSingleLableImageRecord(datum, record);
+
+  // raw images of the same shape are copied into the dense batch
+  dense_=encoded_||(proto.data_param().dense()&&datum.channels()
+    &&datum.height()&&datum.width()
+    &&(datum.data().size()||datum.float_data_size()));
+  if(dense_){
+    batch_.shape=vector<int>{datum.channels(), datum.height(), datum.width()};
+    batch_.is_float=datum.data().empty();
+    batch_.tensors.resize(batchsize_*batch_.record_dim()
+        *(batch_.is_float?sizeof(float):sizeof(uint8_t)));
+    batch_.labels.resize(batchsize_);
+  }else{
+    records_.resize(batchsize_);
+  }
 }
 
 /***************** Implementation for LRNLayer *************************/
@@ -378,79 +610,201 @@ void LRNLayer::ComputeGradient(const vector<SLayer>& srclayers) {
 }
 
 /**************** Implementation for MnistImageLayer******************/
+/**
+ * Bilinear interpolation of the size*size image at (x, y), pixels out of the
+ * image are 0.
+ */
+template<typename T>
+inline float Bilinear(const T* src, int size, float x, float y){
+  int x0=static_cast<int>(floorf(x)), y0=static_cast<int>(floorf(y));
+  float fx=x-x0, fy=y-y0;
+  float v[4]={0, 0, 0, 0};
+  for(int k=0;k<4;k++){
+    int xx=x0+(k&1), yy=y0+(k>>1);
+    if(xx>=0&&xx<size&&yy>=0&&yy<size)
+      v[k]=static_cast<float>(src[yy*size+xx]);
+  }
+  return (1-fy)*((1-fx)*v[0]+fx*v[1])+fy*((1-fx)*v[2]+fx*v[3]);
+}
 
-void MnistImageLayer::ParseRecords(bool training, const vector<Record>& records,
-    Blob<float>* blob){
-  LOG_IF(ERROR, records.size()==0)<<"Empty records to parse";
-  int ndim=records.at(0).image().shape_size();
-  int inputsize =records.at(0).image().shape(ndim-1);
-
-  float* dptr=blob->mutable_cpu_data();
-  for(const Record& record: records){
-    // copy from record to cv::Mat
-    cv::Mat input(inputsize, inputsize, CV_32FC1);
-    const SingleLabelImageRecord& imagerecord=record.image();
-    if(imagerecord.pixel().size()){
-      string pixel=imagerecord.pixel();
-      for(int i=0,k=0;i<inputsize;i++)
-        for(int j=0;j<inputsize;j++)
-          // NOTE!!! must cast pixel to uint8_t then to float!!! waste a lot of
-          // time to debug this
-          input.at<float>(i,j)=static_cast<float>(static_cast<uint8_t>(pixel[k++]));
-    }else{
-      for(int i=0,k=0;i<inputsize;i++)
-        for(int j=0;j<inputsize;j++)
-          input.at<float>(i,j)=imagerecord.data(k++);
+template<typename T>
+void MnistImageLayer::ParseImage(const T* src, int rid, float* dst) const {
+  float scale=1.0f/norm_a_;
+  if(!warp_){
+    for(int i=0;i<size_*size_;i++)
+      dst[i]=src[i]*scale-norm_b_;
+    return;
+  }
+  const float* m=affine_.data()+6*rid;
+  const float* dx=nullptr, *dy=nullptr;
+  if(elastic_){
+    dx=fields_.data()+2*size_*size_*(rid/elastic_freq_);
+    dy=dx+size_*size_;
+  }
+  for(int y=0,i=0;y<size_;y++){
+    for(int x=0;x<size_;x++,i++){
+      float u=x, v=y;
+      if(dx){
+        u+=dx[i];
+        v+=dy[i];
+      }
+      dst[i]=Bilinear(src, inputsize_, m[0]*u+m[1]*v+m[2], m[3]*u+m[4]*v+m[5])
+        *scale-norm_b_;
     }
-    int size=blob->shape()[1];
-    /*
-    cv::Mat resizeMat=input;
-    // affine transform, scaling, rotation and shearing
-    if(gamma_){
-      float r1=rand_real()*2-1;
-      float r2=rand_real()*2-1;
-      int h=static_cast<int>(inputsize*(1.+r1*gamma_/100.0));
-      int w=static_cast<int>(inputsize*(1.+r2*gamma_/100.0));
-      cv::resize(input, resizeMat, cv::Size(h,w));
+  }
+}
+
+void MnistImageLayer::GenerateField(int index, unsigned seed, float* tmp){
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+  int n=size_*size_, r=kernel_/2;
+  for(int k=0;k<2;k++){
+    float* field=fields_.data()+(2*index+k)*n;
+    for(int i=0;i<n;i++)
+      tmp[i]=uniform(rng);
+    // smooth rows of tmp into field and then columns of field into tmp, with
+    // zero padding; the inner loops are over consecutive pixels
+    memset(field, 0, sizeof(float)*n);
+    for(int y=0;y<size_;y++)
+      for(int j=-r;j<=r;j++){
+        float g=gauss_[j+r];
+        float* out=field+y*size_;
+        const float* in=tmp+y*size_+j;
+        for(int x=std::max(0, -j);x<std::min(size_, size_-j);x++)
+          out[x]+=g*in[x];
+      }
+    memset(tmp, 0, sizeof(float)*n);
+    for(int y=0;y<size_;y++)
+      for(int j=std::max(-r, -y);j<=std::min(r, size_-1-y);j++){
+        float g=gauss_[j+r];
+        float* out=tmp+y*size_;
+        const float* in=field+(y+j)*size_;
+        for(int x=0;x<size_;x++)
+          out[x]+=g*in[x];
+      }
+    for(int i=0;i<n;i++)
+      field[i]=alpha_*tmp[i];
+  }
+}
+
+void MnistImageLayer::SampleTransforms(bool training,
+    const vector<int>& labels){
+  int n=labels.size();
+  affine_.resize(6*n);
+  float cin=(inputsize_-1)/2.0f, cout=(size_-1)/2.0f;
+  float ratio=static_cast<float>(inputsize_)/size_;
+  for(int rid=0;rid<n;rid++){
+    // [a b; c d] transforms centered input coordinates to output coordinates
+    float a=1, b=0, c=0, d=1;
+    if(training&&gamma_){
+      a=1+(rand_real()*2-1)*gamma_/100;
+      d=1+(rand_real()*2-1)*gamma_/100;
     }
-    cv::Mat betaMat=resizeMat;
-    cv::Mat warpmat(2,3, CV_32FC1);
-    warpmat.at<float>(0,0)=1.0;
-    warpmat.at<float>(0,1)=0.0;
-    warpmat.at<float>(0,2)=0.0;
-    warpmat.at<float>(1,0)=0.0;
-    warpmat.at<float>(1,1)=1.0;
-    warpmat.at<float>(1,2)=0.0;
-
-    if(beta_){
-      float r=rand_real()*2-1;
-      if(rand() % 2){ // rotation
-        cv::Point center(resizeMat.rows/2, resizeMat.cols/2);
-        warpmat=cv::getRotationMatrix2D(center, r*beta_, 1.0);
+    if(training&&beta_){
+      float r=(rand_real()*2-1)*beta_;
+      if(rand()%2){
+        // rotation
+        float t=r*M_PI/180, cost=cosf(t), sint=sinf(t);
+        b=-sint*d;
+        c=sint*a;
+        a*=cost;
+        d*=cost;
       }else{
-        //shearing
-        warpmat.at<float>(0,1)=r*beta_/90;
-        if(imagerecord.label()==1 ||imagerecord.label()==7)
-          warpmat.at<float>(0,1)/=2.0;
+        // horizontal shearing
+        float shear=r/90;
+        if(labels[rid]==1||labels[rid]==7)
+          shear/=2;
+        b=shear*d;
       }
     }
-    cv::warpAffine(resizeMat, betaMat, warpmat, cv::Size(size, size));
-    */
+    // the inverse, scaled by ratio for resizing, maps output to input
+    float det=a*d-b*c;
+    float* m=affine_.data()+6*rid;
+    m[0]=ratio*d/det;
+    m[1]=-ratio*b/det;
+    m[3]=-ratio*c/det;
+    m[4]=ratio*a/det;
+    m[2]=cin-(m[0]+m[1])*cout;
+    m[5]=cin-(m[3]+m[4])*cout;
+  }
+  elastic_=training&&elastic_freq_>0&&alpha_;
+  warp_=elastic_||size_!=inputsize_||(training&&(gamma_||beta_));
+  if(elastic_){
+    int nfields=(n+elastic_freq_-1)/elastic_freq_;
+    fields_.resize(nfields*2*size_*size_);
+    // seeds are drawn here to keep rand() out of the parallel generation
+    vector<unsigned> seeds(nfields);
+    for(auto& seed: seeds)
+      seed=rand();
+    ParallelFor(nfields, [&](int begin, int end){
+        vector<float> tmp(size_*size_);
+        for(int i=begin;i<end;i++)
+          GenerateField(i, seeds[i], tmp.data());
+      });
+  }
+}
+
+void MnistImageLayer::ParallelFor(int n,
+    const std::function<void(int, int)>& func){
+  ThreadPool* pool=Transform::pool();
+  if(pool!=nullptr)
+    pool->ParallelFor(n, func);
+  else
+    func(0, n);
+}
 
-    for(int i=0;i<size;i++){
-      for(int j=0;j<size;j++){
-        *dptr=input.at<float>(i,j)/norm_a_-norm_b_;
-        dptr++;
+void MnistImageLayer::ParseRecords(bool training, const vector<Record>& records,
+    Blob<float>* blob){
+  LOG_IF(ERROR, records.size()==0)<<"Empty records to parse";
+  int n=records.size();
+  CHECK_EQ(n, blob->shape()[0]);
+  vector<int> labels(n);
+  for(int rid=0;rid<n;rid++)
+    labels[rid]=records[rid].image().label();
+  SampleTransforms(training, labels);
+  int dim=size_*size_, rawdim=inputsize_*inputsize_;
+  float* dptr=blob->mutable_cpu_data();
+  ParallelFor(n, [&](int begin, int end){
+      for(int rid=begin;rid<end;rid++){
+        const SingleLabelImageRecord& image=records[rid].image();
+        if(image.pixel().size()){
+          // pixels must be read as uint8_t rather than char
+          CHECK_EQ(image.pixel().size(), rawdim);
+          ParseImage(reinterpret_cast<const uint8_t*>(image.pixel().data()),
+              rid, dptr+rid*dim);
+        }else{
+          CHECK_EQ(image.data_size(), rawdim);
+          ParseImage(image.data().data(), rid, dptr+rid*dim);
+        }
       }
-    }
-  }
-  CHECK_EQ(dptr, blob->mutable_cpu_data()+blob->count());
+    });
 }
+
+void MnistImageLayer::ParseDenseBatch(bool training, const DenseBatch& batch,
+    Blob<float>* blob){
+  int n=batch.size();
+  CHECK_EQ(n, blob->shape()[0]);
+  CHECK_EQ(batch.record_dim(), inputsize_*inputsize_);
+  SampleTransforms(training, batch.labels);
+  int dim=size_*size_, rawdim=batch.record_dim();
+  float* dptr=blob->mutable_cpu_data();
+  ParallelFor(n, [&](int begin, int end){
+      for(int rid=begin;rid<end;rid++){
+        if(batch.is_float)
+          ParseImage(reinterpret_cast<const float*>(batch.tensors.data())
+              +rid*rawdim, rid, dptr+rid*dim);
+        else
+          ParseImage(reinterpret_cast<const uint8_t*>(batch.tensors.data())
+              +rid*rawdim, rid, dptr+rid*dim);
+      }
+    });
+}
+
 void MnistImageLayer::Setup(const LayerProto& proto,
     const vector<SLayer>& srclayers){
   CHECK_EQ(srclayers.size(),1);
   int batchsize=static_cast<DataLayer*>(srclayers[0].get())->batchsize();
-  Record sample=static_cast<DataLayer*>(srclayers[0].get())->sample();
+  const Record& sample=static_cast<DataLayer*>(srclayers[0].get())->sample();
   kernel_=proto.mnist_param().kernel();
   sigma_=proto.mnist_param().sigma();
   alpha_=proto.mnist_param().alpha();
@@ -463,13 +817,25 @@ void MnistImageLayer::Setup(const LayerProto& proto,
 
   int ndim=sample.image().shape_size();
   CHECK_GE(ndim,2);
-  if(resize_)
-    data_.Reshape(vector<int>{batchsize, resize_, resize_});
-  else{
-    int s=sample.image().shape(ndim-1);
-    CHECK_EQ(s,sample.image().shape(ndim-2));
-    data_.Reshape(vector<int>{batchsize, s, s });
+  inputsize_=sample.image().shape(ndim-1);
+  CHECK_EQ(inputsize_,sample.image().shape(ndim-2));
+  size_=resize_?resize_:inputsize_;
+  data_.Reshape(vector<int>{batchsize, size_, size_});
+
+  if(elastic_freq_>0&&alpha_){
+    CHECK_EQ(kernel_%2, 1)<<"The gaussian kernel size should be odd";
+    CHECK_GT(sigma_, 0);
+    gauss_.resize(kernel_);
+    float sum=0;
+    for(int j=0;j<kernel_;j++){
+      float d=j-kernel_/2;
+      gauss_[j]=expf(-d*d/(2*sigma_*sigma_));
+      sum+=gauss_[j];
+    }
+    for(auto& g: gauss_)
+      g/=sum;
   }
+  warp_=elastic_=false;
 }
 
 /******************** Implementation for PoolingLayer******************/
@@ -501,6 +867,12 @@ void PoolingLayer::Setup(const LayerProto& proto,
           width_ - kernel_) / stride_)) + 1;
   data_.Reshape(vector<int>{batchsize_, channels_, pooled_height_, pooled_width_});
   grad_.ReshapeLike(data_);
+  cache_argmax_=pool_==PoolingProto_PoolMethod_MAX
+    &&pool_param.cache_argmax();
+  if(cache_argmax_)
+    argmax_.resize(data_.count());
+  else
+    argmax_.clear();
 }
 
 void PoolingLayer::SetupAfterPartition(const LayerProto& proto,
@@ -514,7 +886,33 @@ void PoolingLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers
       Shape4(batchsize_, channels_, height_, width_));
   Tensor<cpu, 4> data(data_.mutable_cpu_data(),
       Shape4(batchsize_, channels_, pooled_height_, pooled_width_));
-  if(pool_ == PoolingProto_PoolMethod_MAX)
+  if(cache_argmax_){
+    int area=height_*width_, pooled=pooled_height_*pooled_width_;
+    IntraOpFor(batchsize_*channels_, [&](int begin, int end){
+        for(int i=begin;i<end;i++){
+          const float* img=src.dptr+static_cast<size_t>(i)*area;
+          float* out=data.dptr+static_cast<size_t>(i)*pooled;
+          int* idx=argmax_.data()+static_cast<size_t>(i)*pooled;
+          // same windows as pool<red::maximum>, clipped at the border; the
+          // last window starts inside the image even if stride_>kernel_
+          for(int py=0;py<pooled_height_;py++){
+            int ystart=std::min(py*stride_, height_-1);
+            int yend=std::min(ystart+kernel_, height_);
+            for(int px=0;px<pooled_width_;px++){
+              int xstart=std::min(px*stride_, width_-1);
+              int xend=std::min(xstart+kernel_, width_);
+              int maxidx=ystart*width_+xstart;
+              for(int y=ystart;y<yend;y++)
+                for(int x=xstart;x<xend;x++)
+                  if(img[y*width_+x]>img[maxidx])
+                    maxidx=y*width_+x;
+              out[py*pooled_width_+px]=img[maxidx];
+              idx[py*pooled_width_+px]=maxidx;
+            }
+          }
+        }
+      });
+  }else if(pool_ == PoolingProto_PoolMethod_MAX)
     data=pool<red::maximum>(src, kernel_, stride_);
   else if(pool_ == PoolingProto_PoolMethod_AVE)
     data=pool<red::sum>(src, kernel_, stride_)
@@ -532,7 +930,19 @@ void PoolingLayer::ComputeGradient(const vector<SLayer>& srclayers) {
   Shape<4> s2= Shape4(batchsize_, channels_, pooled_height_, pooled_width_);
   Tensor<cpu, 4> data(data_.mutable_cpu_data(), s2);
   Tensor<cpu, 4> grad(grad_.mutable_cpu_data(), s2);
-  if(pool_ == PoolingProto_PoolMethod_MAX)
+  if(cache_argmax_){
+    int area=height_*width_, pooled=pooled_height_*pooled_width_;
+    IntraOpFor(batchsize_*channels_, [&](int begin, int end){
+        for(int i=begin;i<end;i++){
+          float* img=gsrc.dptr+static_cast<size_t>(i)*area;
+          const float* g=grad.dptr+static_cast<size_t>(i)*pooled;
+          const int* idx=argmax_.data()+static_cast<size_t>(i)*pooled;
+          memset(img, 0, area*sizeof(float));
+          for(int k=0;k<pooled;k++)
+            img[idx[k]]+=g[k];
+        }
+      });
+  }else if(pool_ == PoolingProto_PoolMethod_MAX)
       gsrc = unpool<red::maximum>(src, data, grad, kernel_, stride_);
   else if(pool_ == PoolingProto_PoolMethod_AVE)
       gsrc = unpool<red::sum>(src, data, grad, kernel_, stride_)
@@ -569,107 +979,444 @@ void ReLULayer::ComputeGradient(const vector<SLayer>& srclayers) {
 }
 
 /*************** Implementation for RGBImageLayer *************************/
+/**
+ * dst[i]=(src[i]-mean[i])*scale for i in [0, n), reading src and mean
+ * backwards, i.e., from n-1-i, if mirror. No mean is subtracted if mean is
+ * nullptr.
+ */
+template<typename T>
+inline void ConvertRow(const T* src, const float* mean, int n, bool mirror,
+    float scale, float* dst){
+  for(int i=0;i<n;i++){
+    int j=mirror?n-1-i:i;
+    dst[i]=(src[j]-(mean?mean[j]:0.f))*scale;
+  }
+}
 
-void RGBImageLayer::ParseRecords(bool training, const vector<Record>& records,
-    Blob<float>* blob){
-  LOG_IF(ERROR, records.size()==0)<<"Empty records to parse";
-  const vector<int>& s=blob->shape();
-  Tensor<cpu, 4> images(blob->mutable_cpu_data(), Shape4(s[0],s[1],s[2],s[3]));
-  const SingleLabelImageRecord& r=records.at(0).image();
-  Tensor<cpu, 3> raw_image(Shape3(r.shape(0),r.shape(1),r.shape(2)));
-  AllocSpace(raw_image);
-
-  Tensor<cpu, 3> croped_image(Shape3(s[1],s[2],s[3]));
-  if(cropsize_)
-    AllocSpace(croped_image);
-    //CHECK(std::equal(croped_image.shape(), raw_image.shape());
-  int rid=0;
-  for(const Record& record: records){
-    auto image=images[rid];
-    bool do_crop=cropsize_>0&&training;
-    bool do_mirror=mirror_&&rand()%2&&training;
-    float* dptr=nullptr;
-    if(do_crop||do_mirror)
-      dptr=raw_image.dptr;
-    else
-      dptr=image.dptr;
-    if(record.image().pixel().size()){
-      string pixel=record.image().pixel();
-      for(size_t i=0;i<pixel.size();i++)
-        dptr[i]=static_cast<float>(pixel[i]);
-    }else {
-      memcpy(dptr, record.image().data().data(),
-          sizeof(float)*record.image().data_size());
+inline void ConvertRow(const uint8_t* src, const float* mean, int n,
+    bool mirror, float scale, float* dst){
+  int i=0;
+#ifdef __SSE2__
+  const __m128i zero=_mm_setzero_si128();
+  const __m128 vscale=_mm_set1_ps(scale);
+  for(;i+16<=n;i+=16){
+    // offset of the 16 pixels for dst[i, i+16)
+    int j=mirror?n-i-16:i;
+    __m128i pixels=_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+j));
+    __m128i lo=_mm_unpacklo_epi8(pixels, zero);
+    __m128i hi=_mm_unpackhi_epi8(pixels, zero);
+    __m128 v[4]={
+      _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)),
+      _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)),
+      _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)),
+      _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero))};
+    for(int k=0;k<4;k++){
+      if(mean)
+        v[k]=_mm_sub_ps(v[k], _mm_loadu_ps(mean+j+4*k));
+      v[k]=_mm_mul_ps(v[k], vscale);
+    }
+    if(mirror){
+      for(int k=0;k<4;k++)
+        _mm_storeu_ps(dst+i+4*k,
+            _mm_shuffle_ps(v[3-k], v[3-k], _MM_SHUFFLE(0, 1, 2, 3)));
+    }else{
+      for(int k=0;k<4;k++)
+        _mm_storeu_ps(dst+i+4*k, v[k]);
     }
+  }
+#endif
+  // the rest dst[i, n) is from src[i, n), or from src[0, n-i) if mirror
+  if(mirror)
+    ConvertRow<uint8_t>(src, mean, n-i, true, scale, dst+i);
+  else
+    ConvertRow<uint8_t>(src+i, mean?mean+i:nullptr, n-i, false, scale, dst+i);
+}
+
+template<typename T>
+void RGBImageLayer::ParseImage(const T* src, int rid, float* dst) const {
+  int h=cropsize_?cropsize_:height_, w=cropsize_?cropsize_:width_;
+  const float* mean=mean_.empty()?nullptr:mean_.data();
+  for(int c=0;c<channels_;c++){
+    for(int y=0;y<h;y++){
+      int offset=(c*height_+hoffs_[rid]+y)*width_+woffs_[rid];
+      ConvertRow(src+offset, mean?mean+offset:nullptr, w, mirrors_[rid],
+          scale_, dst+(c*h+y)*w);
+    }
+  }
+}
 
+void RGBImageLayer::SampleTransforms(bool training, int n){
+  hoffs_.resize(n);
+  woffs_.resize(n);
+  mirrors_.resize(n);
+  for(int rid=0;rid<n;rid++){
     if(cropsize_){
-      int hoff=rand()%(r.shape(1)-cropsize_);
-      int woff=rand()%(r.shape(2)-cropsize_);
-      Shape<2> cropshape=Shape2(cropsize_, cropsize_);
-        croped_image=crop(raw_image, cropshape, hoff, woff);
-    }else
-      croped_image=raw_image;
-
-    if(mirror_&&rand()%2){
-      image=mirror(croped_image);
+      // random crop for training, center crop for test
+      hoffs_[rid]=training?rand()%(height_-cropsize_+1):(height_-cropsize_)/2;
+      woffs_[rid]=training?rand()%(width_-cropsize_+1):(width_-cropsize_)/2;
+    }else{
+      hoffs_[rid]=woffs_[rid]=0;
     }
-    rid++;
+    mirrors_[rid]=mirror_&&training&&rand()%2;
   }
-  if(scale_)
-    images=images*scale_;
+}
 
-  FreeSpace(raw_image);
-  if(cropsize_)
-    FreeSpace(croped_image);
+void RGBImageLayer::ParseRecords(bool training, const vector<Record>& records,
+    Blob<float>* blob){
+  LOG_IF(ERROR, records.size()==0)<<"Empty records to parse";
+  int n=records.size();
+  CHECK_EQ(n, blob->shape()[0]);
+  SampleTransforms(training, n);
+  int dim=blob->count()/n, rawdim=channels_*height_*width_;
+  float* dptr=blob->mutable_cpu_data();
+  auto parse=[&](int begin, int end){
+    for(int rid=begin;rid<end;rid++){
+      const SingleLabelImageRecord& image=records[rid].image();
+      if(image.pixel().size()){
+        CHECK_EQ(image.pixel().size(), rawdim);
+        ParseImage(reinterpret_cast<const uint8_t*>(image.pixel().data()),
+            rid, dptr+rid*dim);
+      }else{
+        CHECK_EQ(image.data_size(), rawdim);
+        ParseImage(image.data().data(), rid, dptr+rid*dim);
+      }
+    }
+  };
+  ThreadPool* pool=Transform::pool();
+  if(pool!=nullptr)
+    pool->ParallelFor(n, parse);
+  else
+    parse(0, n);
+}
+
+void RGBImageLayer::ParseDenseBatch(bool training, const DenseBatch& batch,
+    Blob<float>* blob){
+  int n=batch.size();
+  CHECK_EQ(n, blob->shape()[0]);
+  CHECK(batch.shape==(vector<int>{channels_, height_, width_}));
+  SampleTransforms(training, n);
+  int dim=blob->count()/n, rawdim=batch.record_dim();
+  float* dptr=blob->mutable_cpu_data();
+  auto parse=[&](int begin, int end){
+    for(int rid=begin;rid<end;rid++){
+      if(batch.is_float)
+        ParseImage(reinterpret_cast<const float*>(batch.tensors.data())
+            +rid*rawdim, rid, dptr+rid*dim);
+      else
+        ParseImage(reinterpret_cast<const uint8_t*>(batch.tensors.data())
+            +rid*rawdim, rid, dptr+rid*dim);
+    }
+  };
+  ThreadPool* pool=Transform::pool();
+  if(pool!=nullptr)
+    pool->ParallelFor(n, parse);
+  else
+    parse(0, n);
 }
+
 void RGBImageLayer::Setup(const LayerProto& proto,
     const vector<SLayer>& srclayers){
   CHECK_EQ(srclayers.size(),1);
-  scale_=proto.rgbimage_param().scale();
-  cropsize_=proto.rgbimage_param().cropsize();
-  mirror_=proto.rgbimage_param().mirror();
+  const RGBImage& param=proto.rgbimage_param();
+  scale_=param.scale()?param.scale():1.0f;
+  cropsize_=param.cropsize();
+  mirror_=param.mirror();
   int batchsize=static_cast<DataLayer*>(srclayers[0].get())->batchsize();
-  Record sample=static_cast<DataLayer*>(srclayers[0].get())->sample();
+  const Record& sample=static_cast<DataLayer*>(srclayers[0].get())->sample();
   vector<int> shape;
   shape.push_back(batchsize);
   for(int x: sample.image().shape())
     shape.push_back(x);
   CHECK_EQ(shape.size(),4);
+  channels_=shape[1];
+  height_=shape[2];
+  width_=shape[3];
   if(cropsize_){
+    CHECK_LE(cropsize_, height_);
+    CHECK_LE(cropsize_, width_);
     shape[2]=cropsize_;
     shape[3]=cropsize_;
   }
   data_.Reshape(shape);
+  mean_.clear();
+  if(param.has_meanfile()){
+    BlobProto mean;
+    ReadProtoFromBinaryFile(param.meanfile().c_str(), &mean);
+    CHECK_EQ(mean.data_size(), channels_*height_*width_)
+      <<"The mean image should be of the raw image shape";
+    mean_.assign(mean.data().begin(), mean.data().end());
+  }
 }
 
 /***************Implementation for ShardDataLayer**************************/
+ShardDataLayer::~ShardDataLayer(){
+  raw_queue_.Close();
+  free_raw_queue_.Close();
+  record_queue_.Close();
+  free_record_queue_.Close();
+  for(auto& th: threads_)
+    th.join();
+}
+
+template<typename... T>
+void ShardDataLayer::NextRecord(string* key, T... val){
+  if(shuffle_!=nullptr){
+    if(!shuffle_->Next(key, val...)){
+      shuffle_->NextEpoch();
+      CHECK(shuffle_->Next(key, val...));
+    }
+  }else if(!shard_->Next(key, val...)){
+    // We have reached the end. Restart from the first.
+    shard_->SeekToFirst();
+    CHECK(shard_->Next(key, val...));
+  }
+}
+
+/**
+ * Fields of the image of a serialized Record, pixel points into the
+ * serialized data.
+ */
+struct ImageRecordView {
+  int label;
+  bool encoded;
+  const void* pixel;
+  int pixelsize;
+};
+
+/**
+ * Scan the image of the serialized Record without parsing it into a message.
+ * @return false if it has no image or it is malformed
+ */
+bool ScanImageRecord(const void* serialized, int size, ImageRecordView* view){
+  using google::protobuf::internal::WireFormatLite;
+  google::protobuf::io::CodedInputStream in(
+      static_cast<const uint8_t*>(serialized), size);
+  memset(view, 0, sizeof(ImageRecordView));
+  bool has_image=false;
+  uint32_t tag, val;
+  while((tag=in.ReadTag())!=0){
+    // Record::image
+    if(tag!=(2<<3|WireFormatLite::WIRETYPE_LENGTH_DELIMITED)){
+      if(!WireFormatLite::SkipField(&in, tag))
+        return false;
+      continue;
+    }
+    if(!in.ReadVarint32(&val))
+      return false;
+    auto limit=in.PushLimit(val);
+    while((tag=in.ReadTag())!=0){
+      if(tag==(2<<3|WireFormatLite::WIRETYPE_VARINT)){
+        if(!in.ReadVarint32(&val))
+          return false;
+        view->label=val;
+      }else if(tag==(5<<3|WireFormatLite::WIRETYPE_VARINT)){
+        if(!in.ReadVarint32(&val))
+          return false;
+        view->encoded=val;
+      }else if(tag==(3<<3|WireFormatLite::WIRETYPE_LENGTH_DELIMITED)){
+        int avail;
+        if(!in.ReadVarint32(&val)||!in.GetDirectBufferPointer(&view->pixel,
+              &avail)||avail<static_cast<int>(val))
+          return false;
+        view->pixelsize=val;
+        in.Skip(val);
+      }else if(!WireFormatLite::SkipField(&in, tag)){
+        return false;
+      }
+    }
+    in.PopLimit(limit);
+    has_image=true;
+  }
+  return has_image;
+}
+
+void ShardDataLayer::CopyRecord(const char* val, int vallen, int rid){
+  ImageRecordView view;
+  size_t size=batch_.tensors.size()/batchsize_;
+  CHECK(ScanImageRecord(val, vallen, &view)&&!view.encoded
+      &&view.pixelsize==size)
+    <<"Records are not pixel images of the same shape, "
+    <<"set DataProto::dense to false";
+  memcpy(batch_.tensors.data()+rid*size, view.pixel, size);
+  batch_.labels[rid]=view.label;
+}
+
+void ShardDataLayer::AddEncodedRecord(const char* val, int vallen, int rid){
+  ImageRecordView view;
+  CHECK(ScanImageRecord(val, vallen, &view)&&view.encoded)
+    <<"Records are not all encoded images";
+  decoder_.Add(rid, view.pixel, view.pixelsize);
+  batch_.labels[rid]=view.label;
+}
+
+void ShardDataLayer::RandomSkip(){
+  int nskip=rand()%random_skip_;
+  int count=shard_->Count();
+  LOG(INFO)<<"Random Skip "<<nskip<<" records, there are "<<count
+    <<" records in total";
+  shard_->Seek(nskip%count);
+  random_skip_=0;
+}
+
 void ShardDataLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers){
-  if(random_skip_){
-    int nskip=rand()%random_skip_;
-    LOG(INFO)<<"Random Skip "<<nskip<<" records, there are "<<shard_->Count()
-      <<" records in total";
-    string key;
-    for(int i=0;i<nskip;i++){
-      shard_->Next(&key, &sample_);
+  if(threads_.size()&&dense_){
+    vector<string>* raw;
+    CHECK(raw_queue_.Pop(&raw));
+    for(int rid=0;rid<batchsize_;rid++)
+      CopyRecord(raw->at(rid).data(), raw->at(rid).size(), rid);
+    free_raw_queue_.Push(raw);
+    return;
+  }
+  if(threads_.size()){
+    vector<Record>* batch;
+    CHECK(record_queue_.Pop(&batch));
+    records_.swap(*batch);
+    free_record_queue_.Push(batch);
+    return;
+  }
+  if(random_skip_)
+    RandomSkip();
+  string key;
+  if(dense_){
+    const char* val;
+    int vallen;
+    for(int rid=0;rid<batchsize_;rid++){
+      NextRecord(&key, &val, &vallen);
+      if(encoded_)
+        AddEncodedRecord(val, vallen, rid);
+      else
+        CopyRecord(val, vallen, rid);
     }
-    random_skip_=0;
+    if(encoded_)
+      decoder_.Decode(&batch_);
+    return;
+  }
+  for(auto& record: records_)
+    NextRecord(&key, &record);
+}
+
+void ShardDataLayer::ReadBatches(){
+  if(random_skip_)
+    RandomSkip();
+  string key;
+  vector<string>* batch;
+  while(free_raw_queue_.Pop(&batch)){
+    for(auto& val: *batch)
+      NextRecord(&key, &val);
+    if(!raw_queue_.Push(batch))
+      break;
   }
-  for(auto& record: records_){
-    string key;
-    shard_->Next(&key, &record);
+}
+
+void ShardDataLayer::DecodeBatches(){
+  vector<string>* raw;
+  vector<Record>* records;
+  while(raw_queue_.Pop(&raw)){
+    if(!free_record_queue_.Pop(&records))
+      break;
+    // split the batch instead of parsing batches concurrently, which would
+    // reorder them
+    auto parse=[raw, records](int begin, int end){
+      for(int i=begin;i<end;i++)
+        records->at(i).ParseFromString(raw->at(i));
+    };
+    if(decode_pool_)
+      decode_pool_->ParallelFor(raw->size(), parse);
+    else
+      parse(0, raw->size());
+    free_raw_queue_.Push(raw);
+    if(!record_queue_.Push(records))
+      break;
   }
 }
 
 void ShardDataLayer::Setup(const LayerProto& proto,
     const vector<SLayer>& srclayers){
-  shard_= std::make_shared<shard::Shard>(proto.data_param().path(),
-      shard::Shard::kRead);
+  const string& path=proto.data_param().path();
+  struct stat sb;
+  if(stat(path.c_str(), &sb)==0&&S_ISREG(sb.st_mode)){
+    // manifest of multiple shards, every group reads its own partition
+    auto dataset=std::make_shared<shard::Dataset>(path);
+    auto cluster=Cluster::Get();
+    if(cluster!=nullptr)
+      dataset->SetPartition(cluster->groupid(), cluster->ngroups());
+    shard_=dataset;
+  }else{
+    shard_= std::make_shared<shard::Shard>(path, shard::Shard::kMmap);
+  }
   string key;
   shard_->Next(&key, &sample_);
   batchsize_=proto.data_param().batchsize();
 
-  records_.resize(batchsize_);
+  SingleLabelImageRecord* image=sample_.mutable_image();
+  encoded_=image->encoded();
+  if(encoded_){
+    // all images are decoded (and resized) to the shape of the sample, which
+    // is the recorded shape or the shape of the decoded sample
+    vector<int> shape(image->shape().begin(), image->shape().end());
+    if(shape.size()!=3)
+      shape=ImageDecoder::Shape(image->pixel().data(), image->pixel().size());
+    decoder_.Setup(shape, batchsize_, proto.data_param().decode_threads());
+    string pixel(shape[0]*shape[1]*shape[2], 0);
+    decoder_.DecodeImage(image->pixel().data(), image->pixel().size(),
+        reinterpret_cast<uint8_t*>(&pixel[0]));
+    image->clear_shape();
+    for(int x: shape)
+      image->add_shape(x);
+    image->set_pixel(pixel);
+    image->set_encoded(false);
+  }
+  size_t dim=image->shape_size()?1:0;
+  for(int x: image->shape())
+    dim*=x;
+  dense_=encoded_
+    ||(proto.data_param().dense()&&dim>0&&image->pixel().size()==dim);
+  if(dense_){
+    batch_.shape=vector<int>(image->shape().begin(), image->shape().end());
+    batch_.is_float=false;
+    batch_.tensors.resize(batchsize_*dim);
+    batch_.labels.resize(batchsize_);
+  }else{
+    records_.resize(batchsize_);
+  }
   random_skip_=proto.data_param().random_skip();
+  int blocksize=proto.data_param().shuffle_blocksize();
+  if(blocksize>0){
+    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+    shuffle_=std::make_shared<shard::ShuffleReader>(shard_.get(), blocksize,
+        proto.data_param().shuffle_window(), seed);
+    // the order is already random
+    random_skip_=0;
+  }
+
+  // records are read ahead by the reader thread and parsed by the decode
+  // thread with decode_pool_, while copying pixels of dense batches is cheap enough for the
+  // thread of ComputeFeature; encoded images are decoded by the threads of
+  // decoder_ instead
+  int nthreads=proto.data_param().decode_threads();
+  if(nthreads>0&&!encoded_){
+    CHECK(threads_.empty())<<"Decode threads of "<<name()<<" are running";
+    // all batches circulate between the queues, hence Push never blocks
+    int depth=proto.data_param().queue_depth();
+    CHECK_GT(depth, 0);
+    raw_batches_.resize(depth, vector<string>(batchsize_));
+    for(auto* queue: {&raw_queue_, &free_raw_queue_})
+      queue->set_capacity(depth);
+    for(int i=0;i<depth;i++)
+      free_raw_queue_.Push(&raw_batches_[i]);
+    if(!dense_){
+      record_batches_.resize(depth, vector<Record>(batchsize_));
+      for(auto* queue: {&record_queue_, &free_record_queue_})
+        queue->set_capacity(depth);
+      for(int i=0;i<depth;i++)
+        free_record_queue_.Push(&record_batches_[i]);
+    }
+    threads_.push_back(std::thread(&ShardDataLayer::ReadBatches, this));
+    if(!dense_){
+      decode_pool_.reset(nthreads>1?new ThreadPool(nthreads-1):nullptr);
+      threads_.push_back(std::thread(&ShardDataLayer::DecodeBatches, this));
+    }
+  }
 }
 /*******************Implementation of TanLayer***************************/
 void TanhLayer::Setup(const LayerProto& proto,
@@ -763,4 +1510,32 @@ void SoftmaxLossLayer::ComputeGradient(const vector<SLayer>& srclayers) {
   gsrc*=scale_/(1.0f*batchsize_);
 }
 
+/***************Implementation for TensorDataLayer*************************/
+void TensorDataLayer::ComputeFeature(bool training, const vector<SLayer>& srclayers){
+  pos_=shard_->Read(pos_, batchsize_, batch_.tensors.data(),
+      batch_.labels.data());
+}
+
+void TensorDataLayer::Setup(const LayerProto& proto,
+    const vector<SLayer>& srclayers){
+  const string& path=proto.data_param().path();
+  shard_=std::make_shared<shard::TensorShard>(path, shard::TensorShard::kRead);
+  int count=shard_->Count();
+  CHECK_GT(count, 0)<<"Empty tensor shard "<<path;
+  batchsize_=proto.data_param().batchsize();
+  random_skip_=proto.data_param().random_skip();
+  pos_=random_skip_?rand()%random_skip_%count:0;
+  LOG(INFO)<<"Random Skip "<<pos_<<" records, there are "<<count
+    <<" records in total";
+  batch_.shape=shard_->shape();
+  batch_.is_float=shard_->dtype()==shard::TensorShard::kFloat;
+  batch_.tensors.resize(batchsize_*shard_->record_size());
+  batch_.labels.resize(batchsize_);
+  // parser layers get the image shape from the sample
+  sample_.Clear();
+  for(int x: shard_->shape())
+    sample_.mutable_image()->add_shape(x);
+  sample_.mutable_image()->set_label(shard_->label(0));
+}
+
 }  // namespace singa
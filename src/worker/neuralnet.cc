@@ -30,6 +30,7 @@ void NeuralNet::RegistryLayers(){
   factory->Register("kSoftmaxLoss", CreateLayer(SoftmaxLossLayer));
   factory->Register("kSplit", CreateLayer(SplitLayer));
   factory->Register("kTanh", CreateLayer(TanhLayer));
+  factory->Register("kTensorData", CreateLayer(TensorDataLayer));
 }
 
 void NeuralNet::RegistryParam(string param_type){
@@ -44,6 +45,8 @@ void NeuralNet::RegistryParam(string param_type){
 }
 NeuralNet::NeuralNet(NetProto net_proto, int group_size) {
   group_size_=group_size;
+  // create the intra-op pool before any layer computes
+  Layer::intra_op_pool();
   for(int i=0;i<net_proto.layer_size();i++){
     LayerProto * layer_proto=net_proto.mutable_layer(i);
     if(!layer_proto->has_partition_type())
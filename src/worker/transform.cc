@@ -0,0 +1,160 @@
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include "worker/transform.h"
+#include "utils/cluster.h"
+#include "utils/common.h"
+#include "utils/factory.h"
+#include "utils/singleton.h"
+
+namespace singa {
+
+Transform* Transform::Create(const string& type){
+  static std::once_flag flag;
+  std::call_once(flag, [](){
+      auto* factory=Singleton<Factory<Transform>>::Instance();
+      factory->Register("kCrop", CreateInstance(CropTransform, Transform));
+      factory->Register("kFlip", CreateInstance(FlipTransform, Transform));
+      factory->Register("kColorJitter",
+        CreateInstance(ColorJitterTransform, Transform));
+      factory->Register("kNormalize",
+        CreateInstance(NormalizeTransform, Transform));
+    });
+  return Singleton<Factory<Transform>>::Instance()->Create(type);
+}
+
+ThreadPool* Transform::pool(){
+  static std::unique_ptr<ThreadPool> pool;
+  static std::once_flag flag;
+  std::call_once(flag, [](){
+      auto cluster=Cluster::Get();
+      if(cluster!=nullptr&&cluster->naugment_threads()>0)
+        pool.reset(new ThreadPool(cluster->naugment_threads()));
+    });
+  return pool.get();
+}
+
+/***************************CropTransform**********************************/
+void CropTransform::Setup(const TransformProto& proto,
+    const vector<int>& shape){
+  Transform::Setup(proto, shape);
+  int cropsize=proto.cropsize();
+  CHECK_GT(cropsize, 0);
+  CHECK_LE(cropsize, shape[1]);
+  CHECK_LE(cropsize, shape[2]);
+  shape_[1]=shape_[2]=cropsize;
+}
+
+void CropTransform::Sample(bool training, int n){
+  hoffs_.resize(n);
+  woffs_.resize(n);
+  int hspace=srcshape_[1]-shape_[1], wspace=srcshape_[2]-shape_[2];
+  for(int rid=0;rid<n;rid++){
+    hoffs_[rid]=training?rand()%(hspace+1):hspace/2;
+    woffs_[rid]=training?rand()%(wspace+1):wspace/2;
+  }
+}
+
+void CropTransform::Apply(int rid, const float* src, float* dst) const {
+  int height=shape_[1], width=shape_[2];
+  for(int c=0;c<shape_[0];c++)
+    for(int y=0;y<height;y++)
+      memcpy(dst+(c*height+y)*width,
+          src+(c*srcshape_[1]+hoffs_[rid]+y)*srcshape_[2]+woffs_[rid],
+          sizeof(float)*width);
+}
+
+/***************************FlipTransform**********************************/
+void FlipTransform::Setup(const TransformProto& proto,
+    const vector<int>& shape){
+  Transform::Setup(proto, shape);
+  prob_=proto.flip_prob();
+}
+
+void FlipTransform::Sample(bool training, int n){
+  flips_.resize(n);
+  for(int rid=0;rid<n;rid++)
+    flips_[rid]=training&&rand_real()<prob_;
+}
+
+void FlipTransform::Apply(int rid, const float* src, float* dst) const {
+  int nrows=shape_[0]*shape_[1], width=shape_[2];
+  if(!flips_[rid]){
+    memcpy(dst, src, sizeof(float)*nrows*width);
+    return;
+  }
+  for(int r=0;r<nrows;r++)
+    std::reverse_copy(src+r*width, src+(r+1)*width, dst+r*width);
+}
+
+/***************************ColorJitterTransform***************************/
+void ColorJitterTransform::Setup(const TransformProto& proto,
+    const vector<int>& shape){
+  Transform::Setup(proto, shape);
+  brightness_=proto.brightness();
+  contrast_=proto.contrast();
+  saturation_=proto.saturation();
+  CHECK(saturation_==0||shape[0]==3)<<"Saturation applies to RGB images";
+}
+
+void ColorJitterTransform::Sample(bool training, int n){
+  factors_.resize(3*n);
+  for(int rid=0;rid<n;rid++){
+    float* f=factors_.data()+3*rid;
+    f[0]=training?1+(rand_real()*2-1)*brightness_:1;
+    f[1]=training?1+(rand_real()*2-1)*contrast_:1;
+    f[2]=training?1+(rand_real()*2-1)*saturation_:1;
+  }
+}
+
+void ColorJitterTransform::Apply(int rid, const float* src, float* dst) const {
+  const float* f=factors_.data()+3*rid;
+  int hw=shape_[1]*shape_[2], n=shape_[0]*hw;
+  for(int i=0;i<n;i++)
+    dst[i]=src[i]*f[0];
+  if(f[1]!=1){
+    // scale the deviation from the mean intensity
+    float mean=0;
+    for(int i=0;i<n;i++)
+      mean+=dst[i];
+    mean/=n;
+    for(int i=0;i<n;i++)
+      dst[i]=mean+(dst[i]-mean)*f[1];
+  }
+  if(f[2]!=1){
+    // scale the deviation from the gray image
+    float* r=dst, *g=dst+hw, *b=dst+2*hw;
+    for(int i=0;i<hw;i++){
+      float gray=0.299f*r[i]+0.587f*g[i]+0.114f*b[i];
+      r[i]=gray+(r[i]-gray)*f[2];
+      g[i]=gray+(g[i]-gray)*f[2];
+      b[i]=gray+(b[i]-gray)*f[2];
+    }
+  }
+}
+
+/***************************NormalizeTransform*****************************/
+void NormalizeTransform::Setup(const TransformProto& proto,
+    const vector<int>& shape){
+  Transform::Setup(proto, shape);
+  int channels=shape[0];
+  CHECK(proto.mean_size()<=1||proto.mean_size()==channels);
+  CHECK(proto.std_size()<=1||proto.std_size()==channels);
+  mean_.resize(channels);
+  scale_.resize(channels);
+  for(int c=0;c<channels;c++){
+    mean_[c]=proto.mean_size()?proto.mean(proto.mean_size()>1?c:0):0;
+    float std=proto.std_size()?proto.std(proto.std_size()>1?c:0):1;
+    CHECK_GT(std, 0);
+    scale_[c]=1.0f/std;
+  }
+}
+
+void NormalizeTransform::Apply(int rid, const float* src, float* dst) const {
+  int hw=shape_[1]*shape_[2];
+  for(int c=0;c<shape_[0];c++)
+    for(int i=0;i<hw;i++)
+      dst[c*hw+i]=(src[c*hw+i]-mean_[c])*scale_[c];
+}
+} /* singa */
@@ -0,0 +1,338 @@
+#include <glog/logging.h>
+#include <algorithm>
+#include "mshadow/tensor.h"
+#include "worker/winograd.h"
+#include "worker/base_layer.h"
+
+using namespace mshadow;
+using namespace mshadow::expr;
+
+namespace singa {
+/**
+ * 1D transforms of F(m,3), each maps vector x of stride xs to y of stride ys:
+ * Input: y=B^T*x, Output: y=A^T*x, Filter: y=G*x, Grad: y=A*x (the output
+ * gradient of m pixels to alpha), FilterGrad: y=G^T*x (to 3 filter weights).
+ * Matrices are from Lavin and Gray; the 2D transform of a tile is the 1D
+ * transform of its columns then of its rows.
+ */
+template<int M> struct Tile;
+
+template<> struct Tile<2> {
+  static const int kAlpha=4;
+  static inline void Input(const float* x, int xs, float* y, int ys){
+    y[0]=x[0]-x[2*xs];
+    y[ys]=x[xs]+x[2*xs];
+    y[2*ys]=x[2*xs]-x[xs];
+    y[3*ys]=x[xs]-x[3*xs];
+  }
+  static inline void Output(const float* x, int xs, float* y, int ys){
+    y[0]=x[0]+x[xs]+x[2*xs];
+    y[ys]=x[xs]-x[2*xs]-x[3*xs];
+  }
+  static inline void Filter(const float* x, int xs, float* y, int ys){
+    y[0]=x[0];
+    y[ys]=0.5f*(x[0]+x[xs]+x[2*xs]);
+    y[2*ys]=0.5f*(x[0]-x[xs]+x[2*xs]);
+    y[3*ys]=x[2*xs];
+  }
+  static inline void Grad(const float* x, int xs, float* y, int ys){
+    y[0]=x[0];
+    y[ys]=x[0]+x[xs];
+    y[2*ys]=x[0]-x[xs];
+    y[3*ys]=-x[xs];
+  }
+  static inline void FilterGrad(const float* x, int xs, float* y, int ys){
+    y[0]=x[0]+0.5f*(x[xs]+x[2*xs]);
+    y[ys]=0.5f*(x[xs]-x[2*xs]);
+    y[2*ys]=0.5f*(x[xs]+x[2*xs])+x[3*xs];
+  }
+};
+
+template<> struct Tile<4> {
+  static const int kAlpha=6;
+  static inline void Input(const float* x, int xs, float* y, int ys){
+    float x0=x[0], x1=x[xs], x2=x[2*xs], x3=x[3*xs], x4=x[4*xs], x5=x[5*xs];
+    y[0]=4*x0-5*x2+x4;
+    y[ys]=-4*(x1+x2)+x3+x4;
+    y[2*ys]=4*(x1-x2)-x3+x4;
+    y[3*ys]=2*(x3-x1)-x2+x4;
+    y[4*ys]=2*(x1-x3)-x2+x4;
+    y[5*ys]=4*x1-5*x3+x5;
+  }
+  static inline void Output(const float* x, int xs, float* y, int ys){
+    float x0=x[0], x1=x[xs], x2=x[2*xs], x3=x[3*xs], x4=x[4*xs], x5=x[5*xs];
+    float a=x1+x2, b=x1-x2, c=x3+x4, d=x3-x4;
+    y[0]=x0+a+c;
+    y[ys]=b+2*d;
+    y[2*ys]=a+4*c;
+    y[3*ys]=b+8*d+x5;
+  }
+  static inline void Filter(const float* x, int xs, float* y, int ys){
+    float x0=x[0], x1=x[xs], x2=x[2*xs];
+    y[0]=0.25f*x0;
+    y[ys]=-(x0+x1+x2)/6;
+    y[2*ys]=-(x0-x1+x2)/6;
+    y[3*ys]=x0/24+x1/12+x2/6;
+    y[4*ys]=x0/24-x1/12+x2/6;
+    y[5*ys]=x2;
+  }
+  static inline void Grad(const float* x, int xs, float* y, int ys){
+    float x0=x[0], x1=x[xs], x2=x[2*xs], x3=x[3*xs];
+    y[0]=x0;
+    y[ys]=x0+x1+x2+x3;
+    y[2*ys]=x0-x1+x2-x3;
+    y[3*ys]=x0+2*x1+4*x2+8*x3;
+    y[4*ys]=x0-2*x1+4*x2-8*x3;
+    y[5*ys]=x3;
+  }
+  static inline void FilterGrad(const float* x, int xs, float* y, int ys){
+    float x0=x[0], x1=x[xs], x2=x[2*xs], x3=x[3*xs], x4=x[4*xs], x5=x[5*xs];
+    y[0]=0.25f*x0-(x1+x2)/6+(x3+x4)/24;
+    y[ys]=(x2-x1)/6+(x3-x4)/12;
+    y[2*ys]=(x3+x4-x1-x2)/6+x5;
+  }
+};
+
+/**
+ * y=L*x*L^T for the {out, in} matrix L of the 1D transform op, x is {in, in}
+ * and y is {out, out}.
+ */
+template<int in, int out, typename Op>
+inline void Transform2D(Op op, const float* x, float* y){
+  float tmp[out*in];
+  for(int j=0;j<in;j++)
+    op(x+j, in, tmp+j, in);
+  for(int i=0;i<out;i++)
+    op(tmp+i*in, 1, y+i*out, 1);
+}
+
+template<int M> inline void InputTile(const float* x, float* y){
+  const int a=Tile<M>::kAlpha;
+  Transform2D<a, a>(Tile<M>::Input, x, y);
+}
+template<int M> inline void OutputTile(const float* x, float* y){
+  Transform2D<Tile<M>::kAlpha, M>(Tile<M>::Output, x, y);
+}
+template<int M> inline void FilterTile(const float* x, float* y){
+  Transform2D<3, Tile<M>::kAlpha>(Tile<M>::Filter, x, y);
+}
+template<int M> inline void GradTile(const float* x, float* y){
+  Transform2D<M, Tile<M>::kAlpha>(Tile<M>::Grad, x, y);
+}
+template<int M> inline void FilterGradTile(const float* x, float* y){
+  Transform2D<Tile<M>::kAlpha, 3>(Tile<M>::FilterGrad, x, y);
+}
+//!< max tile size, i.e., alpha of F(4x4,3x3)
+const int kMaxAlpha=6;
+
+Winograd::Geometry Winograd::MakeGeometry(int channels, int height, int width,
+    int pad, int filters) const {
+  Geometry geo;
+  geo.channels=channels;
+  geo.height=height;
+  geo.width=width;
+  geo.pad=pad;
+  geo.filters=filters;
+  geo.oheight=height+2*pad-2;
+  geo.owidth=width+2*pad-2;
+  CHECK_GT(geo.oheight, 0);
+  CHECK_GT(geo.owidth, 0);
+  geo.tiles_h=(geo.oheight+m_-1)/m_;
+  geo.tiles_w=(geo.owidth+m_-1)/m_;
+  return geo;
+}
+
+Winograd::Winograd(int m): m_(m), alpha_(m+2){
+  CHECK(m==2||m==4)<<"Winograd tile size must be 2 or 4";
+}
+
+bool Winograd::Setup(const ConvShape& shape, const ConvolutionProto& proto){
+  if(shape.kernel!=3||shape.stride!=1)
+    return false;
+  int channels=shape.channels, num_filters=shape.num_filters;
+  batchsize_=shape.batchsize;
+  forward_=MakeGeometry(channels, shape.height, shape.width, shape.pad,
+      num_filters);
+  // the gradient of the input is the convolution of the output gradient with
+  // flipped filters, padded by 2-pad to get the input size back
+  backward_=MakeGeometry(num_filters, forward_.oheight, forward_.owidth,
+      2-shape.pad, channels);
+  int tiles=std::max(forward_.tiles(), backward_.tiles());
+  int64_t imgsize=static_cast<int64_t>(alpha_)*alpha_*(channels+num_filters)
+    *tiles*sizeof(float);
+  group_=std::max(1, static_cast<int>(std::min<int64_t>(batchsize_,
+          (static_cast<int64_t>(proto.col_buffer_mb())<<20)/imgsize)));
+  int area=alpha_*alpha_;
+  int maxsize=std::max(channels, num_filters)*group_*tiles;
+  filters_.Reshape(vector<int>{area, num_filters, channels});
+  gfilters_.Reshape(vector<int>{area, num_filters, channels});
+  tiles_.Reshape(vector<int>{area, maxsize});
+  products_.Reshape(vector<int>{area, maxsize});
+  return true;
+}
+
+void Winograd::TransformFilters(const Geometry& geo, const float* weight,
+    bool flip, float* u) const {
+  int area=alpha_*alpha_;
+  IntraOpFor(geo.filters*geo.channels, [&](int begin, int end){
+      float g[9], out[kMaxAlpha*kMaxAlpha];
+      for(int i=begin;i<end;i++){
+        int f=i/geo.channels, c=i%geo.channels;
+        for(int k=0;k<9;k++){
+          g[k]=flip?weight[(c*geo.filters+f)*9+8-k]
+            :weight[(f*geo.channels+c)*9+k];
+        }
+        m_==2?FilterTile<2>(g, out):FilterTile<4>(g, out);
+        for(int k=0;k<area;k++)
+          u[(k*geo.filters+f)*geo.channels+c]=out[k];
+      }
+    });
+}
+
+void Winograd::TransformInput(const Geometry& geo, const float* src, int g,
+    float* v) const {
+  int area=alpha_*alpha_, ntiles=g*geo.tiles();
+  IntraOpFor(g*geo.channels, [&](int begin, int end){
+      float d[kMaxAlpha*kMaxAlpha], out[kMaxAlpha*kMaxAlpha];
+      for(int i=begin;i<end;i++){
+        int n=i/geo.channels, c=i%geo.channels;
+        const float* img=src+static_cast<size_t>(i)*geo.height*geo.width;
+        for(int ty=0;ty<geo.tiles_h;ty++){
+          for(int tx=0;tx<geo.tiles_w;tx++){
+            int y0=ty*m_-geo.pad, x0=tx*m_-geo.pad;
+            for(int y=0;y<alpha_;y++){
+              int h=y0+y;
+              for(int x=0;x<alpha_;x++){
+                int w=x0+x;
+                d[y*alpha_+x]=h>=0&&h<geo.height&&w>=0&&w<geo.width?
+                  img[h*geo.width+w]:0.f;
+              }
+            }
+            m_==2?InputTile<2>(d, out):InputTile<4>(d, out);
+            int p=(n*geo.tiles_h+ty)*geo.tiles_w+tx;
+            for(int k=0;k<area;k++)
+              v[(static_cast<size_t>(k)*geo.channels+c)*ntiles+p]=out[k];
+          }
+        }
+      }
+    });
+}
+
+void Winograd::TransformOutput(const Geometry& geo, const float* m, int g,
+    float* dst) const {
+  int area=alpha_*alpha_, ntiles=g*geo.tiles();
+  IntraOpFor(g*geo.filters, [&](int begin, int end){
+      float x[kMaxAlpha*kMaxAlpha], y[kMaxAlpha*kMaxAlpha];
+      for(int i=begin;i<end;i++){
+        int n=i/geo.filters, f=i%geo.filters;
+        float* img=dst+static_cast<size_t>(i)*geo.oheight*geo.owidth;
+        for(int ty=0;ty<geo.tiles_h;ty++){
+          for(int tx=0;tx<geo.tiles_w;tx++){
+            int p=(n*geo.tiles_h+ty)*geo.tiles_w+tx;
+            for(int k=0;k<area;k++)
+              x[k]=m[(static_cast<size_t>(k)*geo.filters+f)*ntiles+p];
+            m_==2?OutputTile<2>(x, y):OutputTile<4>(x, y);
+            int hend=std::min(m_, geo.oheight-ty*m_);
+            int wend=std::min(m_, geo.owidth-tx*m_);
+            for(int h=0;h<hend;h++)
+              for(int w=0;w<wend;w++)
+                img[(ty*m_+h)*geo.owidth+tx*m_+w]=y[h*m_+w];
+          }
+        }
+      }
+    });
+}
+
+void Winograd::TransformGrad(const Geometry& geo, const float* grad, int g,
+    float* e) const {
+  int area=alpha_*alpha_, ntiles=g*geo.tiles();
+  IntraOpFor(g*geo.filters, [&](int begin, int end){
+      float x[kMaxAlpha*kMaxAlpha], out[kMaxAlpha*kMaxAlpha];
+      for(int i=begin;i<end;i++){
+        int n=i/geo.filters, f=i%geo.filters;
+        const float* img=grad+static_cast<size_t>(i)*geo.oheight*geo.owidth;
+        for(int ty=0;ty<geo.tiles_h;ty++){
+          for(int tx=0;tx<geo.tiles_w;tx++){
+            for(int h=0;h<m_;h++){
+              for(int w=0;w<m_;w++){
+                int y=ty*m_+h, z=tx*m_+w;
+                x[h*m_+w]=y<geo.oheight&&z<geo.owidth?
+                  img[y*geo.owidth+z]:0.f;
+              }
+            }
+            m_==2?GradTile<2>(x, out):GradTile<4>(x, out);
+            int p=(n*geo.tiles_h+ty)*geo.tiles_w+tx;
+            for(int k=0;k<area;k++)
+              e[(static_cast<size_t>(k)*geo.filters+f)*ntiles+p]=out[k];
+          }
+        }
+      }
+    });
+}
+
+void Winograd::Convolve(const Geometry& geo, const float* u, const float* src,
+    float* dst){
+  int area=alpha_*alpha_;
+  int srcsize=geo.channels*geo.height*geo.width;
+  int dstsize=geo.filters*geo.oheight*geo.owidth;
+  for(int n=0;n<batchsize_;n+=group_){
+    int g=std::min(group_, batchsize_-n);
+    int ntiles=g*geo.tiles();
+    TransformInput(geo, src+static_cast<size_t>(n)*srcsize, g,
+        tiles_.mutable_cpu_data());
+    Tensor<cpu, 3> filters(const_cast<float*>(u),
+        Shape3(area, geo.filters, geo.channels));
+    Tensor<cpu, 3> tiles(tiles_.mutable_cpu_data(),
+        Shape3(area, geo.channels, ntiles));
+    Tensor<cpu, 3> products(products_.mutable_cpu_data(),
+        Shape3(area, geo.filters, ntiles));
+    for(int k=0;k<area;k++)
+      products[k]=dot(filters[k], tiles[k]);
+    TransformOutput(geo, products.dptr, g, dst+static_cast<size_t>(n)*dstsize);
+  }
+}
+
+void Winograd::Forward(const float* src, const float* weight, float* dst){
+  TransformFilters(forward_, weight, false, filters_.mutable_cpu_data());
+  Convolve(forward_, filters_.cpu_data(), src, dst);
+}
+
+void Winograd::Backward(const float* src, const float* weight,
+    const float* grad, float* gweight, float* gsrc){
+  const Geometry& geo=forward_;
+  int area=alpha_*alpha_;
+  int srcsize=geo.channels*geo.height*geo.width;
+  int gradsize=geo.filters*geo.oheight*geo.owidth;
+  Tensor<cpu, 3> gfilters(gfilters_.mutable_cpu_data(),
+      Shape3(area, geo.filters, geo.channels));
+  gfilters=0.0f;
+  for(int n=0;n<batchsize_;n+=group_){
+    int g=std::min(group_, batchsize_-n);
+    int ntiles=g*geo.tiles();
+    TransformInput(geo, src+static_cast<size_t>(n)*srcsize, g,
+        tiles_.mutable_cpu_data());
+    TransformGrad(geo, grad+static_cast<size_t>(n)*gradsize, g,
+        products_.mutable_cpu_data());
+    Tensor<cpu, 3> tiles(tiles_.mutable_cpu_data(),
+        Shape3(area, geo.channels, ntiles));
+    Tensor<cpu, 3> products(products_.mutable_cpu_data(),
+        Shape3(area, geo.filters, ntiles));
+    for(int k=0;k<area;k++)
+      gfilters[k]+=dot(products[k], tiles[k].T());
+  }
+  // gweight=G^T*gfilters*G per (filter, channel)
+  IntraOpFor(geo.filters*geo.channels, [&](int begin, int end){
+      float x[kMaxAlpha*kMaxAlpha];
+      for(int i=begin;i<end;i++){
+        for(int k=0;k<area;k++)
+          x[k]=gfilters.dptr[static_cast<size_t>(k)*geo.filters*geo.channels+i];
+        m_==2?FilterGradTile<2>(x, gweight+i*9)
+          :FilterGradTile<4>(x, gweight+i*9);
+      }
+    });
+  if(gsrc!=nullptr){
+    TransformFilters(backward_, weight, true, filters_.mutable_cpu_data());
+    Convolve(backward_, filters_.cpu_data(), grad, gsrc);
+  }
+}
+}  // namespace singa
@@ -13,15 +13,17 @@ Worker::Worker(shared_ptr<Cluster> cluster){
 
 void Worker::Start(ModelProto model){
   LOG(ERROR)<<"Worker on "<<cluster_->hostname()<<" is starting...";
-  train_net_=SetupNeuralNet(model.neuralnet(), model.prefetch(), kTrain);
+  train_net_=SetupNeuralNet(model.neuralnet(), model.prefetch(),
+      model.prefetch_depth(), kTrain);
   if(model.test_steps()){
-    test_net_=SetupNeuralNet(model.neuralnet(), model.prefetch(), kTest);
+    test_net_=SetupNeuralNet(model.neuralnet(), model.prefetch(),
+        model.prefetch_depth(), kTest);
     if(test_net_!=nullptr)
       test_net_->ShareWeights(train_net_);
   }
   if(model.validation_steps()){
     validation_net_=SetupNeuralNet(model.neuralnet(), model.prefetch(),
-        kValidation);
+        model.prefetch_depth(), kValidation);
     if(validation_net_!=nullptr)
       validation_net_->ShareWeights(train_net_);
   }
@@ -67,7 +69,7 @@ void Worker::Resume() {
 }
 
 shared_ptr<NeuralNet> Worker::SetupNeuralNet(const NetProto& np, bool prefetch,
-    Phase phase){
+    int prefetch_depth, Phase phase){
   NetProto proto;
   proto.set_partition_type(np.partition_type());
   // exclude layers if necessary
@@ -86,7 +88,7 @@ shared_ptr<NeuralNet> Worker::SetupNeuralNet(const NetProto& np, bool prefetch,
   shared_ptr<NeuralNet> net(new NeuralNet(proto));
   // set prefetch
   for(auto& layer: net->parserlayers()){
-    layer->set_prefetch(prefetch);
+    layer->set_prefetch(prefetch, prefetch_depth);
   }
   for(auto& layer: net->datalayers()){
     layer->set_prefetch(prefetch);
@@ -129,9 +131,10 @@ void Executor::Setup(int local_threadid, const ModelProto& model){
       if(cluster_->group_threadid(local_threadid_)==layer->locationid())
         localDataLayers_.push_back(layer);
     }
+    // one long-lived thread keeps the ring of every parser layer filled
     if(localDataLayers_.size())
       prefetch_thread_=std::thread(Executor::PrefetchData,
-          std::ref(localDataLayers_), true,1);
+          std::ref(localDataLayers_), true, 0);
   }
   int gthreadid=cluster_->group_threadid(local_threadid);
 
@@ -156,21 +159,26 @@ void Executor::Setup(int local_threadid, const ModelProto& model){
 }
 
 Executor::~Executor(){
-  if(prefetch_thread_.joinable())
+  if(prefetch_thread_.joinable()){
+    for(auto* layer: localDataLayers_)
+      for(auto& dstlayer: layer->dstlayers())
+        static_cast<ParserLayer*>(dstlayer.get())->StopPrefetching();
     prefetch_thread_.join();
+  }
 }
 
 void Executor::PrefetchData(const vector<DataLayer*>& datalayers, bool training,
     int steps){
   if(datalayers.size()==0)
     return;
-  for(int i=0;i<steps;i++){
+  for(int i=0;steps<=0||i<steps;i++){
     for(auto& layer: datalayers){
       layer->Prefetching(training);
       for(auto& dstlayer: layer->dstlayers()){
         CHECK(dstlayer->is_parserlayer());
         auto parserlayer=static_cast<ParserLayer*>(dstlayer.get());
-        parserlayer->Prefetching(training);
+        if(!parserlayer->Prefetching(training))
+          return;
       }
     }
   }
@@ -303,11 +311,6 @@ void Executor::Backward(shared_ptr<NeuralNet> net, int step){
 
 void Executor::TrainOneBatch(int step){
   int64_t tick=zclock_mono();
-  if(prefetch_thread_.joinable()){
-      prefetch_thread_.join();
-      prefetch_thread_=std::thread(Executor::PrefetchData,
-          std::ref(localDataLayers_), true,1);
-  }
   Forward(train_net_, step, true);
   tForward_+=zclock_mono()-tick;
   tick=zclock_mono();
@@ -327,16 +330,10 @@ void Executor::Test(shared_ptr<NeuralNet> net, int nsteps, bool disperf){
     }
     if(localDataLayers.size())
       prefetch=std::thread(Executor::PrefetchData,  std::ref(localDataLayers),
-          false,1);
+          false, nsteps);
   }
   Performance perf(net);
   for(int b=0;b<nsteps;b++){
-    if(prefetch.joinable()){
-      prefetch.join();
-      if(b<nsteps-1)
-        prefetch=std::thread(Executor::PrefetchData, std::ref(localDataLayers),
-          false,1);
-    }
     Forward(net, b, false);
     if(disperf)
       perf.Update();
@@ -0,0 +1,294 @@
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include <lmdb.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "proto/model.pb.h"
+#include "utils/shard.h"
+#include "utils/tensor_shard.h"
+#include "worker/layer.h"
+
+/**
+ * \file bench_io.cc benchmarks the data path on synthetic data, i.e., reading
+ * shards and lmdb, parsing Records and parsing batches by parser layers.
+ *
+ * The report has one metric per line, "<name> <value> <unit>", in a fixed
+ * order; lines starting with # are comments. Reports of different commits
+ * can be diffed directly. Every value is the median of repeats runs after a
+ * warm-up run, i.e., the data is mostly in the page cache.
+ */
+
+DEFINE_string(folder, "/tmp/bench_io", "folder for the synthetic data");
+DEFINE_int32(records, 20000, "num of synthetic records");
+DEFINE_int32(channels, 3, "channels of synthetic images");
+DEFINE_int32(height, 32, "height of synthetic images");
+DEFINE_int32(width, 32, "width of synthetic images");
+DEFINE_int32(batchsize, 64, "batchsize of data and parser layers");
+DEFINE_int32(repeats, 5, "num of runs of every benchmark");
+DEFINE_string(benchmarks, "shard,lmdb,proto,parser,tensor",
+    "comma separated benchmarks to run");
+
+using namespace singa;
+
+/**
+ * @return true if the benchmark is in FLAGS_benchmarks
+ */
+bool Enabled(const string& name){
+  std::stringstream ss(FLAGS_benchmarks);
+  string item;
+  while(std::getline(ss, item, ','))
+    if(item==name)
+      return true;
+  return false;
+}
+
+void Report(const string& name, double value, const string& unit){
+  printf("%s %.3f %s\n", name.c_str(), value, unit.c_str());
+  fflush(stdout);
+}
+
+/**
+ * Run func once for warm-up and then repeats times.
+ * @return median seconds of the runs
+ */
+double Median(std::function<void()> func){
+  func();
+  vector<double> secs;
+  for(int i=0;i<FLAGS_repeats;i++){
+    auto start=std::chrono::steady_clock::now();
+    func();
+    std::chrono::duration<double> d=std::chrono::steady_clock::now()-start;
+    secs.push_back(d.count());
+  }
+  std::sort(secs.begin(), secs.end());
+  return secs[secs.size()/2];
+}
+
+/**
+ * Synthetic image with smooth pixels plus noise and a random label; the
+ * random generator is seeded, hence the data is the same for every run.
+ */
+void RandomImage(std::mt19937* rng, string* pixel, int* label){
+  pixel->resize(FLAGS_channels*FLAGS_height*FLAGS_width);
+  int k=0;
+  for(int c=0;c<FLAGS_channels;c++)
+    for(int h=0;h<FLAGS_height;h++)
+      for(int w=0;w<FLAGS_width;w++)
+        (*pixel)[k++]=static_cast<char>(c*80+h*3+w*2+(*rng)()%16);
+  *label=(*rng)()%10;
+}
+
+void CreateData(){
+  mkdir(FLAGS_folder.c_str(), S_IRWXU);
+  vector<string> folders{"shard", "shard_lz", "tensor", "lmdb"};
+  for(auto& folder: folders)
+    mkdir((FLAGS_folder+"/"+folder).c_str(), S_IRWXU);
+  shard::Shard raw(FLAGS_folder+"/shard", shard::Shard::kCreate);
+  shard::Shard lz(FLAGS_folder+"/shard_lz", shard::Shard::kCreate, 104857600,
+      "lz");
+  shard::TensorShard tensor(FLAGS_folder+"/tensor",
+      shard::TensorShard::kCreate, shard::TensorShard::kUInt8,
+      vector<int>{FLAGS_channels, FLAGS_height, FLAGS_width});
+
+  MDB_env* env;
+  MDB_txn* txn;
+  MDB_dbi dbi;
+  string lmdb=FLAGS_folder+"/lmdb";
+  remove((lmdb+"/data.mdb").c_str());
+  remove((lmdb+"/lock.mdb").c_str());
+  CHECK_EQ(mdb_env_create(&env), MDB_SUCCESS);
+  CHECK_EQ(mdb_env_set_mapsize(env, 1099511627776), MDB_SUCCESS);
+  CHECK_EQ(mdb_env_open(env, lmdb.c_str(), 0, 0664), MDB_SUCCESS)
+    <<"cannot open lmdb "<<lmdb;
+  CHECK_EQ(mdb_txn_begin(env, NULL, 0, &txn), MDB_SUCCESS);
+  CHECK_EQ(mdb_open(txn, NULL, 0, &dbi), MDB_SUCCESS);
+
+  std::mt19937 rng(0);
+  char key[16];
+  string val;
+  for(int i=0;i<FLAGS_records;i++){
+    snprintf(key, sizeof(key), "%08d", i);
+    Record record;
+    SingleLabelImageRecord* image=record.mutable_image();
+    int label;
+    RandomImage(&rng, image->mutable_pixel(), &label);
+    image->set_label(label);
+    for(int x: {FLAGS_channels, FLAGS_height, FLAGS_width})
+      image->add_shape(x);
+    raw.Insert(key, record);
+    lz.Insert(key, record);
+    tensor.Insert(image->pixel().data(), label);
+
+    Datum datum;
+    datum.set_channels(FLAGS_channels);
+    datum.set_height(FLAGS_height);
+    datum.set_width(FLAGS_width);
+    datum.set_data(image->pixel());
+    datum.set_label(label);
+    datum.SerializeToString(&val);
+    MDB_val mdb_key, mdb_val;
+    mdb_key.mv_size=strlen(key);
+    mdb_key.mv_data=key;
+    mdb_val.mv_size=val.size();
+    mdb_val.mv_data=&val[0];
+    CHECK_EQ(mdb_put(txn, dbi, &mdb_key, &mdb_val, 0), MDB_SUCCESS);
+  }
+  raw.Flush();
+  lz.Flush();
+  tensor.Flush();
+  CHECK_EQ(mdb_txn_commit(txn), MDB_SUCCESS);
+  mdb_env_close(env);
+}
+
+/**
+ * Sequential Shard::Next over the whole shard, including opening the shard.
+ */
+void BenchShard(const string& name, const string& folder, char mode){
+  size_t bytes=0;
+  int n=0;
+  double sec=Median([&](){
+      shard::Shard shard(folder, mode);
+      string key;
+      const char* val;
+      int vallen;
+      bytes=0;
+      n=0;
+      while(shard.Next(&key, &val, &vallen)){
+        bytes+=key.size()+vallen;
+        n++;
+      }
+    });
+  CHECK_EQ(n, FLAGS_records);
+  Report(name+".throughput", bytes/sec/1e6, "MB/s");
+  Report(name+".rate", n/sec, "records/s");
+}
+
+LayerProto DataLayerProto(const string& folder){
+  LayerProto proto;
+  proto.set_name("data");
+  proto.mutable_data_param()->set_path(FLAGS_folder+"/"+folder);
+  proto.mutable_data_param()->set_batchsize(FLAGS_batchsize);
+  return proto;
+}
+
+/**
+ * ComputeFeature of the data layer for records/batchsize batches.
+ */
+void BenchDataLayer(const string& name, DataLayer* layer){
+  int nbatches=FLAGS_records/FLAGS_batchsize;
+  vector<SLayer> srclayers;
+  double sec=Median([&](){
+      for(int i=0;i<nbatches;i++)
+        layer->ComputeFeature(false, srclayers);
+    });
+  Report(name+".rate", nbatches*FLAGS_batchsize/sec, "records/s");
+}
+
+void BenchProto(){
+  shard::Shard shard(FLAGS_folder+"/shard", shard::Shard::kRead);
+  vector<string> vals;
+  string key, val;
+  while(shard.Next(&key, &val))
+    vals.push_back(val);
+  double sec=Median([&](){
+      Record record;
+      for(const auto& v: vals)
+        record.ParseFromString(v);
+    });
+  Report("proto_parse.cost", sec/vals.size()*1e6, "us/record");
+}
+
+/**
+ * Parse one batch of the data layer repeatedly.
+ */
+void BenchParser(const string& name, ParserLayer* parser,
+    const shared_ptr<DataLayer>& data, bool training){
+  int nbatches=FLAGS_records/FLAGS_batchsize;
+  double sec=Median([&](){
+      for(int i=0;i<nbatches;i++)
+        parser->ComputeFeature(training, vector<SLayer>{data});
+    });
+  Report(name+".cost", sec/nbatches*1e6, "us/batch");
+}
+
+/**
+ * Benchmark parser layers on batches from the data layer.
+ * @param prefix prefix of the metric names
+ */
+void BenchParsers(const string& prefix, const shared_ptr<DataLayer>& data){
+  data->ComputeFeature(false, vector<SLayer>{});
+  LayerProto proto;
+  proto.set_name("parser");
+  LabelLayer label;
+  label.Init(proto);
+  label.Setup(proto, vector<SLayer>{data});
+  label.set_prefetch(false);
+  BenchParser(prefix+"_label", &label, data, false);
+
+  proto.mutable_rgbimage_param()->set_scale(1.0f/255);
+  RGBImageLayer rgb;
+  rgb.Init(proto);
+  rgb.Setup(proto, vector<SLayer>{data});
+  rgb.set_prefetch(false);
+  BenchParser(prefix+"_rgb", &rgb, data, false);
+
+  proto.mutable_rgbimage_param()->set_cropsize(FLAGS_height-4);
+  proto.mutable_rgbimage_param()->set_mirror(true);
+  RGBImageLayer crop;
+  crop.Init(proto);
+  crop.Setup(proto, vector<SLayer>{data});
+  crop.set_prefetch(false);
+  BenchParser(prefix+"_rgb_crop_mirror", &crop, data, true);
+}
+
+int main(int argc, char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  CHECK_GT(FLAGS_repeats, 0);
+  CHECK_GE(FLAGS_records, FLAGS_batchsize);
+  printf("# bench_io records=%d image=%dx%dx%d batchsize=%d repeats=%d\n",
+      FLAGS_records, FLAGS_channels, FLAGS_height, FLAGS_width,
+      FLAGS_batchsize, FLAGS_repeats);
+  CreateData();
+  if(Enabled("shard")){
+    BenchShard("shard_read", FLAGS_folder+"/shard", shard::Shard::kRead);
+    BenchShard("shard_mmap", FLAGS_folder+"/shard", shard::Shard::kMmap);
+    BenchShard("shard_lz_read", FLAGS_folder+"/shard_lz", shard::Shard::kRead);
+    BenchShard("shard_lz_mmap", FLAGS_folder+"/shard_lz", shard::Shard::kMmap);
+  }
+  if(Enabled("lmdb")){
+    LayerProto proto=DataLayerProto("lmdb");
+    LMDBDataLayer layer;
+    layer.Init(proto);
+    layer.Setup(proto, vector<SLayer>{});
+    BenchDataLayer("lmdb_data", &layer);
+  }
+  if(Enabled("proto"))
+    BenchProto();
+  if(Enabled("parser")){
+    LayerProto proto=DataLayerProto("shard");
+    auto layer=std::make_shared<ShardDataLayer>();
+    layer->Init(proto);
+    layer->Setup(proto, vector<SLayer>{});
+    BenchDataLayer("shard_data", layer.get());
+    BenchParsers("parser", layer);
+  }
+  if(Enabled("tensor")){
+    LayerProto proto=DataLayerProto("tensor");
+    auto layer=std::make_shared<TensorDataLayer>();
+    layer->Init(proto);
+    layer->Setup(proto, vector<SLayer>{});
+    BenchDataLayer("tensor_data", layer.get());
+    BenchParsers("dense_parser", layer);
+  }
+  return 0;
+}
@@ -1,36 +1,95 @@
 #include <glog/logging.h>
 #include <gflags/gflags.h>
-#include <mpi.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include "utils/shard.h"
+#include "utils/tensor_shard.h"
 #include "data_source.h"
 #
 
 /**
  * \file data_loader.cc is the main entry of loader.
- * It starts a MPI job to create local Shards on each worker. The Shard is in
- * fact instanitated with kAppend mode to avoid repeating insertion due to
- * crashes. Data (e.g., images) is in local shard_folder.
+ * It creates a local Shard on one node, which is run on every worker node to
+ * create their own shards. The Shard is in fact instanitated with kAppend mode
+ * to avoid repeating insertion due to crashes. Data (e.g., images) is in local
+ * shard_folder. The position of the data source reached so far is appended
+ * to the progress file of shard_folder, from which a restarted loader resumes.
+ *
+ * If the data source supports random access (e.g., ImageNet), records are
+ * read, resized and mean-subtracted by nthreads threads and inserted in order
+ * by one writer, hence the shard is the same for any num of threads. With
+ * shuffle, records are inserted in a random order decided by seed.
  *
  * Aguments mean, width, and height are specifc for the ImageNet dataset and
  * are required to create the ImageNetSource obj.
+ *
+ * With manifest and input, it writes the manifest of the input shards instead
+ * of creating a shard. Workers read their partitions from the manifest
+ * directly, hence the shards need not be split (which copies all records)
+ * when the num of workers changes.
+ *
+ * With dense, it creates a shard::TensorShard of the image tensors and labels
+ * instead, which is read by TensorDataLayer without parsing Records. All
+ * images must have the same shape.
+ *
+ * With verify, it checks the tuples of the shard (in parallel by nthreads
+ * threads) and reports the corrupted ones, which exits with non-zero status.
+ *
+ * With stats and input, it computes the mean image, the per-channel mean and
+ * std and the label histogram of the input shards in one pass (by nthreads
+ * threads per shard). The mean image is written as a BlobProto, which is
+ * read by ImageNetSource (mean) and RGBImageLayer (RGBImage::meanfile).
  */
 
 DEFINE_string(datasource, "mnist", "datasource type");
 DEFINE_string(imagefile, "train-images-idx3-ubyte", "image file");
 DEFINE_string(labelfile, "train-labels-idx1-ubyte", "label file");
 DEFINE_string(shard_folder, "/data1/wangwei/lapis/validation/", "shard_folder");
-DEFINE_string(mean, "example/imagenet12/imagenet_mean.binaryproto", "image mean");
+DEFINE_string(mean, "example/imagenet12/imagenet_mean.binaryproto", "image "
+    "mean, empty for raw images");
 DEFINE_int32(width, 256, "resized width");
 DEFINE_int32(height, 256, "resized height");
+DEFINE_string(codec, "", "codec for compressing new shards, e.g., lz; "
+    "empty for raw shards");
+DEFINE_bool(checksum, false, "add checksums to tuples of new shards");
+DEFINE_bool(dense, false, "create a dense tensor shard instead of a shard of "
+    "records");
+DEFINE_string(encoding, "", "image format of encoded records of imagenet, "
+    "e.g., .jpg or .png; empty for raw pixels");
 
 DEFINE_string(mode, "equal", "split into equal size or not");
 DEFINE_int32(n, 0, "num of records or shards");
-DEFINE_string(input, "", "shard to be split, folder");
+DEFINE_string(input, "", "shard to be split, folder; or comma separated "
+    "shard folders for the manifest");
 DEFINE_string(prefix, "", "prefix of result shards, folder");
+DEFINE_string(manifest, "", "manifest file to write for the input shards");
+DEFINE_string(verify, "", "shard folder to verify");
+DEFINE_string(stats, "", "file to write the mean image (BlobProto) of the "
+    "input shards; channel mean/std and label histogram go to this file.txt");
+DEFINE_int32(nthreads, 4, "num of threads for verifying the shard or "
+    "reading records of the data source");
+DEFINE_bool(shuffle, false, "insert records in a random order");
+DEFINE_int32(seed, 0, "random seed for shuffle, keep it for appending to a "
+    "shard created before crashes");
 
 using shard::Shard;
+using shard::TensorShard;
+
+//!< num of records of the data source between positions in the progress file
+const int kProgressFreq=1000;
 
 
 /**
@@ -47,7 +106,9 @@ void Split(int num, std::string input,  std::string prefix){
   CHECK_LT(num, total)<<"the sub shard should be smaller than original shard";
   std::string prefix0=prefix+"-0";
   mkdir(prefix0.c_str(),  S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-  Shard shard0(prefix0, Shard::kAppend);
+  Shard shard0(prefix0, Shard::kAppend, 104857600, FLAGS_codec,
+      FLAGS_checksum);
+  shard0.StartFlusher();
   for(int i=0;i<num;i++){
     std::string key, val;
     CHECK(origin.Next(&key, &val));
@@ -58,7 +119,9 @@ void Split(int num, std::string input,  std::string prefix){
 
   std::string prefix1=prefix+"-1";
   mkdir(prefix1.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-  Shard shard1(prefix1, Shard::kAppend);
+  Shard shard1(prefix1, Shard::kAppend, 104857600, FLAGS_codec,
+      FLAGS_checksum);
+  shard1.StartFlusher();
   for(int i=num;i<total;i++){
     std::string key, val;
     CHECK(origin.Next(&key, &val));
@@ -81,7 +144,9 @@ void SplitN(int nshards, std::string input, std::string prefix){
   for(int i=0;i<nshards;i++){
     std::string path=prefix+"-"+std::to_string(i);
     mkdir(path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    Shard shardi(path, Shard::kAppend);
+    Shard shardi(path, Shard::kAppend, 104857600, FLAGS_codec,
+      FLAGS_checksum);
+    shardi.StartFlusher();
     int num=total/nshards+(i==0?total%nshards:0);
     for(int k=0;k<num;k++){
     std::string key, val;
@@ -93,12 +158,392 @@ void SplitN(int nshards, std::string input, std::string prefix){
   }
 }
 
+/**
+  * Verify the tuples of the shard, each thread reads one range of tuples.
+  * @param folder shard folder
+  * @param nthreads num of threads
+  * @return num of corrupted tuples
+  */
+int Verify(std::string folder, int nthreads){
+  int total=Shard(folder, Shard::kRead).Count();
+  LOG(ERROR)<<"Verifying "<<total<<" records by "<<nthreads<<" threads";
+  std::vector<int> corrupted(nthreads, 0);
+  std::vector<std::thread> threads;
+  for(int t=0;t<nthreads;t++){
+    threads.push_back(std::thread([&, t](){
+      int begin=static_cast<int64_t>(total)*t/nthreads;
+      int end=static_cast<int64_t>(total)*(t+1)/nthreads;
+      Shard shard(folder, Shard::kMmap);
+      shard.Seek(begin);
+      std::string key;
+      const char* val;
+      int vallen, nread=0;
+      // the tuple read by Next() is at begin+nread+ncorrupted, which may be
+      // beyond end after skipping corrupted tuples
+      while(begin+nread+shard.ncorrupted()<end
+          &&shard.Next(&key, &val, &vallen)
+          &&begin+nread+shard.ncorrupted()<end)
+        nread++;
+      corrupted[t]=end-begin-nread;
+    }));
+  }
+  int ncorrupted=0;
+  for(int t=0;t<nthreads;t++){
+    threads[t].join();
+    ncorrupted+=corrupted[t];
+  }
+  LOG(ERROR)<<ncorrupted<<" of "<<total<<" records are corrupted";
+  return ncorrupted;
+}
+/**
+  * Sums of images and labels of a range of records.
+  */
+struct ImageStats {
+  int64_t count=0;
+  //!< sum of every element of the images
+  std::vector<double> sum;
+  //!< sum and squared sum of the elements of every channel
+  std::vector<double> channel_sum, channel_sqsum;
+  //!< num of records of every label
+  std::map<int, int64_t> labels;
+
+  ImageStats(int dim, int channels): sum(dim, 0), channel_sum(channels, 0),
+    channel_sqsum(channels, 0){}
+  void Merge(const ImageStats& other){
+    count+=other.count;
+    for(size_t i=0;i<sum.size();i++)
+      sum[i]+=other.sum[i];
+    for(size_t c=0;c<channel_sum.size();c++){
+      channel_sum[c]+=other.channel_sum[c];
+      channel_sqsum[c]+=other.channel_sqsum[c];
+    }
+    for(auto& entry: other.labels)
+      labels[entry.first]+=entry.second;
+  }
+};
+
+/**
+  * @return shape of the image as {channels, height, width}, channels is 1 for
+  * 2D shapes; encoded images without shape are decoded for the shape
+  */
+std::vector<int> ImageShape(const singa::SingleLabelImageRecord& image){
+  std::vector<int> shape(image.shape().begin(), image.shape().end());
+  if(shape.size()==2)
+    shape.insert(shape.begin(), 1);
+  if(shape.size()!=3&&image.encoded()){
+    cv::Mat buf(1, image.pixel().size(), CV_8UC1,
+        const_cast<char*>(image.pixel().data()));
+    cv::Mat img=cv::imdecode(buf, cv::IMREAD_ANYCOLOR);
+    CHECK(!img.empty())<<"Cannot decode the image";
+    shape={img.channels()==1?1:3, img.rows, img.cols};
+  }
+  CHECK_EQ(shape.size(), 3)<<"Records are not images";
+  return shape;
+}
+
+/**
+  * Add the image of the record to stats. Encoded images are decoded (and
+  * resized to shape) as by ImageDecoder of data layers.
+  * @param scratch decoded and resized images, reused across records
+  */
+void AddImage(const singa::SingleLabelImageRecord& image,
+    const std::vector<int>& shape, cv::Mat* scratch, ImageStats* stats){
+  int channels=shape[0], area=shape[1]*shape[2];
+  auto add=[&](int i, double x){
+    stats->sum[i]+=x;
+    stats->channel_sum[i/area]+=x;
+    stats->channel_sqsum[i/area]+=x*x;
+  };
+  if(image.encoded()){
+    cv::Mat buf(1, image.pixel().size(), CV_8UC1,
+        const_cast<char*>(image.pixel().data()));
+    cv::imdecode(buf, channels==1?cv::IMREAD_GRAYSCALE:cv::IMREAD_COLOR,
+        &scratch[0]);
+    CHECK(!scratch[0].empty())<<"Cannot decode the image";
+    const cv::Mat* img=&scratch[0];
+    if(img->rows!=shape[1]||img->cols!=shape[2]){
+      cv::resize(scratch[0], scratch[1], cv::Size(shape[2], shape[1]));
+      img=&scratch[1];
+    }
+    for(int h=0;h<shape[1];h++){
+      const uint8_t* row=img->ptr(h);
+      for(int w=0;w<shape[2];w++)
+        for(int c=0;c<channels;c++)
+          add((c*shape[1]+h)*shape[2]+w, row[w*channels+c]);
+    }
+  }else if(image.pixel().size()){
+    CHECK_EQ(image.pixel().size(), stats->sum.size())
+      <<"Images are of different shapes";
+    const uint8_t* pixel=reinterpret_cast<const uint8_t*>(image.pixel().data());
+    for(size_t i=0;i<stats->sum.size();i++)
+      add(i, pixel[i]);
+  }else{
+    CHECK_EQ(image.data_size(), stats->sum.size())
+      <<"Images are of different shapes";
+    for(size_t i=0;i<stats->sum.size();i++)
+      add(i, image.data(i));
+  }
+  stats->labels[image.label()]++;
+  stats->count++;
+}
+
+/**
+  * Compute the statistics of the images of the shards in one pass, every
+  * shard is read by nthreads threads, each reading one range of tuples.
+  * The mean image is written to file as a BlobProto of shape {1, channels,
+  * height, width}; the channel mean/std and label histogram to file.txt.
+  * @param folders shard folders
+  */
+void Stats(const std::vector<std::string>& folders, std::string file,
+    int nthreads){
+  std::vector<int> shape;
+  {
+    Shard shard(folders[0], Shard::kRead);
+    std::string key;
+    singa::Record record;
+    CHECK(shard.Next(&key, &record))<<"Empty shard "<<folders[0];
+    shape=ImageShape(record.image());
+  }
+  int dim=shape[0]*shape[1]*shape[2];
+  ImageStats total(dim, shape[0]);
+  for(auto& folder: folders){
+    int count=Shard(folder, Shard::kRead).Count();
+    LOG(ERROR)<<"Computing stats of "<<count<<" records of "<<folder<<" by "
+      <<nthreads<<" threads";
+    std::vector<ImageStats> stats(nthreads, ImageStats(dim, shape[0]));
+    std::vector<std::thread> threads;
+    for(int t=0;t<nthreads;t++){
+      threads.push_back(std::thread([&, t](){
+        int begin=static_cast<int64_t>(count)*t/nthreads;
+        int end=static_cast<int64_t>(count)*(t+1)/nthreads;
+        Shard shard(folder, Shard::kMmap);
+        shard.Seek(begin);
+        std::string key;
+        const char* val;
+        int vallen, nread=0;
+        singa::Record record;
+        cv::Mat scratch[2];
+        // see Verify() for skipping corrupted tuples
+        while(begin+nread+shard.ncorrupted()<end
+            &&shard.Next(&key, &val, &vallen)
+            &&begin+nread+shard.ncorrupted()<end){
+          CHECK(record.ParseFromArray(val, vallen))<<"Invalid record "<<key;
+          AddImage(record.image(), shape, scratch, &stats[t]);
+          nread++;
+        }
+      }));
+    }
+    for(int t=0;t<nthreads;t++){
+      threads[t].join();
+      total.Merge(stats[t]);
+    }
+  }
+  CHECK_GT(total.count, 0)<<"No record";
+
+  singa::BlobProto mean;
+  mean.set_num(1);
+  mean.set_channels(shape[0]);
+  mean.set_height(shape[1]);
+  mean.set_width(shape[2]);
+  for(double x: total.sum)
+    mean.add_data(x/total.count);
+  std::ofstream out(file, std::ios::out|std::ios::binary);
+  CHECK(mean.SerializeToOstream(&out))<<"Cannot write "<<file;
+  out.close();
+
+  std::ofstream txt(file+".txt");
+  txt<<"records "<<total.count<<"\n";
+  double n=static_cast<double>(total.count)*shape[1]*shape[2];
+  for(int c=0;c<shape[0];c++){
+    double avg=total.channel_sum[c]/n;
+    double std=sqrt(std::max(0.0, total.channel_sqsum[c]/n-avg*avg));
+    txt<<"channel "<<c<<" mean "<<avg<<" std "<<std<<"\n";
+    LOG(ERROR)<<"Channel "<<c<<" mean "<<avg<<" std "<<std;
+  }
+  for(auto& entry: total.labels)
+    txt<<"label "<<entry.first<<" "<<entry.second<<"\n";
+  LOG(ERROR)<<"Wrote the mean image of "<<total.count<<" records of "
+    <<total.labels.size()<<" labels to "<<file;
+}
+
+/**
+  * @return the position of the data source to resume inserting records from,
+  * i.e., the last position in the progress file whose num of tuples is at
+  * most count, the num of tuples of the shard; 0 if there is none. Records
+  * before the position are in the shard or failed to be read.
+  * @param file progress file of lines of position and num of tuples
+  */
+int ResumePosition(const std::string& file, int count){
+  std::ifstream in(file);
+  std::string line;
+  int start=0;
+  // the last line may be incomplete due to crashes
+  while(std::getline(in, line)&&!in.eof()){
+    std::istringstream ss(line);
+    int pos, ntuples;
+    if(ss>>pos>>ntuples&&ntuples<=count)
+      start=pos;
+  }
+  return start;
+}
+
+/**
+  * Run func on the records of the source in order (or in the random order of
+  * seed if shuffle), skipping the first start ones.
+  *
+  * If the source supports random access and nthreads>1, records are read by
+  * nthreads threads concurrently into a window of slots, while func is run by
+  * the calling thread on the records in order; threads wait if the record is
+  * beyond the window, which bounds the memory. Otherwise records are read by
+  * NextRecord on the calling thread.
+  * @param func called with the position in the order, the key and the record;
+  * records failed to be read are skipped
+  */
+void ForEachRecord(DataSource* source, int start, int nthreads, bool shuffle,
+    int seed, const std::function<void(int, const std::string&,
+      const singa::Record&)>& func){
+  int size=source->size();
+  std::vector<int> order(size);
+  for(int i=0;i<size;i++)
+    order[i]=i;
+  if(shuffle){
+    std::mt19937 rng(seed);
+    std::shuffle(order.begin(), order.end(), rng);
+  }
+  CHECK(!shuffle||source->random_access())<<"Cannot shuffle records of "
+    <<source->name();
+  if(nthreads<=1||!source->random_access()){
+    std::string key;
+    singa::Record record;
+    for(int i=0;i<size;i++){
+      if(source->random_access()){
+        if(i>=start&&source->GetRecord(order[i], &key, &record))
+          func(i, key, record);
+      }else if(source->NextRecord(&key, &record)&&i>=start){
+        func(i, key, record);
+      }
+    }
+    return;
+  }
+
+  struct Slot {
+    std::string key;
+    singa::Record record;
+    bool ready=false, ok=false;
+  };
+  // records [next_write, next_write+window) are being read or ready
+  const int window=nthreads*16;
+  std::vector<Slot> slots(window);
+  int next_read=start, next_write=start;
+  std::mutex mtx;
+  std::condition_variable read_cv, write_cv;
+  std::vector<std::thread> threads;
+  for(int t=0;t<nthreads;t++){
+    threads.push_back(std::thread([&](){
+      std::unique_lock<std::mutex> lck(mtx);
+      while(true){
+        while(next_read<size&&next_read>=next_write+window)
+          read_cv.wait(lck);
+        if(next_read>=size)
+          return;
+        int i=next_read++;
+        Slot& slot=slots[i%window];
+        lck.unlock();
+        slot.record.Clear();
+        slot.ok=source->GetRecord(order[i], &slot.key, &slot.record);
+        lck.lock();
+        slot.ready=true;
+        write_cv.notify_one();
+      }
+    }));
+  }
+  for(int i=start;i<size;i++){
+    Slot& slot=slots[i%window];
+    {
+      std::unique_lock<std::mutex> lck(mtx);
+      while(!slot.ready)
+        write_cv.wait(lck);
+    }
+    if(slot.ok)
+      func(i, slot.key, slot.record);
+    {
+      std::unique_lock<std::mutex> lck(mtx);
+      slot.ready=false;
+      next_write++;
+    }
+    read_cv.notify_all();
+  }
+  for(auto& th: threads)
+    th.join();
+}
+
+/**
+  * Insert the images of the source into a TensorShard. The shape and the
+  * element type (uint8 for pixel, float for data) are from the first record.
+  * Records inserted before (e.g., before crashes) are skipped.
+  * @param source data source
+  * @param folder tensor shard folder
+  */
+void CreateTensorShard(DataSource* source, std::string folder){
+  std::shared_ptr<TensorShard> shard;
+  int nskip=0, count=0;
+  ForEachRecord(source, 0, FLAGS_nthreads, FLAGS_shuffle, FLAGS_seed,
+      [&](int pos, const std::string& key, const singa::Record& record){
+    const singa::SingleLabelImageRecord& image=record.image();
+    bool is_float=image.pixel().size()==0;
+    if(shard==nullptr){
+      std::vector<int> shape(image.shape().begin(), image.shape().end());
+      shard=std::make_shared<TensorShard>(folder, TensorShard::kAppend,
+          is_float?TensorShard::kFloat:TensorShard::kUInt8, shape);
+      count=nskip=shard->Count();
+      LOG(ERROR)<<"Start inserting records into tensor shard, "<<count
+        <<" records were inserted before";
+    }
+    if(nskip>0){
+      nskip--;
+      return;
+    }
+    const char* tensor=is_float
+      ?reinterpret_cast<const char*>(image.data().data()):image.pixel().data();
+    size_t size=is_float?image.data_size()*sizeof(float):image.pixel().size();
+    CHECK_EQ(size, shard->record_size())<<"Image "<<key
+      <<" is of different shape";
+    shard->Insert(tensor, image.label());
+    count++;
+    if(count%100==0)
+      LOG(INFO)<<"Inserted "<<count<<" records, "<<source->size()-count
+        <<" are left";
+  });
+  CHECK(shard!=nullptr)<<"No record is inserted";
+  shard->Flush();
+  LOG(ERROR)<<"Finish creating tensor shard, there are "<<count<<" records";
+}
 
 int main(int argc, char **argv) {
-//  MPI_Init(&argc, &argv);
   google::InitGoogleLogging(argv[0]);
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
+  if(FLAGS_manifest!=""||FLAGS_stats!=""){
+    std::vector<std::string> folders;
+    std::stringstream ss(FLAGS_input);
+    std::string folder;
+    while(std::getline(ss, folder, ','))
+      if(folder.size())
+        folders.push_back(folder);
+    CHECK(folders.size())<<"No input shard";
+    if(FLAGS_stats!=""){
+      Stats(folders, FLAGS_stats, FLAGS_nthreads);
+      return 0;
+    }
+    shard::Dataset::WriteManifest(FLAGS_manifest, folders);
+    LOG(ERROR)<<"Wrote manifest "<<FLAGS_manifest<<" of "<<folders.size()
+      <<" shards";
+    return 0;
+  }
+
+  if(FLAGS_verify!="")
+    return Verify(FLAGS_verify, FLAGS_nthreads)>0;
+
   if(FLAGS_input!=""){
     LOG(ERROR)<<"Splitting shard";
     if(FLAGS_mode=="equal"){
@@ -116,12 +561,21 @@ int main(int argc, char **argv) {
   }else{
     source=new ImageNetSource();
     dynamic_cast<ImageNetSource*>(source)->Init(FLAGS_shard_folder, FLAGS_mean,
-        FLAGS_width, FLAGS_height);
+        FLAGS_width, FLAGS_height, FLAGS_encoding);
   }
 
-  shard::Shard shard(FLAGS_shard_folder, shard::Shard::kAppend);
+  if(FLAGS_dense){
+    CHECK(FLAGS_encoding.empty())<<"Tensor shards store raw pixels only";
+    CreateTensorShard(source, FLAGS_shard_folder);
+    return 0;
+  }
 
-  std::string key, value;
+  shard::Shard shard(FLAGS_shard_folder, shard::Shard::kAppend, 104857600,
+      FLAGS_codec, FLAGS_checksum);
+  // write to disk in background while records are being prepared
+  shard.StartFlusher();
+
+  std::string value;
   int count=shard.Count();
   char hostname[256];
   gethostname(hostname, sizeof(hostname));
@@ -129,10 +583,21 @@ int main(int argc, char **argv) {
   LOG(ERROR)<<host<<" Start inserting records into shard, "
     <<count<<" records were inserted before" ;
 
-  while(!source->eof()){
-    singa::Record record;
-    if(!source->NextRecord(&key, &record))
-      continue;
+  // records are inserted in the same order as before, hence those before the
+  // recorded position are skipped without being read again. The position is
+  // recorded with the num of tuples inserted before it, which may not be
+  // flushed yet, hence it is used only if the shard has as many tuples;
+  // records read again after the position are skipped as duplicated keys.
+  // The progress file is rewritten from the resumed position, dropping lines
+  // torn by crashes
+  std::string progress=FLAGS_shard_folder+"/progress";
+  int start=ResumePosition(progress, count), saved=start;
+  if(start>0)
+    LOG(ERROR)<<host<<" Resume from record "<<start<<" of the data source";
+  std::ofstream out(progress);
+  out<<start<<" "<<count<<std::endl;
+  ForEachRecord(source, start, FLAGS_nthreads, FLAGS_shuffle, FLAGS_seed,
+      [&](int pos, const std::string& key, const singa::Record& record){
     record.SerializeToString(&value);
     if(shard.Insert(key, value)){
       count++;
@@ -140,9 +605,13 @@ int main(int argc, char **argv) {
         LOG(INFO)<<host<<" Inserted "<<count<<" records, "
           <<source->size()-count<<" are left";
     }
-  }
+    if(pos+1>=saved+kProgressFreq){
+      saved=pos+1;
+      out<<saved<<" "<<count<<std::endl;
+    }
+  });
   shard.Flush();
+  out<<source->size()<<" "<<count<<std::endl;
   LOG(ERROR)<<"Finish creating shard, there are "<<count<<" records";
-//  MPI_Finalize();
   return 0;
 }
@@ -94,8 +94,9 @@ void ReadProtoFromBinaryFile(const char* filename, Message* proto) {
   VLOG(3)<<"read binry file";
 }
 
-void ImageNetSource::Init(const string& folder, const string& meanfile, const int width, const int height){
+void ImageNetSource::Init(const string& folder, const string& meanfile, const int width, const int height, const string& encoding){
   size_=0;
+  encoding_=encoding;
   offset_=0;
   width_=width;
   height_=height;
@@ -104,7 +105,8 @@ void ImageNetSource::Init(const string& folder, const string& meanfile, const in
   label_path_=folder+"/rid.txt";
   LoadLabel(label_path_);
   mean_file_=meanfile;
-  LoadMeanFile(mean_file_);
+  if(mean_file_.size())
+    LoadMeanFile(mean_file_);
 }
 void ImageNetSource::LoadLabel(string path){
   LOG(INFO)<<"Loading labels...";
@@ -135,7 +137,7 @@ void ImageNetSource::LoadMeanFile(string path){
 }
 
 int ImageNetSource::ReadImage(const std::string &path, int height, int width,
-    const float *mean, singa::SingleLabelImageRecord* image) {
+    const float *mean, singa::SingleLabelImageRecord* image) const {
   cv::Mat cv_img;
   if (height > 0 && width > 0) {
     cv::Mat cv_img_origin = cv::imread(path, CV_LOAD_IMAGE_COLOR);
@@ -152,7 +154,13 @@ int ImageNetSource::ReadImage(const std::string &path, int height, int width,
   image->add_shape(cv_img.rows);
   image->add_shape(cv_img.cols);
   string *pixel=image->mutable_pixel();
-  if(mean==nullptr){
+  if(encoding_.size()){
+    std::vector<unsigned char> buf;
+    CHECK(cv::imencode(encoding_, cv_img, buf))<<"Cannot encode "<<path
+      <<" as "<<encoding_;
+    pixel->assign(buf.begin(), buf.end());
+    image->set_encoded(true);
+  }else if(mean==nullptr){
     for (int c = 0; c < 3; ++c) {
       for (int h = 0; h < cv_img.rows; ++h) {
         for (int w = 0; w < cv_img.cols; ++w) {
@@ -174,23 +182,19 @@ int ImageNetSource::ReadImage(const std::string &path, int height, int width,
   return 1;
 }
 
-bool ImageNetSource::GetRecord(const int key, singa::Record* record) {
-  if(key<0 || key>=size_)
+bool ImageNetSource::GetRecord(int index, string* key,
+    singa::Record* record) const {
+  if(index<0 || index>=size_)
     return false;
+  record->set_type(singa::Record_Type_kSingleLabelImage);
   singa::SingleLabelImageRecord *image=record->mutable_image();
-  ReadImage(image_folder_ + "/" + lines_.at(key).first, height_,
-            width_, data_mean_.data().data(),image);
-  image->set_label(lines_.at(key).second);
-  return true;
+  *key=lines_.at(index).first;
+  const float* mean=data_mean_.data_size()?data_mean_.data().data():nullptr;
+  int ret=ReadImage(image_folder_ + "/" + *key, height_, width_, mean, image);
+  image->set_label(lines_.at(index).second);
+  return ret;
 }
 
 bool ImageNetSource::NextRecord(string* key, singa::Record *record) {
-  record->set_type(singa::Record_Type_kSingleLabelImage);
-  singa::SingleLabelImageRecord *image=record->mutable_image();
-  *key=lines_.at(offset_).first;
-  int ret=ReadImage(image_folder_ + "/" + *key, height_, width_,
-      data_mean_.data().data(),image);
-  image->set_label(lines_.at(offset_).second);
-  offset_++;
-  return ret;
+  return GetRecord(offset_++, key, record);
 }
@@ -27,6 +27,21 @@ class DataSource {
    * @return true if read succ, false otherwise
    */
   virtual bool NextRecord(string* key, singa::Record *record)=0;
+  /**
+   * Fetch/parse the index-th record without moving offset(). Unlike
+   * NextRecord, it can be called by multiple threads concurrently, e.g., for
+   * loading records in parallel.
+   * @return false if it fails or random_access() is false
+   */
+  virtual bool GetRecord(int index, string* key, singa::Record* record) const {
+    return false;
+  }
+  /**
+   * @return true if records can be fetched by GetRecord
+   */
+  virtual bool random_access() const {
+    return false;
+  }
   /**
    * @return name of this data source
    */
@@ -91,26 +106,33 @@ class ImageNetSource : public DataSource {
    * @folder local shard folder for train/validation/test.It's subdirs/files
    * include img/ for original images; rid.txt for record meta info (image path
    * and label pair); shard.dat, storing parsed records;
-   * @meanfile, mean google protobuf file for the imagenet images
+   * @meanfile, mean google protobuf file for the imagenet images, empty for
+   * raw images, e.g., before computing the mean by data_loader --stats
    * @width, resize images to this width
    * @height, resize images to this height
+   * @encoding, if not empty, e.g., ".jpg" or ".png", (resized) images are
+   * stored encoded in this format instead of raw pixels, and the mean is
+   * not subtracted
    */
   void Init(const string& folder, const string& meanfile,
-      const int width, const int height);
+      const int width, const int height, const string& encoding="");
 
   virtual bool NextRecord(string* key, singa::Record *record);
-
- protected:
   /**
-   * get record at the specific offset
-   * return true if succ, otherwise false
+   * Read the image at the index-th line of rid.txt; it only reads members,
+   * hence multiple threads can read images concurrently.
    */
-  bool GetRecord(const int offset, singa::Record* record);
+  virtual bool GetRecord(int index, string* key, singa::Record* record) const;
+  virtual bool random_access() const {
+    return true;
+  }
+
+ protected:
   /**
    * Read raw image, resize, normalize (substract mean), copy to DAryProto obj
    */
   int ReadImage(const std::string &path, int height, int width,
-      const float *mean, singa::SingleLabelImageRecord* datum);
+      const float *mean, singa::SingleLabelImageRecord* datum) const;
   /**
    * Load meta info file which has image path and label
    */
@@ -131,6 +153,8 @@ class ImageNetSource : public DataSource {
    */
   std::string label_path_;
   std::string mean_file_;
+  //! image format of encoded records, e.g., ".jpg", empty for raw pixels
+  std::string encoding_;
   /**
    * expected height of the image, assume all images are of the same shape; if
    * the real shape is not the same as the expected, then resize it.